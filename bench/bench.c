@@ -0,0 +1,298 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/chip8.h"
+
+/* Times the engine of the build on a headless chip, one instruction family
+ * at a time, with no UI, timer or execution threads. Every case is placed
+ * in memory and run with chip8_run_batch, so the time of an instruction
+ * includes entering the engine. Each case is timed as a number of samples,
+ * every sample long enough to dwarf the clock, and reported as the mean
+ * time per instruction with a 95% confidence interval. The loop that resets
+ * the program counter between instructions is timed on its own as the
+ * "loop" case.
+ */
+
+#ifndef BENCH_CFLAGS
+#define BENCH_CFLAGS ""
+#endif
+
+#if defined(CHIP8_THREADED_CORE)
+#define BENCH_ENGINE "threaded"
+#elif defined(CHIP8_JIT_CORE)
+#define BENCH_ENGINE "jit"
+#elif defined(CHIP8_PREDECODE_CORE)
+#define BENCH_ENGINE "predecode"
+#else
+#define BENCH_ENGINE "switch"
+#endif
+
+#define BENCH_DEFAULT_SAMPLES 30
+/* The shortest sample, long enough that clock_gettime is noise */
+#define BENCH_SAMPLE_NS 2000000.0
+
+struct bench_case {
+        const char *name;
+        const char *family;
+        /* Executed in this order, then the PC is put back */
+        uint16_t ins[2];
+        uint8_t count;
+        /* Register values, for cases that need them */
+        uint8_t x;
+        uint8_t y;
+        /* Run in the SUPER-CHIP 128x64 mode */
+        uint8_t hires;
+};
+
+static const struct bench_case cases[] = {
+        { "loop", "none", {0}, 0, 0, 0, 0 },
+        { "6XNN", "load", {0x6A42}, 1, 0, 0, 0 },
+        { "7XNN", "load", {0x7A01}, 1, 0, 0, 0 },
+        { "ANNN", "load", {0xA300}, 1, 0, 0, 0 },
+        { "CXNN", "load", {0xCAFF}, 1, 0, 0, 0 },
+        { "8XY0", "alu", {0x8120}, 1, 0x5A, 0xA5, 0 },
+        { "8XY1", "alu", {0x8121}, 1, 0x5A, 0xA5, 0 },
+        { "8XY2", "alu", {0x8122}, 1, 0x5A, 0xA5, 0 },
+        { "8XY3", "alu", {0x8123}, 1, 0x5A, 0xA5, 0 },
+        { "8XY4", "alu", {0x8124}, 1, 0x5A, 0xA5, 0 },
+        { "8XY5", "alu", {0x8125}, 1, 0x5A, 0xA5, 0 },
+        { "8XY6", "alu", {0x8126}, 1, 0x5A, 0xA5, 0 },
+        { "8XY7", "alu", {0x8127}, 1, 0x5A, 0xA5, 0 },
+        { "8XYE", "alu", {0x812E}, 1, 0x5A, 0xA5, 0 },
+        { "3XNN taken", "skip", {0x3110}, 1, 0x10, 0, 0 },
+        { "3XNN", "skip", {0x3111}, 1, 0x10, 0, 0 },
+        { "4XNN taken", "skip", {0x4111}, 1, 0x10, 0, 0 },
+        { "5XY0", "skip", {0x5120}, 1, 0x10, 0x10, 0 },
+        { "9XY0", "skip", {0x9120}, 1, 0x10, 0x10, 0 },
+        /* Key 3 is held */
+        { "EX9E", "skip", {0xE19E}, 1, 0x3, 0, 0 },
+        { "EXA1", "skip", {0xE1A1}, 1, 0x3, 0, 0 },
+        { "1NNN", "flow", {0x1300}, 1, 0, 0, 0 },
+        { "BNNN", "flow", {0xB300}, 1, 0, 0, 0 },
+        { "2NNN+00EE", "flow", {0x2300, 0x00EE}, 2, 0, 0, 0 },
+        { "00E0", "display", {0x00E0}, 1, 0, 0, 0 },
+        { "DXYF x=0", "display", {0xD12F}, 1, 0, 5, 0 },
+        { "DXYF x=1", "display", {0xD12F}, 1, 1, 5, 0 },
+        { "DXYF x=7", "display", {0xD12F}, 1, 7, 5, 0 },
+        { "DXYF x=8", "display", {0xD12F}, 1, 8, 5, 0 },
+        { "DXYF x=60", "display", {0xD12F}, 1, 60, 5, 0 },
+        { "DXYF x=63", "display", {0xD12F}, 1, 63, 5, 0 },
+        { "DXY1 x=3", "display", {0xD121}, 1, 3, 5, 0 },
+        { "DXY0 x=60", "display", {0xD120}, 1, 60, 5, 0 },
+        { "DXYF x=100 hires", "display", {0xD12F}, 1, 100, 5, 1 },
+        { "DXY0 x=60 hires", "display", {0xD120}, 1, 60, 5, 1 },
+        /* The display is full for these, see prepare */
+        { "00FB+00FC", "scroll", {0x00FB, 0x00FC}, 2, 0, 0, 0 },
+        { "00FB+00FC hires", "scroll", {0x00FB, 0x00FC}, 2, 0, 0, 1 },
+        { "00C1+DXYF", "scroll", {0x00C1, 0xD12F}, 2, 0, 0, 0 },
+        { "00C1+DXYF hires", "scroll", {0x00C1, 0xD12F}, 2, 0, 0, 1 },
+        { "FX07", "timer", {0xF107}, 1, 0, 0, 0 },
+        { "FX15", "timer", {0xF115}, 1, 0, 0, 0 },
+        { "FX18", "timer", {0xF118}, 1, 0, 0, 0 },
+        { "FX1E", "memory", {0xF11E}, 1, 0, 0, 0 },
+        { "FX29", "memory", {0xF129}, 1, 0xA, 0, 0 },
+        { "FX33", "memory", {0xF133}, 1, 0xFE, 0, 0 },
+        { "F355", "memory", {0xF355}, 1, 0, 0, 0 },
+        { "FF55", "memory", {0xFF55}, 1, 0, 0, 0 },
+        { "F365", "memory", {0xF365}, 1, 0, 0, 0 },
+        { "FF65", "memory", {0xFF65}, 1, 0, 0, 0 },
+};
+
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+struct bench_result {
+        double mean;
+        double stddev;
+        double median;
+        double ci95;
+        uint64_t iterations;
+};
+
+static double now_ns(void){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Puts the chip back in the state every case starts from. Each
+ * instruction of the case is written to memory where the PC is when it
+ * runs, which running it once finds */
+static void prepare(struct mState *ms, const struct bench_case *c){
+        if(ms->hires != c->hires)
+                run_instruction(ms, c->hires ? 0x00FF : 0x00FE);
+        ms->pc = 0x200;
+        ms->stackSize = 0;
+        for(int k = 0; k < c->count; k++){
+                ms->mem[ms->pc] = c->ins[k] >> 8;
+                ms->mem[ms->pc + 1] = c->ins[k] & 0xFF;
+                run_instruction(ms, c->ins[k]);
+        }
+        ms->pc = 0x200;
+        ms->stackSize = 0;
+        ms->registers[1] = c->x;
+        ms->registers[2] = c->y;
+        ms->keys[0x3] = 1;
+        ms->iRegister = 0x400;
+        for(int i = 0; i < 32; i++)
+                ms->mem[0x400 + i] = 0xA5 ^ (i * 0x11);
+        decode_invalidate_all(ms);
+        if(strcmp(c->family, "scroll") == 0){
+                int height = c->hires ? CHIP8_LINES : CHIP8_LINES / 2;
+                for(int y = 0; y < height; y++){
+                        ms->disp[y][0] = 0x5A5A5A5A5A5A5A5AULL;
+                        ms->disp[y][1] = c->hires ? 0xA5A5A5A5A5A5A5A5ULL : 0;
+                }
+        }
+}
+
+/* Runs the case n times, returning the time taken in ns. I is put back
+ * along with the PC, so FX1E, FX55 and FX65 do not walk through memory */
+static double run(struct mState *ms, const struct bench_case *c, uint64_t n){
+        double start = now_ns();
+        for(uint64_t i = 0; i < n; i++){
+                chip8_run_batch(ms, c->count);
+                ms->pc = 0x200;
+                ms->iRegister = 0x400;
+        }
+        return now_ns() - start;
+}
+
+static int compare_double(const void *a, const void *b){
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+/* Student's t for a two sided 95% interval, by degrees of freedom */
+static double t95(int df){
+        static const double t[] = { 0, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45,
+                2.36, 2.31, 2.26, 2.23, 2.20, 2.18, 2.16, 2.14, 2.13, 2.12,
+                2.11, 2.10, 2.09, 2.09, 2.08, 2.07, 2.07, 2.06, 2.06, 2.06,
+                2.05, 2.05, 2.05, 2.04 };
+        if(df < 1) return 0;
+        return (df <= 30) ? t[df] : 1.96;
+}
+
+static void measure(struct mState *ms, const struct bench_case *c, int samples, struct bench_result *r){
+        double *ns = malloc(samples * sizeof(double));
+        int ops = (c->count != 0) ? c->count : 1;
+        uint64_t n = 1024;
+
+        prepare(ms, c);
+        /* Grow the sample until it takes long enough, which also warms
+         * the caches, and the branch predictors */
+        while(run(ms, c, n) < BENCH_SAMPLE_NS && n < (1ULL << 32))
+                n *= 2;
+        for(int s = 0; s < samples; s++)
+                ns[s] = run(ms, c, n) / (n * ops);
+
+        double sum = 0, sq = 0;
+        for(int s = 0; s < samples; s++)
+                sum += ns[s];
+        r->mean = sum / samples;
+        for(int s = 0; s < samples; s++)
+                sq += (ns[s] - r->mean) * (ns[s] - r->mean);
+        r->stddev = (samples > 1) ? sqrt(sq / (samples - 1)) : 0;
+        r->ci95 = t95(samples - 1) * r->stddev / sqrt(samples);
+        qsort(ns, samples, sizeof(double), compare_double);
+        r->median = (samples % 2) ? ns[samples / 2] : (ns[samples / 2 - 1] + ns[samples / 2]) / 2;
+        r->iterations = n;
+        free(ns);
+}
+
+void usage(char *argv[]){
+        printf("%s [-n samples] [-f filter] [-c csv]\n", argv[0]);
+        printf("  -n N  time each case N times, %d by default\n", BENCH_DEFAULT_SAMPLES);
+        printf("  -f S  only run cases whose name, or family, contains S\n");
+        printf("  -c F  append the results to F as CSV, for comparing builds\n");
+}
+
+int main(int argc, char *argv[]){
+        int samples = BENCH_DEFAULT_SAMPLES;
+        char *filter = NULL;
+        char *csvPath = NULL;
+        FILE *csv = NULL;
+        int opt;
+
+        while((opt = getopt(argc, argv, "n:f:c:h")) != -1){
+                switch(opt){
+                        case 'n':
+                                samples = atoi(optarg);
+                                break;
+                        case 'f':
+                                filter = optarg;
+                                break;
+                        case 'c':
+                                csvPath = optarg;
+                                break;
+                        default:
+                                usage(argv);
+                                return (opt == 'h') ? 0 : -1;
+                }
+        }
+        if(samples < 2){
+                fprintf(stderr, "At least 2 samples are needed\n");
+                return -1;
+        }
+
+        struct mState *ms = chip8_init_headless();
+        if(ms == NULL){
+                fprintf(stderr, "Failed to create the chip8\n");
+                return -1;
+        }
+        chip8_seed(ms, 1);
+
+        if(csvPath != NULL){
+                csv = fopen(csvPath, "a");
+                if(csv == NULL){
+                        fprintf(stderr, "Could not open \"%s\"\n", csvPath);
+                        chip8_destroy(&ms);
+                        return -1;
+                }
+                /* A header for a new file only */
+                if(ftell(csv) == 0)
+                        fprintf(csv, "time,engine,cflags,case,family,ns_per_op,ci95,stddev,median,samples,iterations\n");
+        }
+
+        time_t started = time(NULL);
+        printf("engine: %s, cflags: %s, %d samples a case\n", BENCH_ENGINE, BENCH_CFLAGS, samples);
+        printf("%-12s %-8s %10s %8s %10s\n", "case", "family", "ns/op", "+-95%", "median");
+        for(size_t i = 0; i < CASES; i++){
+                const struct bench_case *c = &cases[i];
+                struct bench_result r;
+                if(filter != NULL && strstr(c->name, filter) == NULL && strstr(c->family, filter) == NULL)
+                        continue;
+                measure(ms, c, samples, &r);
+                printf("%-12s %-8s %10.2f %8.2f %10.2f\n", c->name, c->family, r.mean, r.ci95, r.median);
+                if(csv != NULL)
+                        fprintf(csv, "%ld,%s,\"%s\",%s,%s,%.3f,%.3f,%.3f,%.3f,%d,%lu\n",
+                                        (long) started, BENCH_ENGINE, BENCH_CFLAGS, c->name,
+                                        c->family, r.mean, r.ci95, r.stddev, r.median,
+                                        samples, r.iterations);
+        }
+
+        if(csv != NULL)
+                fclose(csv);
+        chip8_destroy(&ms);
+        return 0;
+}
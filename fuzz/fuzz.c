@@ -0,0 +1,357 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/chip8.h"
+
+/* Runs machine states and instruction streams built from fuzzer input
+ * through two chips in lockstep: a reference that executes every
+ * instruction with the switch in run_instruction, and one running the
+ * engine the harness was built with, from the predecoded cache in the
+ * default build. The chips are compared after every batch, and the first
+ * difference aborts with a report, so crashes, sanitizer errors and
+ * engines that disagree with the reference all show up as findings.
+ *
+ * Built with fuzzer=libfuzzer this file only provides
+ * LLVMFuzzerTestOneInput, otherwise it has a driver of its own that runs
+ * files given on the command line, such as crashes saved by libFuzzer, or
+ * random inputs.
+ */
+
+#if defined(CHIP8_THREADED_CORE)
+#define FUZZ_ENGINE "threaded"
+#elif defined(CHIP8_JIT_CORE)
+#define FUZZ_ENGINE "jit"
+#else
+#define FUZZ_ENGINE "predecode"
+#endif
+
+/* Layout of an input, anything missing is zero. The rest of the input is
+ * the program, copied to memory from the PC on, wrapping at the end */
+#define FUZZ_REGISTERS 0
+#define FUZZ_I 16
+#define FUZZ_PC 18
+#define FUZZ_DELAY 20
+#define FUZZ_SOUND 21
+#define FUZZ_RNG 22
+#define FUZZ_KEYS 26
+/* Low 6 bits, the number of return addresses on the stack. Bit 7 set if
+ * a key press is waiting for FX0A, bit 6 the key, 0 or 1 */
+#define FUZZ_STACK 28
+/* Instructions the engine runs between comparisons, 1 to 64 */
+#define FUZZ_BATCH 29
+#define FUZZ_HEADER 30
+
+/* Instructions run for each input, at most */
+#define FUZZ_MAX_STEPS 512
+/* Largest input worth generating, a header and a program filling memory */
+#define FUZZ_MAX_INPUT (FUZZ_HEADER + 4096)
+
+static struct mState *reference;
+static struct mState *engine;
+/* Memory of a new chip, holding nothing but the font */
+static uint8_t fresh[4096];
+/* The input being run, saved by the driver when it finds something */
+static const uint8_t *current;
+static size_t currentSize;
+
+static uint8_t byte_at(const uint8_t *data, size_t size, size_t i){
+        return (i < size) ? data[i] : 0;
+}
+
+/* Puts a chip in the state the input describes */
+static void load(struct mState *ms, const uint8_t *data, size_t size){
+        for(int i = 0; i < 16; i++)
+                ms->registers[i] = byte_at(data, size, FUZZ_REGISTERS + i);
+        /* All 16 bits, so I can start past the end of memory */
+        ms->iRegister = byte_at(data, size, FUZZ_I) << 8 | byte_at(data, size, FUZZ_I + 1);
+        ms->pc = (byte_at(data, size, FUZZ_PC) << 8 | byte_at(data, size, FUZZ_PC + 1)) & 0xFFF;
+        ms->dTimer = byte_at(data, size, FUZZ_DELAY);
+        ms->sTimer = byte_at(data, size, FUZZ_SOUND);
+        uint32_t seed = 0;
+        for(int i = 0; i < 4; i++)
+                seed = seed << 8 | byte_at(data, size, FUZZ_RNG + i);
+        chip8_seed(ms, seed);
+        uint16_t keys = byte_at(data, size, FUZZ_KEYS) << 8 | byte_at(data, size, FUZZ_KEYS + 1);
+        for(int i = 0; i < 16; i++)
+                ms->keys[i] = (keys >> i) & 1;
+
+        uint8_t stack = byte_at(data, size, FUZZ_STACK);
+        ms->stackSize = (stack & 0x3F) % (ms->stackCapacity + 1);
+        for(size_t i = 0; i < ms->stackSize; i++)
+                ms->stack[i] = 0x200 + 2 * i;
+        ms->lastEvent.type = (stack & 0x80) ? Pressed : Released;
+        ms->lastEvent.key = (stack >> 6) & 1;
+        ms->waitingForKey = 0;
+
+        ms->count = 0;
+        memset(ms->disp, 0, sizeof(ms->disp));
+        ms->hires = 0;
+        ms->dirty = 0;
+        memset(ms->rplFlags, 0, sizeof(ms->rplFlags));
+        memcpy(ms->mem, fresh, sizeof(ms->mem));
+        for(size_t i = FUZZ_HEADER; i < size && i < FUZZ_HEADER + sizeof(ms->mem); i++)
+                ms->mem[(ms->pc + i - FUZZ_HEADER) & 0xFFF] = data[i];
+}
+
+/* Runs up to n instructions with the switch in run_instruction, the way
+ * the default build's chip8_run_batch does. Sets stuck if one of them
+ * left the PC where it was, with no timers or keys to change anything it
+ * will do the same forever */
+static uint64_t reference_run(struct mState *ms, uint64_t n, int *stuck){
+        uint64_t i;
+        for(i = 0; i < n && (uint16_t) ms->pc <= 4094; i++){
+                int16_t pc = ms->pc;
+                run_instruction(ms, ((uint16_t) ms->mem[ms->pc]) << 8 | ms->mem[ms->pc + 1]);
+                ms->count++;
+                if(ms->pc == pc)
+                        *stuck = 1;
+        }
+        return i;
+}
+
+/* Runs up to n instructions with the engine being tested */
+static uint64_t engine_run(struct mState *ms, uint64_t n){
+#if defined(CHIP8_THREADED_CORE) || defined(CHIP8_JIT_CORE)
+        return chip8_run_batch(ms, n);
+#else
+        uint64_t i;
+        for(i = 0; i < n && (uint16_t) ms->pc <= 4094; i++){
+                decode_execute(ms);
+                ms->count++;
+        }
+        return i;
+#endif
+}
+
+static void fail(const char *what, unsigned a, unsigned b){
+        fprintf(stderr, "%s engine differs from the reference after %lu instructions\n",
+                        FUZZ_ENGINE, (unsigned long) reference->count);
+        fprintf(stderr, "%s: reference %x, %s %x\n", what, a, FUZZ_ENGINE, b);
+        fprintf(stderr, "reference:\n");
+        chip8_dump_state(reference, stderr);
+        fprintf(stderr, "%s:\n", FUZZ_ENGINE);
+        chip8_dump_state(engine, stderr);
+#ifndef CHIP8_LIBFUZZER
+        /* libFuzzer saves the input itself */
+        FILE *fp = fopen("fuzz-finding", "wb");
+        if(fp != NULL){
+                fwrite(current, 1, currentSize, fp);
+                fclose(fp);
+                fprintf(stderr, "input saved to fuzz-finding\n");
+        }
+#endif
+        abort();
+}
+
+/* Compares everything an instruction can change, but memory, which is
+ * only worth comparing once the input has run */
+static void compare(struct mState *r, struct mState *e){
+        char what[48];
+        if(r->count != e->count)
+                fail("count", r->count, e->count);
+        if(r->pc != e->pc)
+                fail("PC", r->pc, e->pc);
+        if(r->iRegister != e->iRegister)
+                fail("I", r->iRegister, e->iRegister);
+        for(int i = 0; i < 16; i++){
+                if(r->registers[i] != e->registers[i]){
+                        snprintf(what, sizeof(what), "V%X", i);
+                        fail(what, r->registers[i], e->registers[i]);
+                }
+        }
+        if(r->stackSize != e->stackSize)
+                fail("stack size", r->stackSize, e->stackSize);
+        for(size_t i = 0; i < r->stackSize; i++){
+                if(r->stack[i] != e->stack[i]){
+                        snprintf(what, sizeof(what), "stack[%zu]", i);
+                        fail(what, r->stack[i], e->stack[i]);
+                }
+        }
+        if(r->dTimer != e->dTimer)
+                fail("delay timer", r->dTimer, e->dTimer);
+        if(r->sTimer != e->sTimer)
+                fail("sound timer", r->sTimer, e->sTimer);
+        if(r->rngState != e->rngState)
+                fail("RNG", r->rngState, e->rngState);
+        if(r->waitingForKey != e->waitingForKey)
+                fail("waiting for key", r->waitingForKey, e->waitingForKey);
+        if(r->hires != e->hires)
+                fail("high resolution", r->hires, e->hires);
+        for(int y = 0; y < CHIP8_LINES; y++){
+                for(int w = 0; w < 2; w++){
+                        if(r->disp[y][w] != e->disp[y][w]){
+                                snprintf(what, sizeof(what), "line %d word %d", y, w);
+                                fail(what, r->disp[y][w] >> 32, e->disp[y][w] >> 32);
+                        }
+                }
+        }
+        if((uint32_t) r->dirty != (uint32_t) e->dirty)
+                fail("dirty lines 0-31", r->dirty, e->dirty);
+        if(r->dirty >> 32 != e->dirty >> 32)
+                fail("dirty lines 32-63", r->dirty >> 32, e->dirty >> 32);
+        if(memcmp(r->rplFlags, e->rplFlags, sizeof(r->rplFlags)) != 0)
+                fail("flags", r->rplFlags[0], e->rplFlags[0]);
+}
+
+static void compare_memory(struct mState *r, struct mState *e){
+        char what[32];
+        if(memcmp(r->mem, e->mem, sizeof(r->mem)) != 0){
+                for(int i = 0; i < 4096; i++){
+                        if(r->mem[i] != e->mem[i]){
+                                snprintf(what, sizeof(what), "mem[%03x]", i);
+                                fail(what, r->mem[i], e->mem[i]);
+                        }
+                }
+        }
+}
+
+static int fuzz_init(void){
+        reference = chip8_init_headless();
+        engine = chip8_init_headless();
+        if(reference == NULL || engine == NULL){
+                fprintf(stderr, "Failed to create the chip8\n");
+                return -1;
+        }
+        memcpy(fresh, reference->mem, sizeof(fresh));
+        return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+        if(reference == NULL && fuzz_init() != 0)
+                abort();
+        current = data;
+        currentSize = size;
+        load(reference, data, size);
+        load(engine, data, size);
+        /* Everything, so a finding never depends on the inputs before it.
+         * The reference has no use for the cache */
+        decode_invalidate_all(engine);
+        uint64_t batch = byte_at(data, size, FUZZ_BATCH) % 64 + 1;
+        int stuck = 0;
+
+        while(reference->count < FUZZ_MAX_STEPS){
+                uint64_t ran = engine_run(engine, batch);
+                reference_run(reference, ran, &stuck);
+                compare(reference, engine);
+                if(stuck)
+                        break;
+                /* Stopped early by the PC leaving memory, the reference
+                 * must agree it had to stop */
+                if(ran < batch){
+                        if(reference_run(reference, 1, &stuck) != 0)
+                                fail("ran past the end", reference->pc, engine->pc);
+                        break;
+                }
+        }
+        compare_memory(reference, engine);
+        return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+static uint32_t rngState = 1;
+
+static uint32_t next_random(void){
+        rngState ^= rngState << 13;
+        rngState ^= rngState >> 17;
+        rngState ^= rngState << 5;
+        return rngState;
+}
+
+/* Runs one input from a file */
+static int run_file(const char *path, uint8_t *buf){
+        FILE *fp = fopen(path, "rb");
+        if(fp == NULL){
+                fprintf(stderr, "Could not open \"%s\"\n", path);
+                return -1;
+        }
+        size_t size = fread(buf, 1, FUZZ_MAX_INPUT, fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, size);
+        return 0;
+}
+
+void usage(char *argv[]){
+        printf("%s [-n inputs] [-s seed] [file...]\n", argv[0]);
+        printf("  -n N  run N random inputs, 1000000 by default\n");
+        printf("  -s N  seed the random inputs with N\n");
+        printf("  files are run once each instead, to reproduce a finding\n");
+        printf("differences from the reference are saved to fuzz-finding, for\n");
+        printf("sanitizer errors run the same seed again under a debugger\n");
+}
+
+int main(int argc, char *argv[]){
+        uint64_t inputs = 1000000;
+        uint32_t seed = time(NULL);
+        int opt;
+
+        while((opt = getopt(argc, argv, "n:s:h")) != -1){
+                switch(opt){
+                        case 'n':
+                                inputs = strtoull(optarg, NULL, 0);
+                                break;
+                        case 's':
+                                seed = strtoul(optarg, NULL, 0);
+                                break;
+                        default:
+                                usage(argv);
+                                return (opt == 'h') ? 0 : -1;
+                }
+        }
+        if(fuzz_init() != 0)
+                return -1;
+        uint8_t *buf = malloc(FUZZ_MAX_INPUT);
+        if(buf == NULL)
+                return -1;
+        /* The chips complain about bad instructions on stdout */
+        if(freopen("/dev/null", "w", stdout) == NULL)
+                return -1;
+
+        if(optind < argc){
+                int ret = 0;
+                for(int i = optind; i < argc; i++)
+                        ret |= run_file(argv[i], buf);
+                fprintf(stderr, "%d inputs ran with no findings\n", argc - optind);
+                free(buf);
+                return ret;
+        }
+
+        fprintf(stderr, "%s engine, seed %u\n", FUZZ_ENGINE, seed);
+        rngState = (seed != 0) ? seed : 1;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(uint64_t n = 0; n < inputs; n++){
+                /* Mostly short programs, which run more instructions
+                 * before wandering off into empty memory */
+                size_t size = FUZZ_HEADER + next_random() % ((next_random() & 7) ? 64 : 4096);
+                for(size_t i = 0; i < size; i++)
+                        buf[i] = next_random();
+                LLVMFuzzerTestOneInput(buf, size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%lu inputs, %.0f a second, no findings\n",
+                        (unsigned long) inputs, inputs / secs);
+        free(buf);
+        return 0;
+}
+#endif
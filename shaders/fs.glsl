@@ -1,6 +1,18 @@
 #version 330 core
+in vec2 uv;
 out vec4 fcolor;
-uniform vec4 color;
+/* The Chip-8 display, a line a row of two texels, one for each 64 bit word
+ * split into its low half in r, and its high half in g, with the leftmost
+ * pixel in the top bit of g of the first texel. Low resolution only uses
+ * the first texel of the first 32 rows */
+uniform usampler2D disp;
+/* Set in the SUPER-CHIP 128x64 mode */
+uniform bool hires;
 void main(){
-        fcolor = vec4(1.0, 1.0, 1.0, 1.0);
+        ivec2 size = hires ? ivec2(128, 64) : ivec2(64, 32);
+        ivec2 p = min(ivec2(uv * vec2(size)), size - 1);
+        uvec2 line = texelFetch(disp, ivec2(p.x / 64, p.y), 0).rg;
+        uint bits = (p.x % 64 < 32) ? line.g : line.r;
+        float on = float((bits >> uint(31 - p.x % 32)) & 1u);
+        fcolor = vec4(on, on, on, 1.0);
 }
@@ -1,6 +1,11 @@
 #version 330 core
-layout(location = 0) in vec3 aPos;
+/* Where the fragment is on the display, (0, 0) top left, (1, 1) bottom
+ * right */
+out vec2 uv;
 
 void main(){
-        gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);
+        /* The quad's corners are 0 top left, 1 top right, 2 bottom left and
+         * 3 bottom right, drawn as a triangle strip */
+        uv = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+        gl_Position = vec4(uv.x * 2.0 - 1.0, 0.5 - uv.y, 0.0, 1.0);
 }
@@ -0,0 +1,374 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+#ifdef CHIP8_ALSA
+#include <alsa/asoundlib.h>
+/* Latency asked of ALSA, in us */
+#define AUDIO_ALSA_LATENCY 50000
+#endif
+
+/* Size of a WAV header, and of the samples in it */
+#define WAV_HEADER 44
+#define WAV_BYTES 2
+
+static uint64_t now_ns(void){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns){
+        struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+        nanosleep(&ts, NULL);
+}
+
+/* The null device keeps to the time the samples would take to play */
+struct null_sink {
+        uint64_t due;
+};
+
+static int null_open(struct audio *a, const char *path){
+        (void) path;
+        struct null_sink *n = malloc(sizeof(struct null_sink));
+        if(n == NULL) return -1;
+        n->due = now_ns();
+        a->sink = n;
+        return 0;
+}
+
+static int null_write(struct audio *a, const int16_t *samples, size_t len){
+        (void) samples;
+        struct null_sink *n = a->sink;
+        uint64_t now = now_ns();
+        n->due += len * 1000000000ULL / a->rate;
+        /* A device that fell behind starts over instead of racing */
+        if(n->due < now)
+                n->due = now;
+        else
+                sleep_ns(n->due - now);
+        return 0;
+}
+
+static void null_close(struct audio *a){
+        free(a->sink);
+        a->sink = NULL;
+}
+
+const struct audio_backend audio_null = {"null", null_open, null_write, null_close, 1};
+
+struct wav_sink {
+        FILE *fp;
+        char *path;
+        uint64_t bytes;
+        /* One period of little endian samples */
+        uint8_t *buf;
+};
+
+static void put16(uint8_t *p, uint16_t v){
+        p[0] = v;
+        p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+        put16(p, v);
+        put16(p + 2, v >> 16);
+}
+
+/* The header for bytes of samples */
+static void wav_header(uint8_t *h, uint32_t rate, uint64_t bytes){
+        uint32_t data = (bytes > UINT32_MAX - 36) ? UINT32_MAX - 36 : bytes;
+        memcpy(h, "RIFF", 4);
+        put32(h + 4, 36 + data);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        put32(h + 16, 16);
+        /* PCM, mono */
+        put16(h + 20, 1);
+        put16(h + 22, 1);
+        put32(h + 24, rate);
+        put32(h + 28, rate * WAV_BYTES);
+        put16(h + 32, WAV_BYTES);
+        put16(h + 34, 8 * WAV_BYTES);
+        memcpy(h + 36, "data", 4);
+        put32(h + 40, data);
+}
+
+static int wav_open(struct audio *a, const char *path){
+        uint8_t h[WAV_HEADER];
+        struct wav_sink *w = calloc(1, sizeof(struct wav_sink));
+        if(w == NULL) return -1;
+        w->path = strdup(path);
+        if(w->path == NULL) goto pathFail;
+        w->buf = malloc(a->periodLen * WAV_BYTES);
+        if(w->buf == NULL) goto bufFail;
+        w->fp = fopen(path, "wb");
+        if(w->fp == NULL){
+                fprintf(stderr, "Could not open audio file \"%s\"\n", path);
+                goto fpFail;
+        }
+        /* The sizes are filled in on closing */
+        wav_header(h, a->rate, 0);
+        fwrite(h, 1, WAV_HEADER, w->fp);
+        a->sink = w;
+        return 0;
+fpFail:
+        free(w->buf);
+bufFail:
+        free(w->path);
+pathFail:
+        free(w);
+        return -1;
+}
+
+static int wav_write(struct audio *a, const int16_t *samples, size_t n){
+        struct wav_sink *w = a->sink;
+        for(size_t i = 0; i < n; i++)
+                put16(w->buf + i * WAV_BYTES, samples[i]);
+        if(fwrite(w->buf, WAV_BYTES, n, w->fp) != n){
+                fprintf(stderr, "Could not write audio file \"%s\"\n", w->path);
+                return -1;
+        }
+        w->bytes += n * WAV_BYTES;
+        return 0;
+}
+
+static void wav_close(struct audio *a){
+        uint8_t h[WAV_HEADER];
+        struct wav_sink *w = a->sink;
+        wav_header(h, a->rate, w->bytes);
+        if(fseek(w->fp, 0, SEEK_SET) != 0 || fwrite(h, 1, WAV_HEADER, w->fp) != WAV_HEADER)
+                fprintf(stderr, "Could not write audio file \"%s\"\n", w->path);
+        if(fclose(w->fp) != 0)
+                fprintf(stderr, "Could not write audio file \"%s\"\n", w->path);
+        free(w->buf);
+        free(w->path);
+        free(w);
+        a->sink = NULL;
+}
+
+const struct audio_backend audio_wav = {"wav", wav_open, wav_write, wav_close, 0};
+
+#ifdef CHIP8_ALSA
+static int alsa_open(struct audio *a, const char *path){
+        const char *device = (path != NULL) ? path : "default";
+        snd_pcm_t *pcm;
+        int err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+        if(err < 0){
+                fprintf(stderr, "Could not open audio device \"%s\": %s\n", device, snd_strerror(err));
+                return -1;
+        }
+        err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+                        1, a->rate, 1, AUDIO_ALSA_LATENCY);
+        if(err < 0){
+                fprintf(stderr, "Could not set up audio device \"%s\": %s\n", device, snd_strerror(err));
+                snd_pcm_close(pcm);
+                return -1;
+        }
+        a->sink = pcm;
+        return 0;
+}
+
+static int alsa_write(struct audio *a, const int16_t *samples, size_t n){
+        snd_pcm_t *pcm = a->sink;
+        while(n > 0){
+                snd_pcm_sframes_t w = snd_pcm_writei(pcm, samples, n);
+                if(w < 0){
+                        /* The device ran dry, or was suspended */
+                        if(w == -EPIPE)
+                                atomic_fetch_add(&a->underruns, 1);
+                        if(snd_pcm_recover(pcm, w, 1) < 0)
+                                return -1;
+                        continue;
+                }
+                samples += w;
+                n -= w;
+        }
+        return 0;
+}
+
+static void alsa_close(struct audio *a){
+        snd_pcm_drain(a->sink);
+        snd_pcm_close(a->sink);
+        a->sink = NULL;
+}
+
+const struct audio_backend audio_alsa = {"alsa", alsa_open, alsa_write, alsa_close, 1};
+#endif
+
+static size_t queued(struct audio *a){
+        return atomic_load_explicit(&a->tail, memory_order_acquire) -
+                atomic_load_explicit(&a->head, memory_order_relaxed);
+}
+
+/* Moves up to n samples from the ring to the period */
+static size_t take(struct audio *a, size_t n){
+        size_t head = atomic_load_explicit(&a->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&a->tail, memory_order_acquire);
+        if(tail - head < n)
+                n = tail - head;
+        for(size_t i = 0; i < n; i++)
+                a->period[i] = a->ring[(head + i) & (a->ringLen - 1)];
+        atomic_store_explicit(&a->head, head + n, memory_order_release);
+        return n;
+}
+
+/* Hands the ring's samples to the backend until audio_stop has been called,
+ * and the ring is empty. A real time backend is only started once a tick,
+ * and a period are queued, and again after running dry, so the jitter of
+ * the producer is not heard */
+static void *player(void *data){
+        struct audio *a = (struct audio *) data;
+        size_t prime = a->rate / 60 + a->periodLen;
+        int primed = 0;
+        for(;;){
+                int stopping = atomic_load(&a->stopping);
+                size_t q = queued(a);
+                size_t n;
+                if(stopping && q == 0)
+                        break;
+                if(a->backend->realtime){
+                        if(!primed)
+                                primed = stopping || q >= prime;
+                        n = primed ? take(a, a->periodLen) : 0;
+                        if(primed && n < a->periodLen && !stopping){
+                                atomic_fetch_add(&a->underruns, 1);
+                                primed = 0;
+                        }
+                        memset(a->period + n, 0, (a->periodLen - n) * sizeof(int16_t));
+                        n = a->periodLen;
+                } else {
+                        n = take(a, a->periodLen);
+                        if(n == 0){
+                                sleep_ns(1000000000ULL / AUDIO_PERIOD_HZ);
+                                continue;
+                        }
+                }
+                if(a->backend->write(a, a->period, n) != 0){
+                        atomic_store(&a->failed, 1);
+                        break;
+                }
+                atomic_fetch_add(&a->written, n);
+        }
+        return NULL;
+}
+
+/* Opens the backend at path, and starts feeding it. A rate, or ring
+ * length, of 0 picks the default, the ring is rounded up to a power of
+ * two. Returns
+ * NULL if the backend can not be opened, or the player started */
+struct audio *audio_init(const struct audio_backend *backend, const char *path, uint32_t rate, size_t ringLen){
+        struct audio *a = calloc(1, sizeof(struct audio));
+        if(a == NULL) return NULL;
+        a->backend = backend;
+        a->rate = (rate != 0) ? rate : AUDIO_DEFAULT_RATE;
+        if(ringLen == 0)
+                ringLen = AUDIO_DEFAULT_RING;
+        a->ringLen = 1;
+        while(a->ringLen < ringLen)
+                a->ringLen <<= 1;
+        a->periodLen = a->rate / AUDIO_PERIOD_HZ;
+        if(a->periodLen == 0)
+                a->periodLen = 1;
+        a->step = ((uint64_t) AUDIO_TONE_HZ << 32) / a->rate;
+        atomic_init(&a->head, 0);
+        atomic_init(&a->tail, 0);
+        atomic_init(&a->stopping, 0);
+        atomic_init(&a->samples, 0);
+        atomic_init(&a->written, 0);
+        atomic_init(&a->dropped, 0);
+        atomic_init(&a->underruns, 0);
+        atomic_init(&a->failed, 0);
+        a->ring = calloc(a->ringLen, sizeof(int16_t));
+        if(a->ring == NULL) goto ringFail;
+        a->period = calloc(a->periodLen, sizeof(int16_t));
+        if(a->period == NULL) goto periodFail;
+        if(backend->open(a, path) != 0)
+                goto openFail;
+        if(pthread_create(&a->thread, NULL, player, a) != 0)
+                goto playerFail;
+        return a;
+playerFail:
+        backend->close(a);
+openFail:
+        free(a->period);
+periodFail:
+        free(a->ring);
+ringFail:
+        free(a);
+        return NULL;
+}
+
+/* Plays every queued sample, stops the player, and closes the backend.
+ * Samples added after this are counted as dropped */
+void audio_stop(struct audio *a){
+        if(a->joined) return;
+        atomic_store(&a->stopping, 1);
+        pthread_join(a->thread, NULL);
+        a->backend->close(a);
+        a->joined = 1;
+}
+
+/* Stops playing, see audio_stop, and frees the sink */
+void audio_destroy(struct audio **a){
+        if(*a == NULL) return;
+        audio_stop(*a);
+        free((*a)->period);
+        free((*a)->ring);
+        free(*a);
+        *a = NULL;
+}
+
+/* Adds the samples from the current position up to sample until, the tone
+ * sounding if on is set. Never waits, samples the ring has no room for are
+ * dropped. Only one thread at a time may add samples */
+void audio_render(struct audio *a, uint64_t until, int on){
+        if(until <= a->position)
+                return;
+        uint64_t n = until - a->position;
+        size_t tail = atomic_load_explicit(&a->tail, memory_order_relaxed);
+        size_t room = a->ringLen - (tail - atomic_load_explicit(&a->head, memory_order_acquire));
+        if(atomic_load_explicit(&a->stopping, memory_order_relaxed))
+                room = 0;
+        size_t m = (n < room) ? n : room;
+        /* Every tone starts at the top of the wave */
+        if(on && !a->on)
+                a->phase = 0;
+        a->on = on;
+        for(size_t i = 0; i < m; i++){
+                int16_t s = 0;
+                if(on){
+                        s = (a->phase < 0x80000000u) ? AUDIO_VOLUME : -AUDIO_VOLUME;
+                        a->phase += a->step;
+                }
+                a->ring[(tail + i) & (a->ringLen - 1)] = s;
+        }
+        atomic_store_explicit(&a->tail, tail + m, memory_order_release);
+        a->position = until;
+        atomic_fetch_add(&a->samples, n);
+        atomic_fetch_add(&a->dropped, n - m);
+}
+
+void audio_report(struct audio *a, FILE *fp){
+        fprintf(fp, "AUDIO: %lu samples, %lu played, %lu dropped, %lu underruns%s\n",
+                        atomic_load(&a->samples), atomic_load(&a->written),
+                        atomic_load(&a->dropped), atomic_load(&a->underruns),
+                        atomic_load(&a->failed) ? ", playing failed" : "");
+}
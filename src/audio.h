@@ -0,0 +1,113 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_AUDIO_H
+#define _SRC_AUDIO_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Plays the buzzer a chip sounds while its sound timer is not zero. The
+ * thread ticking the timers adds samples to a single producer, single
+ * consumer ring without ever waiting, and a thread of the sink's own takes
+ * them out and hands them to a backend: a WAV file, a null device, or ALSA
+ * in builds with audio=alsa. Samples that do not fit in the ring are
+ * dropped, and counted. A backend that plays in real time is given silence
+ * when the ring runs dry, and the underrun is counted.
+ */
+
+/* Samples per second, a whole number of samples per 60 Hz tick */
+#define AUDIO_DEFAULT_RATE 44100
+/* Samples the ring holds, a power of two, about 24 seconds */
+#define AUDIO_DEFAULT_RING (1 << 20)
+/* A longer ring for runs that know their length, about 6 minutes */
+#define AUDIO_MAX_RING (1 << 24)
+/* A ring for playing, short enough that fast forwarding, which makes
+ * samples faster than they play, drops them instead of queueing seconds
+ * of sound */
+#define AUDIO_PLAY_RING (1 << 13)
+/* The buzzer, a square wave */
+#define AUDIO_TONE_HZ 440
+#define AUDIO_VOLUME 8000
+/* Periods a real time backend is fed per second */
+#define AUDIO_PERIOD_HZ 100
+
+struct audio;
+
+/* A sink for the samples. open returns non zero, having said why on
+ * stderr, if it fails. write is only ever called by the sink's thread */
+struct audio_backend {
+        const char *name;
+        int (*open)(struct audio *a, const char *path);
+        int (*write)(struct audio *a, const int16_t *samples, size_t n);
+        void (*close)(struct audio *a);
+        /* Set when write blocks until the device has played the samples */
+        uint8_t realtime;
+};
+
+/* Throws the samples away at the rate a device would play them */
+extern const struct audio_backend audio_null;
+/* Writes 16 bit mono PCM to the WAV file path */
+extern const struct audio_backend audio_wav;
+#ifdef CHIP8_ALSA
+/* Plays on the ALSA device path, or "default" when path is NULL */
+extern const struct audio_backend audio_alsa;
+#endif
+
+struct audio {
+        const struct audio_backend *backend;
+        uint32_t rate;
+        /* The backend's state */
+        void *sink;
+
+        /* The ring, ringLen samples. head is only moved by the sink's
+         * thread, and tail by the producer, both count up forever */
+        int16_t *ring;
+        size_t ringLen;
+        atomic_size_t head;
+        atomic_size_t tail;
+
+        /* Only touched by the producer. position is the sample the next
+         * one added is, on whether the tone is sounding */
+        uint64_t position;
+        uint8_t on;
+        uint32_t phase;
+        uint32_t step;
+
+        /* One period of samples for the backend */
+        int16_t *period;
+        size_t periodLen;
+        pthread_t thread;
+        atomic_bool stopping;
+        uint8_t joined;
+
+        /* Statistics */
+        atomic_uint_fast64_t samples;
+        atomic_uint_fast64_t written;
+        atomic_uint_fast64_t dropped;
+        atomic_uint_fast64_t underruns;
+        atomic_bool failed;
+};
+
+struct audio *audio_init(const struct audio_backend *backend, const char *path, uint32_t rate, size_t ringLen);
+void audio_destroy(struct audio **a);
+void audio_stop(struct audio *a);
+void audio_render(struct audio *a, uint64_t until, int on);
+void audio_report(struct audio *a, FILE *fp);
+
+#endif
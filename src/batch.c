@@ -0,0 +1,693 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+
+#include "batch.h"
+#include "chip8.h"
+
+/* A small vector API over the lane arrays. A chunk is LANES lanes, one
+ * vector of bytes or two vectors of words. Masks are all ones, or all
+ * zeros per lane */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANES 32
+typedef __m256i vbytes;
+typedef __m256i vwords;
+
+static inline vbytes vb_load(const uint8_t *p){ return _mm256_loadu_si256((const __m256i *) p); }
+static inline void vb_store(uint8_t *p, vbytes v){ _mm256_storeu_si256((__m256i *) p, v); }
+static inline vbytes vb_set(uint8_t x){ return _mm256_set1_epi8(x); }
+static inline vbytes vb_add(vbytes a, vbytes b){ return _mm256_add_epi8(a, b); }
+static inline vbytes vb_sub(vbytes a, vbytes b){ return _mm256_sub_epi8(a, b); }
+static inline vbytes vb_adds(vbytes a, vbytes b){ return _mm256_adds_epu8(a, b); }
+static inline vbytes vb_subs(vbytes a, vbytes b){ return _mm256_subs_epu8(a, b); }
+static inline vbytes vb_min(vbytes a, vbytes b){ return _mm256_min_epu8(a, b); }
+static inline vbytes vb_and(vbytes a, vbytes b){ return _mm256_and_si256(a, b); }
+static inline vbytes vb_andnot(vbytes a, vbytes b){ return _mm256_andnot_si256(a, b); }
+static inline vbytes vb_or(vbytes a, vbytes b){ return _mm256_or_si256(a, b); }
+static inline vbytes vb_xor(vbytes a, vbytes b){ return _mm256_xor_si256(a, b); }
+static inline vbytes vb_eq(vbytes a, vbytes b){ return _mm256_cmpeq_epi8(a, b); }
+static inline vbytes vb_blend(vbytes a, vbytes b, vbytes m){ return _mm256_blendv_epi8(a, b, m); }
+static inline vbytes vb_shr(vbytes a, int n){ return _mm256_and_si256(_mm256_srli_epi16(a, n), _mm256_set1_epi8(0xFF >> n)); }
+static inline uint32_t vb_bits(vbytes m){ return _mm256_movemask_epi8(m); }
+
+static inline vwords vw_load(const uint16_t *p){ return _mm256_loadu_si256((const __m256i *) p); }
+static inline void vw_store(uint16_t *p, vwords v){ _mm256_storeu_si256((__m256i *) p, v); }
+static inline vwords vw_set(uint16_t x){ return _mm256_set1_epi16(x); }
+static inline vwords vw_add(vwords a, vwords b){ return _mm256_add_epi16(a, b); }
+static inline vwords vw_and(vwords a, vwords b){ return _mm256_and_si256(a, b); }
+static inline vwords vw_eq(vwords a, vwords b){ return _mm256_cmpeq_epi16(a, b); }
+static inline vwords vw_blend(vwords a, vwords b, vwords m){ return _mm256_blendv_epi8(a, b, m); }
+
+/* packs, and unpack work within 128 bit halves, the permutes put the
+ * lanes back in order */
+static inline vbytes mask_pack(vwords lo, vwords hi){
+        return _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+}
+static inline vwords mask_lo(vbytes m){
+        m = _mm256_permute4x64_epi64(m, 0xD8);
+        return _mm256_unpacklo_epi8(m, m);
+}
+static inline vwords mask_hi(vbytes m){
+        m = _mm256_permute4x64_epi64(m, 0xD8);
+        return _mm256_unpackhi_epi8(m, m);
+}
+static inline vwords widen_lo(vbytes v){
+        return _mm256_unpacklo_epi8(_mm256_permute4x64_epi64(v, 0xD8), _mm256_setzero_si256());
+}
+static inline vwords widen_hi(vbytes v){
+        return _mm256_unpackhi_epi8(_mm256_permute4x64_epi64(v, 0xD8), _mm256_setzero_si256());
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANES 16
+typedef __m128i vbytes;
+typedef __m128i vwords;
+
+static inline vbytes vb_load(const uint8_t *p){ return _mm_loadu_si128((const __m128i *) p); }
+static inline void vb_store(uint8_t *p, vbytes v){ _mm_storeu_si128((__m128i *) p, v); }
+static inline vbytes vb_set(uint8_t x){ return _mm_set1_epi8(x); }
+static inline vbytes vb_add(vbytes a, vbytes b){ return _mm_add_epi8(a, b); }
+static inline vbytes vb_sub(vbytes a, vbytes b){ return _mm_sub_epi8(a, b); }
+static inline vbytes vb_adds(vbytes a, vbytes b){ return _mm_adds_epu8(a, b); }
+static inline vbytes vb_subs(vbytes a, vbytes b){ return _mm_subs_epu8(a, b); }
+static inline vbytes vb_min(vbytes a, vbytes b){ return _mm_min_epu8(a, b); }
+static inline vbytes vb_and(vbytes a, vbytes b){ return _mm_and_si128(a, b); }
+static inline vbytes vb_andnot(vbytes a, vbytes b){ return _mm_andnot_si128(a, b); }
+static inline vbytes vb_or(vbytes a, vbytes b){ return _mm_or_si128(a, b); }
+static inline vbytes vb_xor(vbytes a, vbytes b){ return _mm_xor_si128(a, b); }
+static inline vbytes vb_eq(vbytes a, vbytes b){ return _mm_cmpeq_epi8(a, b); }
+static inline vbytes vb_blend(vbytes a, vbytes b, vbytes m){ return _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a)); }
+static inline vbytes vb_shr(vbytes a, int n){ return _mm_and_si128(_mm_srli_epi16(a, n), _mm_set1_epi8(0xFF >> n)); }
+static inline uint32_t vb_bits(vbytes m){ return _mm_movemask_epi8(m); }
+
+static inline vwords vw_load(const uint16_t *p){ return _mm_loadu_si128((const __m128i *) p); }
+static inline void vw_store(uint16_t *p, vwords v){ _mm_storeu_si128((__m128i *) p, v); }
+static inline vwords vw_set(uint16_t x){ return _mm_set1_epi16(x); }
+static inline vwords vw_add(vwords a, vwords b){ return _mm_add_epi16(a, b); }
+static inline vwords vw_and(vwords a, vwords b){ return _mm_and_si128(a, b); }
+static inline vwords vw_eq(vwords a, vwords b){ return _mm_cmpeq_epi16(a, b); }
+static inline vwords vw_blend(vwords a, vwords b, vwords m){ return vb_blend(a, b, m); }
+
+static inline vbytes mask_pack(vwords lo, vwords hi){ return _mm_packs_epi16(lo, hi); }
+static inline vwords mask_lo(vbytes m){ return _mm_unpacklo_epi8(m, m); }
+static inline vwords mask_hi(vbytes m){ return _mm_unpackhi_epi8(m, m); }
+static inline vwords widen_lo(vbytes v){ return _mm_unpacklo_epi8(v, _mm_setzero_si128()); }
+static inline vwords widen_hi(vbytes v){ return _mm_unpackhi_epi8(v, _mm_setzero_si128()); }
+#else
+/* Plain C with the same shape as SSE2, the compiler vectorises what it
+ * can */
+#define LANES 16
+typedef struct { uint8_t b[LANES]; } vbytes;
+typedef struct { uint16_t w[LANES / 2]; } vwords;
+
+#define VB_OP(name, expr) \
+static inline vbytes name(vbytes a, vbytes b){ \
+        vbytes r; \
+        for(int l = 0; l < LANES; l++) r.b[l] = (expr); \
+        return r; \
+}
+VB_OP(vb_add, a.b[l] + b.b[l])
+VB_OP(vb_sub, a.b[l] - b.b[l])
+VB_OP(vb_adds, (a.b[l] + b.b[l] > 0xFF) ? 0xFF : a.b[l] + b.b[l])
+VB_OP(vb_subs, (a.b[l] < b.b[l]) ? 0 : a.b[l] - b.b[l])
+VB_OP(vb_min, (a.b[l] < b.b[l]) ? a.b[l] : b.b[l])
+VB_OP(vb_and, a.b[l] & b.b[l])
+VB_OP(vb_andnot, ~a.b[l] & b.b[l])
+VB_OP(vb_or, a.b[l] | b.b[l])
+VB_OP(vb_xor, a.b[l] ^ b.b[l])
+VB_OP(vb_eq, (a.b[l] == b.b[l]) ? 0xFF : 0)
+#undef VB_OP
+
+static inline vbytes vb_load(const uint8_t *p){ vbytes r; memcpy(r.b, p, sizeof(r.b)); return r; }
+static inline void vb_store(uint8_t *p, vbytes v){ memcpy(p, v.b, sizeof(v.b)); }
+static inline vbytes vb_set(uint8_t x){ vbytes r; memset(r.b, x, sizeof(r.b)); return r; }
+static inline vbytes vb_blend(vbytes a, vbytes b, vbytes m){ return vb_or(vb_and(m, b), vb_andnot(m, a)); }
+static inline vbytes vb_shr(vbytes a, int n){
+        for(int l = 0; l < LANES; l++) a.b[l] >>= n;
+        return a;
+}
+static inline uint32_t vb_bits(vbytes m){
+        uint32_t bits = 0;
+        for(int l = 0; l < LANES; l++) bits |= (uint32_t) (m.b[l] >> 7) << l;
+        return bits;
+}
+
+static inline vwords vw_load(const uint16_t *p){ vwords r; memcpy(r.w, p, sizeof(r.w)); return r; }
+static inline void vw_store(uint16_t *p, vwords v){ memcpy(p, v.w, sizeof(v.w)); }
+static inline vwords vw_set(uint16_t x){
+        vwords r;
+        for(int l = 0; l < LANES / 2; l++) r.w[l] = x;
+        return r;
+}
+static inline vwords vw_add(vwords a, vwords b){
+        for(int l = 0; l < LANES / 2; l++) a.w[l] += b.w[l];
+        return a;
+}
+static inline vwords vw_and(vwords a, vwords b){
+        for(int l = 0; l < LANES / 2; l++) a.w[l] &= b.w[l];
+        return a;
+}
+static inline vwords vw_eq(vwords a, vwords b){
+        for(int l = 0; l < LANES / 2; l++) a.w[l] = (a.w[l] == b.w[l]) ? 0xFFFF : 0;
+        return a;
+}
+static inline vwords vw_blend(vwords a, vwords b, vwords m){
+        for(int l = 0; l < LANES / 2; l++) a.w[l] = (m.w[l] & b.w[l]) | (~m.w[l] & a.w[l]);
+        return a;
+}
+
+static inline vbytes mask_pack(vwords lo, vwords hi){
+        vbytes r;
+        for(int l = 0; l < LANES / 2; l++){
+                r.b[l] = lo.w[l];
+                r.b[l + LANES / 2] = hi.w[l];
+        }
+        return r;
+}
+static inline vwords mask_lo(vbytes m){
+        vwords r;
+        for(int l = 0; l < LANES / 2; l++) r.w[l] = m.b[l] ? 0xFFFF : 0;
+        return r;
+}
+static inline vwords mask_hi(vbytes m){
+        vwords r;
+        for(int l = 0; l < LANES / 2; l++) r.w[l] = m.b[l + LANES / 2] ? 0xFFFF : 0;
+        return r;
+}
+static inline vwords widen_lo(vbytes v){
+        vwords r;
+        for(int l = 0; l < LANES / 2; l++) r.w[l] = v.b[l];
+        return r;
+}
+static inline vwords widen_hi(vbytes v){
+        vwords r;
+        for(int l = 0; l < LANES / 2; l++) r.w[l] = v.b[l + LANES / 2];
+        return r;
+}
+#endif
+
+#define ROW(b, x) ((b)->v + (size_t) (x) * (b)->lanes)
+
+/* Replaces the masked lanes of row with v */
+static inline void put(uint8_t *row, vbytes v, vbytes m){
+        vb_store(row, vb_blend(vb_load(row), v, m));
+}
+
+/* 1 in the lanes where a < b */
+static inline vbytes less_than(vbytes a, vbytes b){
+        return vb_and(vb_andnot(vb_eq(a, b), vb_eq(vb_min(a, b), a)), vb_set(1));
+}
+
+static uint16_t fetch(struct mState *ms, uint16_t pc){
+        return ((uint16_t) ms->mem[pc]) << 8 | ms->mem[pc + 1];
+}
+
+/* Instructions executed a group at a time. Most are SIMD, calls, returns,
+ * key skips and FX65 loop over the group's lanes, but still skip copying
+ * the lane to its chip, and back */
+static int grouped(uint16_t ins){
+        switch(ins >> 12){
+                case 0x0:
+                        return ins == 0x00EE;
+                case 0x1: case 0x2: case 0x3: case 0x4: case 0x6: case 0x7: case 0xA:
+                        return 1;
+                case 0x5: case 0x9:
+                        return (ins & 0xF) == 0;
+                case 0x8:
+                        return (ins & 0xF) <= 0x7 || (ins & 0xF) == 0xE;
+                case 0xE:
+                        return (ins & 0xFF) == 0x9E || (ins & 0xFF) == 0xA1;
+                case 0xF:
+                        switch(ins & 0xFF){
+                                case 0x07: case 0x15: case 0x18: case 0x1E:
+                                case 0x29: case 0x65:
+                                        return 1;
+                        }
+                        return 0;
+        }
+        return 0;
+}
+
+static void stop_lane(struct batch *b, size_t l);
+static void run_lane(struct batch *b, size_t l);
+
+/* Executes ins on the lanes of the group at pc, which all start at or
+ * after lane first. Every register row is loaded, and stored, in the same
+ * order run_instruction reads, and writes it, so instructions naming VF
+ * behave the same */
+static void run_group(struct batch *b, uint16_t pc, uint16_t ins, size_t first){
+        uint8_t x = (ins >> 8) & 0xF;
+        uint8_t y = (ins >> 4) & 0xF;
+        uint8_t nn = ins & 0xFF;
+        uint16_t nnn = ins & 0xFFF;
+        vwords p = vw_set(pc);
+        vwords done = vw_set(BATCH_DONE);
+        vwords two = vw_set(2);
+        vbytes ones = vb_set(0xFF);
+        vbytes one = vb_set(1);
+
+        for(size_t c = first - first % LANES; c < b->lanes; c += LANES){
+                vwords slo = vw_load(b->snap + c);
+                vwords shi = vw_load(b->snap + c + LANES / 2);
+                vwords mlo = vw_eq(slo, p);
+                vwords mhi = vw_eq(shi, p);
+                vbytes m = mask_pack(mlo, mhi);
+                if(vb_bits(m) == 0)
+                        continue;
+                vw_store(b->snap + c, vw_blend(slo, done, mlo));
+                vw_store(b->snap + c + LANES / 2, vw_blend(shi, done, mhi));
+
+                uint8_t *vx = ROW(b, x) + c;
+                uint8_t *vy = ROW(b, y) + c;
+                uint8_t *vf = ROW(b, 0xF) + c;
+                /* Lanes that skip the next instruction */
+                vbytes skip = vb_set(0);
+                uint32_t bits = vb_bits(m);
+                switch(ins >> 12){
+                        case 0x0:
+                                /* 00EE, an empty stack is left to
+                                 * run_instruction to report */
+                                for(; bits != 0; bits &= bits - 1){
+                                        size_t l = c + __builtin_ctz(bits);
+                                        struct mState *ms = b->chips[l];
+                                        if(ms->stackSize == 0){
+                                                run_lane(b, l);
+                                                continue;
+                                        }
+                                        b->pc[l] = ms->stack[--ms->stackSize];
+                                        if(b->pc[l] > 4094)
+                                                stop_lane(b, l);
+                                }
+                                continue;
+                        case 0x2:
+                                for(; bits != 0; bits &= bits - 1){
+                                        size_t l = c + __builtin_ctz(bits);
+                                        struct mState *ms = b->chips[l];
+                                        if(ms->stackSize == ms->stackCapacity){
+                                                run_lane(b, l);
+                                                continue;
+                                        }
+                                        ms->stack[ms->stackSize++] = b->pc[l] + 2;
+                                        b->pc[l] = nnn;
+                                        if(nnn > 4094)
+                                                stop_lane(b, l);
+                                }
+                                continue;
+                        case 0x1:{
+                                vwords target = vw_set(nnn);
+                                vw_store(b->pc + c, vw_blend(vw_load(b->pc + c), target, mlo));
+                                vw_store(b->pc + c + LANES / 2, vw_blend(vw_load(b->pc + c + LANES / 2), target, mhi));
+                                continue;
+                                }
+                        case 0x3:
+                                skip = vb_eq(vb_load(vx), vb_set(nn));
+                                break;
+                        case 0x4:
+                                skip = vb_xor(vb_eq(vb_load(vx), vb_set(nn)), ones);
+                                break;
+                        case 0x5:
+                                skip = vb_eq(vb_load(vx), vb_load(vy));
+                                break;
+                        case 0x9:
+                                skip = vb_xor(vb_eq(vb_load(vx), vb_load(vy)), ones);
+                                break;
+                        case 0x6:
+                                put(vx, vb_set(nn), m);
+                                break;
+                        case 0x7:
+                                put(vx, vb_add(vb_load(vx), vb_set(nn)), m);
+                                break;
+                        case 0x8:
+                                switch(ins & 0xF){
+                                        case 0x0:
+                                                put(vx, vb_load(vy), m);
+                                                break;
+                                        case 0x1:
+                                                put(vx, vb_or(vb_load(vx), vb_load(vy)), m);
+                                                break;
+                                        case 0x2:
+                                                put(vx, vb_and(vb_load(vx), vb_load(vy)), m);
+                                                break;
+                                        case 0x3:
+                                                put(vx, vb_xor(vb_load(vx), vb_load(vy)), m);
+                                                break;
+                                        case 0x4:{
+                                                vbytes a = vb_load(vx), d = vb_load(vy);
+                                                /* The saturating sum only differs on a carry */
+                                                put(vf, vb_andnot(vb_eq(vb_adds(a, d), vb_add(a, d)), one), m);
+                                                put(vx, vb_add(vb_load(vx), vb_load(vy)), m);
+                                                break;
+                                                }
+                                        case 0x5:
+                                                put(vf, less_than(vb_load(vy), vb_load(vx)), m);
+                                                put(vx, vb_sub(vb_load(vx), vb_load(vy)), m);
+                                                break;
+                                        case 0x6:
+                                                put(vf, vb_and(vb_load(vy), one), m);
+                                                put(vy, vb_shr(vb_load(vy), 1), m);
+                                                put(vx, vb_load(vy), m);
+                                                break;
+                                        case 0x7:
+                                                put(vf, less_than(vb_load(vx), vb_load(vy)), m);
+                                                put(vx, vb_sub(vb_load(vy), vb_load(vx)), m);
+                                                break;
+                                        case 0xE:
+                                                put(vf, vb_shr(vb_load(vy), 7), m);
+                                                put(vy, vb_add(vb_load(vy), vb_load(vy)), m);
+                                                put(vx, vb_load(vy), m);
+                                                break;
+                                }
+                                break;
+                        case 0xA:{
+                                vwords addr = vw_set(nnn);
+                                vw_store(b->i + c, vw_blend(vw_load(b->i + c), addr, mlo));
+                                vw_store(b->i + c + LANES / 2, vw_blend(vw_load(b->i + c + LANES / 2), addr, mhi));
+                                break;
+                                }
+                        case 0xE:{
+                                uint8_t pressed[LANES] = {0};
+                                for(; bits != 0; bits &= bits - 1){
+                                        size_t l = c + __builtin_ctz(bits);
+                                        pressed[l - c] = b->chips[l]->keys[vx[l - c] & 0xF] ? 0xFF : 0;
+                                }
+                                skip = vb_load(pressed);
+                                if(nn == 0xA1)
+                                        skip = vb_xor(skip, ones);
+                                break;
+                                }
+                        case 0xF:
+                                switch(nn){
+                                        case 0x07:
+                                                put(vx, vb_load(b->dTimer + c), m);
+                                                break;
+                                        case 0x15:
+                                                put(b->dTimer + c, vb_load(vx), m);
+                                                break;
+                                        case 0x18:
+                                                put(b->sTimer + c, vb_load(vx), m);
+                                                break;
+                                        case 0x1E:
+                                        case 0x29:{
+                                                vbytes v = vb_load(vx);
+                                                vwords lo = widen_lo(v), hi = widen_hi(v);
+                                                if(nn == 0x1E){
+                                                        lo = vw_add(vw_load(b->i + c), lo);
+                                                        hi = vw_add(vw_load(b->i + c + LANES / 2), hi);
+                                                }else{
+                                                        /* Each font character is 5 bytes */
+                                                        vwords lo4 = vw_add(vw_add(lo, lo), vw_add(lo, lo));
+                                                        vwords hi4 = vw_add(vw_add(hi, hi), vw_add(hi, hi));
+                                                        lo = vw_add(lo4, lo);
+                                                        hi = vw_add(hi4, hi);
+                                                }
+                                                vw_store(b->i + c, vw_blend(vw_load(b->i + c), lo, mlo));
+                                                vw_store(b->i + c + LANES / 2, vw_blend(vw_load(b->i + c + LANES / 2), hi, mhi));
+                                                break;
+                                                }
+                                        case 0x65:
+                                                for(; bits != 0; bits &= bits - 1){
+                                                        size_t l = c + __builtin_ctz(bits);
+                                                        struct mState *ms = b->chips[l];
+                                                        for(int r = 0; r <= x; r++)
+                                                                ROW(b, r)[l] = ms->mem[b->i[l]++ & 0xFFF];
+                                                }
+                                                break;
+                                }
+                                break;
+                }
+                /* Every lane moves on by 2, and by 2 more if it skips */
+                skip = vb_and(skip, m);
+                vwords inclo = vw_add(vw_and(mlo, two), vw_and(mask_lo(skip), two));
+                vwords inchi = vw_add(vw_and(mhi, two), vw_and(mask_hi(skip), two));
+                vw_store(b->pc + c, vw_add(vw_load(b->pc + c), inclo));
+                vw_store(b->pc + c + LANES / 2, vw_add(vw_load(b->pc + c + LANES / 2), inchi));
+        }
+}
+
+/* Stops a lane whose PC has left memory. Its chip keeps the PC, and the
+ * number of instructions it executed */
+static void stop_lane(struct batch *b, size_t l){
+        b->chips[l]->pc = b->pc[l];
+        b->chips[l]->count = b->steps + 1;
+        b->pc[l] = BATCH_DONE;
+}
+
+/* The registers an instruction run by run_instruction reads, or writes */
+static uint16_t registers_used(uint16_t ins){
+        uint16_t used = 1 << ((ins >> 8) & 0xF) | 1 << ((ins >> 4) & 0xF) | 1 << 0xF;
+        if((ins >> 12) == 0xB)
+                used |= 1;
+        if((ins & 0xF0FF) == 0xF055 || (ins & 0xF0FF) == 0xF065 ||
+                        (ins & 0xF0FF) == 0xF075 || (ins & 0xF0FF) == 0xF085)
+                used |= (2 << ((ins >> 8) & 0xF)) - 1;
+        return used;
+}
+
+/* Executes one instruction on one lane with run_instruction, only the
+ * registers the instruction uses are copied to, and from its chip */
+static void run_lane(struct batch *b, size_t l){
+        struct mState *ms = b->chips[l];
+        uint16_t ins = fetch(ms, b->pc[l]);
+        uint16_t used = registers_used(ins);
+        for(int x = 0; x < 16; x++)
+                if((used >> x) & 1)
+                        ms->registers[x] = ROW(b, x)[l];
+        ms->iRegister = b->i[l];
+        ms->pc = b->pc[l];
+        ms->dTimer = b->dTimer[l];
+        ms->sTimer = b->sTimer[l];
+
+        uint16_t sopc = ins & 0xF0FF;
+        if(sopc == 0xF033 || sopc == 0xF055){
+                size_t len = (sopc == 0xF033) ? 3 : ((ins >> 8) & 0xF) + 1;
+                for(size_t a = 0; a < len; a++)
+                        b->written[(ms->iRegister + a) & 0xFFF] = 1;
+        }
+        run_instruction(ms, ins);
+
+        for(int x = 0; x < 16; x++)
+                if((used >> x) & 1)
+                        ROW(b, x)[l] = ms->registers[x];
+        b->i[l] = ms->iRegister;
+        b->pc[l] = ms->pc;
+        b->dTimer[l] = ms->dTimer;
+        b->sTimer[l] = ms->sTimer;
+        b->scalarSteps++;
+        if((uint16_t) ms->pc > 4094)
+                stop_lane(b, l);
+}
+
+/* The first lane from l on that has not been executed this step, or
+ * count if there are none */
+static size_t next_lane(struct batch *b, size_t l){
+        vwords done = vw_set(BATCH_DONE);
+        size_t c = l - l % LANES;
+        uint32_t skip = (1u << (l % LANES)) - 1;
+        for(; c < b->count; c += LANES, skip = 0){
+                vbytes m = mask_pack(vw_eq(vw_load(b->snap + c), done),
+                                vw_eq(vw_load(b->snap + c + LANES / 2), done));
+                uint32_t bits = ~(vb_bits(m) | skip);
+#if LANES < 32
+                bits &= (1u << LANES) - 1;
+#endif
+                if(bits != 0){
+                        size_t n = c + __builtin_ctz(bits);
+                        return (n < b->count) ? n : b->count;
+                }
+        }
+        return b->count;
+}
+
+/* Executes one instruction on every running lane */
+static void step(struct batch *b){
+        size_t groups = 0;
+        memcpy(b->snap, b->pc, b->lanes * sizeof(uint16_t));
+        for(size_t l = next_lane(b, 0); l < b->count; l = next_lane(b, l + 1)){
+                uint16_t pc = b->snap[l];
+                uint16_t ins = fetch(b->chips[l], pc);
+                if(groups == BATCH_MAX_GROUPS || !grouped(ins) ||
+                                b->written[pc] || b->written[pc + 1]){
+                        b->snap[l] = BATCH_DONE;
+                        run_lane(b, l);
+                        continue;
+                }
+                run_group(b, pc, ins, l);
+                groups++;
+                b->simdGroups++;
+                /* Only a jump, or a skip at the very end of memory can
+                 * leave it */
+                if(pc + 4 > 4094 || ((ins >> 12) == 0x1 && (ins & 0xFFF) > 4094)){
+                        for(size_t k = l; k < b->count; k++)
+                                if(b->pc[k] != BATCH_DONE && b->pc[k] > 4094)
+                                        stop_lane(b, k);
+                }
+        }
+        b->steps++;
+}
+
+static void tick(struct batch *b){
+        vbytes one = vb_set(1);
+        vwords done = vw_set(BATCH_DONE);
+        for(size_t c = 0; c < b->lanes; c += LANES){
+                vbytes stopped = mask_pack(vw_eq(vw_load(b->pc + c), done),
+                                vw_eq(vw_load(b->pc + c + LANES / 2), done));
+                vbytes d = vb_load(b->dTimer + c);
+                vbytes s = vb_load(b->sTimer + c);
+                vb_store(b->dTimer + c, vb_blend(vb_subs(d, one), d, stopped));
+                vb_store(b->sTimer + c, vb_blend(vb_subs(s, one), s, stopped));
+        }
+}
+
+/* Creates count headless chips to run in lockstep */
+struct batch *batch_init(size_t count){
+        struct batch *b = calloc(1, sizeof(struct batch));
+        if(b == NULL) return NULL;
+        b->count = count;
+        b->lanes = (count + BATCH_LANE_ALIGN - 1) / BATCH_LANE_ALIGN * BATCH_LANE_ALIGN;
+        b->insPerFrame = CHIP8_DEFAULT_IPF;
+        b->chips = calloc(b->lanes, sizeof(struct mState *));
+        if(b->chips == NULL) goto chipsFail;
+        b->v = calloc(16 * b->lanes, sizeof(uint8_t));
+        if(b->v == NULL) goto vFail;
+        b->i = calloc(b->lanes, sizeof(uint16_t));
+        if(b->i == NULL) goto iFail;
+        b->pc = calloc(b->lanes, sizeof(uint16_t));
+        if(b->pc == NULL) goto pcFail;
+        b->snap = calloc(b->lanes, sizeof(uint16_t));
+        if(b->snap == NULL) goto snapFail;
+        b->dTimer = calloc(b->lanes, sizeof(uint8_t));
+        if(b->dTimer == NULL) goto dTimerFail;
+        b->sTimer = calloc(b->lanes, sizeof(uint8_t));
+        if(b->sTimer == NULL) goto sTimerFail;
+
+        for(size_t l = 0; l < b->lanes; l++)
+                b->pc[l] = BATCH_DONE;
+        for(size_t l = 0; l < count; l++){
+                b->chips[l] = chip8_init_headless();
+                if(b->chips[l] == NULL) goto chipFail;
+        }
+        batch_reset(b);
+        return b;
+chipFail:
+        for(size_t l = 0; l < count; l++)
+                chip8_destroy(&b->chips[l]);
+        free(b->sTimer);
+sTimerFail:
+        free(b->dTimer);
+dTimerFail:
+        free(b->snap);
+snapFail:
+        free(b->pc);
+pcFail:
+        free(b->i);
+iFail:
+        free(b->v);
+vFail:
+        free(b->chips);
+chipsFail:
+        free(b);
+        return NULL;
+}
+
+void batch_destroy(struct batch **b){
+        if(*b == NULL) return;
+        for(size_t l = 0; l < (*b)->count; l++)
+                chip8_destroy(&(*b)->chips[l]);
+        free((*b)->sTimer);
+        free((*b)->dTimer);
+        free((*b)->snap);
+        free((*b)->pc);
+        free((*b)->i);
+        free((*b)->v);
+        free((*b)->chips);
+        free(*b);
+        *b = NULL;
+}
+
+/* Starts every lane from the registers, I, PC and timers of its chip, so
+ * lanes can be set up before they run */
+void batch_reset(struct batch *b){
+        for(size_t l = 0; l < b->count; l++){
+                struct mState *ms = b->chips[l];
+                ms->count = 0;
+                ms->insPerFrame = b->insPerFrame;
+                for(int x = 0; x < 16; x++)
+                        ROW(b, x)[l] = ms->registers[x];
+                b->i[l] = ms->iRegister;
+                b->pc[l] = ((uint16_t) ms->pc > 4094) ? BATCH_DONE : ms->pc;
+                b->dTimer[l] = ms->dTimer;
+                b->sTimer[l] = ms->sTimer;
+        }
+        memset(b->written, 0, sizeof(b->written));
+        b->steps = 0;
+}
+
+/* Loads the ROM into every lane, and starts them all from the top */
+struct runtime_error *batch_load_rom(struct batch *b, char *file){
+        for(size_t l = 0; l < b->count; l++){
+                struct runtime_error *re = chip8_load_rom(b->chips[l], file);
+                if(re != NULL)
+                        return re;
+                b->chips[l]->pc = 0x200;
+        }
+        batch_reset(b);
+        return NULL;
+}
+
+/* Instructions the lane has executed since it was reset */
+static uint64_t lane_count(struct batch *b, size_t l){
+        return (b->pc[l] != BATCH_DONE) ? b->steps : b->chips[l]->count;
+}
+
+/* Runs every lane for the given number of frames, or until its PC leaves
+ * memory. Returns the number of instructions executed over all lanes */
+uint64_t batch_run(struct batch *b, uint64_t frames){
+        uint64_t before = 0, after = 0;
+        for(size_t l = 0; l < b->count; l++)
+                before += lane_count(b, l);
+        for(uint64_t f = 0; f < frames; f++){
+                size_t running = 0;
+                for(size_t l = 0; l < b->count; l++)
+                        running += (b->pc[l] != BATCH_DONE);
+                if(running == 0)
+                        break;
+                for(uint32_t s = 0; s < b->insPerFrame; s++)
+                        step(b);
+                tick(b);
+        }
+        for(size_t l = 0; l < b->count; l++)
+                after += lane_count(b, l);
+        return after - before;
+}
+
+/* Copies the lane arrays back into the chips, so they can be inspected
+ * with the usual functions */
+void batch_sync(struct batch *b){
+        for(size_t l = 0; l < b->count; l++){
+                struct mState *ms = b->chips[l];
+                for(int x = 0; x < 16; x++)
+                        ms->registers[x] = ROW(b, x)[l];
+                ms->iRegister = b->i[l];
+                ms->dTimer = b->dTimer[l];
+                ms->sTimer = b->sTimer[l];
+                if(b->pc[l] != BATCH_DONE){
+                        ms->pc = b->pc[l];
+                        ms->count = b->steps;
+                }
+        }
+}
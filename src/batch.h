@@ -0,0 +1,83 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_BATCH_H
+#define _SRC_BATCH_H
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "runtime_error.h"
+
+/* Runs many chips with the same ROM in lockstep. The registers, I, PC and
+ * timers of every lane are kept as structure of arrays, so one SIMD
+ * instruction updates 16 lanes with SSE2, or 32 with AVX2. Each step the
+ * lanes are grouped by PC, and the instruction at a group's PC is executed
+ * on the whole group with a lane mask when it is one of the register, ALU,
+ * skip, jump, I or timer instructions. Anything else, and any lane left
+ * over once BATCH_MAX_GROUPS groups have run, is executed one lane at a
+ * time with run_instruction on the lane's own chip. The chips also hold
+ * what is not kept in the arrays, memory, the stack, the display and keys.
+ *
+ * Every lane runs on the virtual clock, a frame is insPerFrame steps
+ * followed by a timer tick, like chip8_run_headless.
+ */
+
+/* Lanes are padded to a multiple of this */
+#define BATCH_LANE_ALIGN 32
+/* Groups executed with SIMD each step */
+#define BATCH_MAX_GROUPS 4
+/* The PC of a lane that has stopped, or is padding */
+#define BATCH_DONE 0xFFFF
+
+struct mState;
+
+struct batch {
+        /* Lanes in use, and allocated */
+        size_t count;
+        size_t lanes;
+        struct mState **chips;
+
+        /* V0-VF, V[x] is the row at v + x * lanes */
+        uint8_t *v;
+        uint16_t *i;
+        uint16_t *pc;
+        uint8_t *dTimer;
+        uint8_t *sTimer;
+        /* The PCs at the start of the step, BATCH_DONE once a lane has
+         * been executed */
+        uint16_t *snap;
+
+        /* Addresses written by any lane, instructions there may differ
+         * between lanes so they are never run with SIMD */
+        uint8_t written[4096];
+
+        uint32_t insPerFrame;
+        /* Steps since the ROM was loaded */
+        uint64_t steps;
+
+        /* Statistics */
+        uint64_t simdGroups;
+        uint64_t scalarSteps;
+};
+
+struct batch *batch_init(size_t count);
+void batch_destroy(struct batch **b);
+void batch_reset(struct batch *b);
+struct runtime_error *batch_load_rom(struct batch *b, char *file);
+uint64_t batch_run(struct batch *b, uint64_t frames);
+void batch_sync(struct batch *b);
+
+#endif
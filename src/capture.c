@@ -0,0 +1,235 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+
+#include "capture.h"
+
+/* Y4M's 4:2:0 chroma planes, all grey */
+#define Y4M_CHROMA 128
+
+/* Expands a line of the display to one scaled line, RGB for PPM, luma for
+ * Y4M */
+static void expand_line(struct capture *c, uint64_t line[2], uint8_t hires){
+        size_t bpp = (c->format == CAPTURE_PPM) ? 3 : 1;
+        uint32_t width = hires ? 128 : 64;
+        size_t n = (hires ? c->scale / 2 : c->scale) * bpp;
+        uint8_t *p = c->line;
+        for(uint32_t x = 0; x < width; x++){
+                uint8_t v = ((line[x / 64] >> (63 - x % 64)) & 1) ? 0xFF : 0x00;
+                memset(p, v, n);
+                p += n;
+        }
+}
+
+/* Writes the scaled lines of the image to fp */
+static void write_lines(struct capture *c, struct capture_entry *e, FILE *fp){
+        uint32_t height = e->hires ? 64 : 32;
+        uint32_t rows = e->hires ? c->scale / 2 : c->scale;
+        for(uint32_t y = 0; y < height; y++){
+                expand_line(c, e->disp[y], e->hires);
+                for(uint32_t s = 0; s < rows; s++)
+                        fwrite(c->line, 1, c->lineLen, fp);
+        }
+}
+
+static int write_ppm(struct capture *c, struct capture_entry *e, uint64_t index){
+        char name[4096];
+        snprintf(name, sizeof(name), "%s%06lu.ppm", c->path, index);
+        FILE *fp = fopen(name, "wb");
+        if(fp == NULL){
+                fprintf(stderr, "Could not open capture file \"%s\"\n", name);
+                return -1;
+        }
+        fprintf(fp, "P6\n%u %u\n255\n", 64 * c->scale, 32 * c->scale);
+        write_lines(c, e, fp);
+        if(ferror(fp) | fclose(fp)){
+                fprintf(stderr, "Could not write capture file \"%s\"\n", name);
+                return -1;
+        }
+        return 0;
+}
+
+static int write_y4m(struct capture *c, struct capture_entry *e, uint64_t index){
+        (void) index;
+        fputs("FRAME\n", c->out);
+        write_lines(c, e, c->out);
+        /* Cb, and Cr at half the width, and height */
+        memset(c->line, Y4M_CHROMA, c->lineLen);
+        for(uint32_t s = 0; s < 32 * c->scale; s++)
+                fwrite(c->line, 1, c->lineLen / 2, c->out);
+        if(ferror(c->out)){
+                fprintf(stderr, "Could not write the capture video\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* Writes queued frames until capture_destroy has been called, and the
+ * queue is empty */
+static void *writer(void *data){
+        struct capture *c = (struct capture *) data;
+        struct capture_entry e;
+        pthread_mutex_lock(&c->lock);
+        for(;;){
+                while(c->size == 0 && !c->stopping){
+                        c->writerWaiting = 1;
+                        pthread_cond_wait(&c->queued, &c->lock);
+                        c->writerWaiting = 0;
+                }
+                if(c->size == 0)
+                        break;
+                e = c->queue[c->head];
+                c->head = (c->head + 1) % c->queueLen;
+                c->size--;
+                if(c->failed){
+                        c->dropped += e.repeat;
+                        continue;
+                }
+                pthread_mutex_unlock(&c->lock);
+
+                /* Only the writer changes written */
+                uint64_t first = c->written;
+                uint32_t n;
+                for(n = 0; n < e.repeat; n++){
+                        int err = (c->format == CAPTURE_PPM) ? write_ppm(c, &e, first + n) : write_y4m(c, &e, first + n);
+                        if(err != 0) break;
+                }
+
+                pthread_mutex_lock(&c->lock);
+                c->written += n;
+                if(n != e.repeat){
+                        c->failed = 1;
+                        c->dropped += e.repeat - n;
+                }
+        }
+        pthread_mutex_unlock(&c->lock);
+        if(c->out != NULL)
+                fflush(c->out);
+        return NULL;
+}
+
+/* Starts capturing to path, with scale rounded up to an even one, so the
+ * pixels of the 128x64 mode are whole. Returns NULL if the video can not be opened,
+ * or the writer can not be started */
+struct capture *capture_init(enum capture_format format, char *path, uint32_t scale, size_t queueLen){
+        struct capture *c = calloc(1, sizeof(struct capture));
+        if(c == NULL) return NULL;
+        c->format = format;
+        c->scale = (scale > 1) ? scale + (scale & 1) : 2;
+        c->queueLen = (queueLen != 0) ? queueLen : 1;
+        c->lineLen = 64 * c->scale * ((format == CAPTURE_PPM) ? 3 : 1);
+        c->path = strdup(path);
+        if(c->path == NULL) goto pathFail;
+        c->queue = calloc(c->queueLen, sizeof(*c->queue));
+        if(c->queue == NULL) goto queueFail;
+        c->line = malloc(c->lineLen);
+        if(c->line == NULL) goto lineFail;
+
+        if(format == CAPTURE_Y4M){
+                c->out = (strcmp(path, "-") == 0) ? stdout : fopen(path, "wb");
+                if(c->out == NULL){
+                        fprintf(stderr, "Could not open capture file \"%s\"\n", path);
+                        goto outFail;
+                }
+                /* C420jpeg is full range, so black is 0, and white 255 */
+                fprintf(c->out, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg\n", 64 * c->scale, 32 * c->scale);
+        }
+
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->queued, NULL);
+        if(pthread_create(&c->writer, NULL, writer, c) != 0)
+                goto writerFail;
+        return c;
+writerFail:
+        pthread_cond_destroy(&c->queued);
+        pthread_mutex_destroy(&c->lock);
+        if(c->out != NULL && c->out != stdout)
+                fclose(c->out);
+outFail:
+        free(c->line);
+lineFail:
+        free(c->queue);
+queueFail:
+        free(c->path);
+pathFail:
+        free(c);
+        return NULL;
+}
+
+/* Writes every queued frame, and stops the writer. Frames queued after
+ * this are counted as dropped */
+void capture_stop(struct capture *c){
+        if(c->joined) return;
+        pthread_mutex_lock(&c->lock);
+        c->stopping = 1;
+        pthread_cond_signal(&c->queued);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->writer, NULL);
+        c->joined = 1;
+}
+
+/* Stops capturing, see capture_stop, and frees the sink */
+void capture_destroy(struct capture **c){
+        if(*c == NULL) return;
+        capture_stop(*c);
+
+        if((*c)->out != NULL && (*c)->out != stdout)
+                fclose((*c)->out);
+        pthread_cond_destroy(&(*c)->queued);
+        pthread_mutex_destroy(&(*c)->lock);
+        free((*c)->line);
+        free((*c)->queue);
+        free((*c)->path);
+        free(*c);
+        *c = NULL;
+}
+
+/* Queues a copy of disp, or drops it if the queue is full. lines are the
+ * lines that changed since the frame before, a change of mode marks them
+ * all. Only ever waits for another capture_frame, or the writer taking a
+ * frame */
+void capture_frame(struct capture *c, uint64_t disp[64][2], uint64_t lines, uint8_t hires){
+        pthread_mutex_lock(&c->lock);
+        c->frames++;
+        struct capture_entry *tail = &c->queue[(c->head + c->size + c->queueLen - 1) % c->queueLen];
+        if(c->stopping){
+                c->dropped++;
+                c->lastQueued = 0;
+        } else if(lines == 0 && c->lastQueued && c->size != 0 && tail->repeat != UINT32_MAX){
+                tail->repeat++;
+        } else if(c->size == c->queueLen){
+                c->dropped++;
+                c->lastQueued = 0;
+        } else {
+                tail = &c->queue[(c->head + c->size) % c->queueLen];
+                memcpy(tail->disp, disp, sizeof(tail->disp));
+                tail->hires = hires;
+                tail->repeat = 1;
+                c->size++;
+                c->lastQueued = 1;
+                if(c->writerWaiting)
+                        pthread_cond_signal(&c->queued);
+        }
+        pthread_mutex_unlock(&c->lock);
+}
+
+void capture_report(struct capture *c, FILE *fp){
+        pthread_mutex_lock(&c->lock);
+        fprintf(fp, "CAPTURE: %lu frames, %lu written, %lu dropped%s\n", c->frames,
+                        c->written, c->dropped, c->failed ? ", writing failed" : "");
+        pthread_mutex_unlock(&c->lock);
+}
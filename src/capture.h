@@ -0,0 +1,95 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_CAPTURE_H
+#define _SRC_CAPTURE_H
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Writes the display at the end of every frame on the virtual clock to
+ * disk, either as numbered PPM images, or as one uncompressed 60 fps Y4M
+ * video, with every pixel scaled to a square of scale pixels. Images are
+ * always the size of the 64x32 display, pixels of the 128x64 mode are
+ * squares of half the size, so odd scales are rounded up. Frames are
+ * copied into a bounded queue, and written by a thread of their own, so
+ * the execution thread never waits for I/O. A frame with no lines changed
+ * since the last one queued only adds to its repeat count. When the queue
+ * is full the frame is dropped, and counted.
+ */
+
+/* Distinct frames queued before they are dropped, about 4 MB */
+#define CAPTURE_DEFAULT_QUEUE 4096
+/* A longer queue for runs that know their length, about 67 MB */
+#define CAPTURE_MAX_QUEUE 65536
+#define CAPTURE_DEFAULT_SCALE 4
+
+enum capture_format {
+        /* <path>000000.ppm, <path>000001.ppm, ... */
+        CAPTURE_PPM,
+        /* A single file, or stdout when path is "-" */
+        CAPTURE_Y4M
+};
+
+struct capture_entry {
+        uint64_t disp[64][2];
+        /* Times the frame was presented in a row */
+        uint32_t repeat;
+        uint8_t hires;
+};
+
+struct capture {
+        enum capture_format format;
+        /* Always even, the size of a pixel of the 64x32 display */
+        uint32_t scale;
+        char *path;
+        FILE *out;
+
+        /* Queued frames, a ring of queueLen entries */
+        struct capture_entry *queue;
+        size_t queueLen;
+        size_t head;
+        size_t size;
+        /* Protects the queue, and everything below */
+        pthread_mutex_t lock;
+        /* Signalled when a frame is queued while the writer sleeps */
+        pthread_cond_t queued;
+        uint8_t writerWaiting;
+        /* Whether the last frame is the newest one in the queue */
+        uint8_t lastQueued;
+        uint8_t stopping;
+        pthread_t writer;
+        uint8_t joined;
+
+        /* One scaled line of the image, and its size in bytes */
+        uint8_t *line;
+        size_t lineLen;
+
+        /* Statistics */
+        uint64_t frames;
+        uint64_t written;
+        uint64_t dropped;
+        uint8_t failed;
+};
+
+struct capture *capture_init(enum capture_format format, char *path, uint32_t scale, size_t queueLen);
+void capture_destroy(struct capture **c);
+void capture_stop(struct capture *c);
+void capture_frame(struct capture *c, uint64_t disp[64][2], uint64_t lines, uint8_t hires);
+void capture_report(struct capture *c, FILE *fp);
+
+#endif
@@ -16,11 +16,22 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "audio.h"
+#include "capture.h"
 #include "chip8.h"
+#include "input.h"
 #include "runtime_error.h"
+#include "jit.h"
+#include "profile.h"
+#include "rewind.h"
+#include "sched.h"
+#include "threaded.h"
 
 
 
@@ -44,7 +55,30 @@ static const uint8_t font[] = {
         0xF0, 0x80, 0xF0, 0x80, 0xF0,
         0xF0, 0x80, 0xF0, 0x80, 0x80};
 
-static void clear_display(struct mState *ms);
+/* The SUPER-CHIP font, 8x10 characters for 0-9 A-F, stored after the
+ * small one */
+#define BIG_FONT_LEN 160
+static const uint8_t bigFont[] = {
+        0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,
+        0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,
+        0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,
+        0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,
+        0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,
+        0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0};
+
+static uint64_t clear_display(struct mState *ms);
+static void publish_display(struct mState *ms, uint64_t lines);
+static void flush_display(struct mState *ms);
 
 // returns the last 4 bits of ins
 static inline int8_t get4bit(int16_t ins){
@@ -70,39 +104,298 @@ static inline void get2Registers(int16_t ins, uint8_t *reg1, uint8_t *reg2){
 
 }
 
+/* Counts a timer down by n ticks, stopping at 0. Returns non zero if it
+ * changed. A value the execution thread sets part way through is counted
+ * down from instead of being overwritten */
+static inline int count_down(_Atomic uint8_t *timer, uint64_t n){
+        uint8_t t = atomic_load(timer);
+        do {
+                if(t == 0)
+                        return 0;
+        } while(!atomic_compare_exchange_weak(timer, &t, n < t ? t - n : 0));
+        return 1;
+}
+
+/* Returns non zero if the delay timer changed */
+static inline int tick_timers(struct mState *ms, uint64_t n){
+        count_down(&ms->sTimer, n);
+        return count_down(&ms->dTimer, n);
+}
+
+/* The sample tick, on the virtual clock frame, of the chip's sound ends
+ * at */
+static inline uint64_t tick_sample(struct mState *ms, uint64_t tick){
+        return ms->soundBase + tick * ms->audio->rate / 60;
+}
+
+/* Adds the sound up to the end of tick to the audio sink, for the n ticks
+ * ending there that are about to be counted off the sound timer. Only the
+ * thread ticking the timers calls it, so there is one producer. FX18 sets
+ * soundEdge before the sound timer, so an edge seen is never older than
+ * the timer */
+static void sound_ticks(struct mState *ms, uint64_t tick, uint64_t n){
+        struct audio *a = ms->audio;
+        uint64_t end = tick_sample(ms, tick);
+        uint8_t sound = ms->sTimer;
+        uint64_t edge = atomic_load(&ms->soundEdge);
+        if(edge > end)
+                edge = end;
+        if(sound != 0){
+                /* FX18 started the tone part way through */
+                if(!a->on)
+                        audio_render(a, edge, 0);
+                audio_render(a, (sound <= n) ? tick_sample(ms, tick - n + sound) : end, 1);
+        } else if(a->on){
+                /* FX18 stopped it */
+                audio_render(a, edge, 1);
+        }
+        audio_render(a, end, 0);
+}
+
+/* Ends a frame on the virtual clock */
+static inline void end_frame(struct mState *ms){
+        if(ms->audio != NULL)
+                sound_ticks(ms, ms->frames + 1 - ms->soundFrame, 1);
+        tick_timers(ms, 1);
+        ms->frames++;
+        ms->frameStart = ms->count;
+        if(ms->frames % atomic_load(&ms->turbo) == 0)
+                flush_display(ms);
+        if(ms->rewind != NULL)
+                rewind_capture(ms->rewind, ms);
+        if(ms->capture != NULL)
+                capture_frame(ms->capture, ms->disp, ms->dirty, ms->hires);
+        ms->dirty = 0;
+}
+
+/* xorshift32, each chip has its own generator so a seeded run repeats */
+static inline uint8_t next_random(struct mState *ms){
+        uint32_t x = ms->rngState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        ms->rngState = x;
+        return x >> 24;
+}
+
+static uint64_t now_ns(void){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleeps until the absolute time due, in steps short enough to notice the
+ * chip halting at low rates. Returns the time it woke */
+static uint64_t sleep_until(struct mState *ms, uint64_t due){
+        uint64_t now = now_ns();
+        while(now < due && ms->running){
+                uint64_t wake = due;
+                if(wake - now > CHIP8_PACE_MAX_SLEEP)
+                        wake = now + CHIP8_PACE_MAX_SLEEP;
+                struct timespec ts = { wake / 1000000000ULL, wake % 1000000000ULL };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                now = now_ns();
+        }
+        return now;
+}
+
+/* The emulated time, in ns, of the given tick */
+static inline uint64_t tick_time(uint64_t tick){
+        return tick / 60 * 1000000000ULL + (tick % 60 * 1000000000ULL + 59) / 60;
+}
+
+/* The emulated time at the wall clock time now. paceMutex must be held */
+static uint64_t emulated_ns(struct mState *ms, uint64_t now){
+        if(now < ms->clockWall)
+                return ms->clockEmulated;
+        return ms->clockEmulated + (now - ms->clockWall) * atomic_load(&ms->turbo);
+}
+
+/* The wall clock time the emulated time t comes at. paceMutex must be
+ * held */
+static uint64_t wall_ns(struct mState *ms, uint64_t t){
+        if(t < ms->clockEmulated)
+                return ms->clockWall;
+        return ms->clockWall + (t - ms->clockEmulated) / atomic_load(&ms->turbo);
+}
+
+/* The ticks due on the emulated clock by now */
+static uint64_t ticks_due_now(struct mState *ms){
+        pthread_mutex_lock(&ms->paceMutex);
+        uint64_t due = chip8_ticks_due(emulated_ns(ms, now_ns()));
+        pthread_mutex_unlock(&ms->paceMutex);
+        return due;
+}
+
+/* Sleeps until the emulated time t */
+static void sleep_until_emulated(struct mState *ms, uint64_t t){
+        pthread_mutex_lock(&ms->paceMutex);
+        uint64_t due = wall_ns(ms, t);
+        pthread_mutex_unlock(&ms->paceMutex);
+        sleep_until(ms, due);
+}
+
+/* Wakes for every tick on a timerfd, or by sleeping if one cannot be made,
+ * and applies however many ticks are due by then on the emulated clock.
+ * A wake up that comes late, or is missed, is made up on the next one, and
+ * when fast forwarding each wake up applies turbo ticks */
 static void *timerThread(void *data){
         struct mState *ms = (struct mState *) data;
-        struct timespec ts, ts2;
-        ts.tv_nsec = 16666666L;
-        ts.tv_sec = 0;
+        uint64_t done = 0;
+        int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if(fd >= 0){
+                uint64_t first = ms->tickStart + tick_time(1);
+                struct itimerspec its;
+                its.it_interval.tv_sec = 0;
+                its.it_interval.tv_nsec = CHIP8_TICK_NS;
+                its.it_value.tv_sec = first / 1000000000ULL;
+                its.it_value.tv_nsec = first % 1000000000ULL;
+                if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) != 0){
+                        close(fd);
+                        fd = -1;
+                }
+        }
         while(ms->running){
-                pthread_mutex_lock(&ms->timerMutex);
-                if(ms->dTimer != 0) ms->dTimer--;
-                if(ms->sTimer != 0) ms->sTimer--;
-                pthread_mutex_unlock(&ms->timerMutex);
-                nanosleep(&ts, &ts2);
+                uint64_t expirations;
+                if(fd < 0 || read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                        sleep_until_emulated(ms, tick_time(done + 1));
+                uint64_t due = ticks_due_now(ms);
+                if(due <= done)
+                        continue;
+                if(ms->audio != NULL)
+                        sound_ticks(ms, due, due - done);
+                /* wait_while_idle sets idleWaiting before it looks at the
+                 * delay timer, so either it sees the tick or it is woken */
+                if(tick_timers(ms, due - done) && atomic_load(&ms->idleWaiting)){
+                        pthread_mutex_lock(&ms->timerMutex);
+                        pthread_cond_broadcast(&ms->timerTicked);
+                        pthread_mutex_unlock(&ms->timerMutex);
+                }
+                done = due;
+                atomic_store(&ms->ticks, done);
         }
+        if(fd >= 0)
+                close(fd);
         pthread_exit(NULL);
 }
 
+/* Runs insPerFrame instructions per frame, and ticks the timers at the end of
+ * each frame, 60 frames a second on the emulated clock */
+static void frameScheduler(struct mState *ms){
+        uint64_t frames = 0;
+        while(ms->running){
+                if(chip8_run_frame(ms) != 0)
+                        return;
+                sleep_until_emulated(ms, tick_time(++frames));
+        }
+}
+
+static int idle_loop(struct mState *ms, uint16_t *start);
+
+/* Free running, sleeps while the chip is in an idle loop instead of
+ * spinning in it, until the timer thread ticks it out, or for good if it
+ * jumps to itself */
+static void wait_while_idle(struct mState *ms){
+        uint16_t start;
+        if(idle_loop(ms, &start) == 0)
+                return;
+        flush_display(ms);
+        pthread_mutex_lock(&ms->timerMutex);
+        atomic_store(&ms->idleWaiting, 1);
+        while(ms->running && idle_loop(ms, &start) != 0)
+                pthread_cond_wait(&ms->timerTicked, &ms->timerMutex);
+        atomic_store(&ms->idleWaiting, 0);
+        pthread_mutex_unlock(&ms->timerMutex);
+}
+
+/* The schedule a free running chip keeps to, owned by its execution
+ * thread */
+struct pacer {
+        uint64_t rate;
+        /* When the rate was set, and the count then */
+        uint64_t since;
+        uint64_t sinceCount;
+        /* When the current schedule started, and the count then */
+        uint64_t start;
+        uint64_t base;
+        /* Time lost falling behind the schedules before this one */
+        uint64_t lost;
+};
+
+/* Runs one batch of about a millisecond of instructions at rate, then
+ * sleeps until the absolute time the instructions executed since the
+ * schedule started are due. Neither the time spent running, nor the sleeps
+ * overshooting, add up. A chip that falls too far behind, after waiting in
+ * an idle loop or on a busy host, starts a new schedule instead of running
+ * flat out to catch up */
+static void run_paced(struct mState *ms, struct pacer *pc, uint64_t rate){
+        struct chip8_pace *p = &ms->pace;
+        uint64_t now = now_ns();
+        if(rate != pc->rate){
+                pc->rate = rate;
+                pc->since = pc->start = now;
+                pc->sinceCount = pc->base = ms->count;
+                pc->lost = 0;
+                pthread_mutex_lock(&ms->paceMutex);
+                memset(p, 0, sizeof(*p));
+                p->rate = (rate < UINT32_MAX) ? rate : UINT32_MAX;
+                pthread_mutex_unlock(&ms->paceMutex);
+        }
+        uint64_t batch = rate / CHIP8_PACE_HZ;
+        chip8_run_batch(ms, (batch != 0) ? batch : 1);
+
+        uint64_t n = ms->count - pc->base;
+        uint64_t due = pc->start + n / rate * 1000000000ULL + n % rate * 1000000000ULL / rate;
+        int resync = 0;
+        now = now_ns();
+        if(now > due + CHIP8_PACE_MAX_LAG){
+                resync = 1;
+                pc->lost += now - due;
+                pc->start = now;
+                pc->base = ms->count;
+        } else if(now < due){
+                now = sleep_until(ms, due);
+        }
+
+        pthread_mutex_lock(&ms->paceMutex);
+        if(resync){
+                p->resyncs++;
+        } else if(now >= due){
+                p->deadlines++;
+                p->lateTotal += now - due;
+                if(now - due > p->lateMax)
+                        p->lateMax = now - due;
+        }
+        p->instructions = ms->count - pc->sinceCount;
+        p->elapsed = now - pc->since - pc->lost;
+        pthread_mutex_unlock(&ms->paceMutex);
+}
+
 static void *executionThread(void * data){
         struct mState *ms = (struct mState *) data;
+        struct pacer pacer = {0};
         ms->count = 0;
+        if(ms->insPerFrame != 0){
+                frameScheduler(ms);
+                pthread_exit(NULL);
+        }
         while(ms->running){
-                uint16_t ins;
-                uint8_t lsins, msins;
-                msins = ms->mem[ms->pc];
-                lsins = ms->mem[ms->pc + 1];
-                ins = ((uint16_t) (msins)) << 8;
-                ins |= lsins;
-                //printf("%x\n", ins);
-                run_instruction(ms, ins);
-                ms->count++;
-                if(ms->pc > 4095){
+                wait_while_idle(ms);
+                pthread_mutex_lock(&ms->paceMutex);
+                uint64_t rate = (uint64_t) ms->insPerSecond * atomic_load(&ms->turbo);
+                pthread_mutex_unlock(&ms->paceMutex);
+                if(rate != 0)
+                        run_paced(ms, &pacer, rate);
+                else
+                        chip8_run_batch(ms, CHIP8_BATCH_SIZE);
+                if(ms->unpublished != 0 && now_ns() - ms->lastPublish >= 1000000000ULL / CHIP8_PRESENT_HZ)
+                        flush_display(ms);
+                if((uint16_t) ms->pc > 4094){
                         puts("PC > memory size");
-                        pthread_exit(NULL);
+                        break;
                 }
         }
+        flush_display(ms);
         pthread_exit(NULL);
 }
 
@@ -112,30 +405,79 @@ void chip8_key_event_notify(struct mState *ms, struct keyEvent ke){
                 return;
         }
         pthread_mutex_lock(&ms->keyMutex);
+        /* A recorded chip takes its events between batches, a replayed one
+         * only from the log */
+        if(ms->input != NULL && input_queue(ms->input, ke)){
+                pthread_mutex_unlock(&ms->keyMutex);
+                return;
+        }
         ms->lastEvent = ke;
         if(ke.type == Pressed){
                 ms->keys[ke.key] = 1;
         } else {
                 ms->keys[ke.key] = 0;
         }
+        /* A scheduled chip waiting for a key is parked, not waiting on the
+         * condition */
+        if(ke.type == Pressed && ms->sched != NULL)
+                sched_wake(ms);
         pthread_cond_signal(&ms->incomingKeyEvent);
         pthread_mutex_unlock(&ms->keyMutex);
 }
 
-struct mState *chip8_init(void){
+/* Allocates and resets the machine state without attaching a UI */
+static struct mState *chip8_alloc(void){
         struct mState *ms = malloc(sizeof(struct mState));
         if(ms == NULL) return NULL;
         ms->stack = calloc(48, sizeof(int16_t));
-        if(ms->stack == NULL) goto mStateInitFail;
+        if(ms->stack == NULL) goto stackFail;
         ms->stackSize = 0;
         ms->stackCapacity = 48;
         ms->pc = 0x200;
         ms->sTimer = 0;
         ms->dTimer = 0;
         ms->iRegister = 0;
+        ms->count = 0;
+        ms->running = 0;
+        ms->headless = 0;
+        ms->waitingForKey = 0;
+        ms->insPerFrame = 0;
+        ms->insPerSecond = 0;
+        memset(&ms->pace, 0, sizeof(ms->pace));
+        ms->timerThreadStarted = 0;
+        ms->tickStart = 0;
+        atomic_init(&ms->turbo, 1);
+        ms->clockWall = 0;
+        ms->clockEmulated = 0;
+        ms->unpublished = 0;
+        ms->lastPublish = 0;
+        atomic_init(&ms->ticks, 0);
+        atomic_init(&ms->idleWaiting, 0);
+        ms->display = NULL;
+        ms->jit = NULL;
+        ms->sched = NULL;
+        ms->schedNext = NULL;
+        ms->schedState = SCHED_DONE;
+        ms->rewind = NULL;
+        ms->capture = NULL;
+        ms->profile = NULL;
+        ms->input = NULL;
+        ms->frames = 0;
+        ms->frameStart = 0;
+        ms->audio = NULL;
+        ms->soundBase = 0;
+        ms->soundFrame = 0;
+        atomic_init(&ms->soundEdge, 0);
+        ms->lastEvent.type = Released;
+        ms->lastEvent.key = 0;
         for(int i = 0; i < 16; i++)
                 ms->registers[i] = 0;
-        clear_display(ms);
+        memset(ms->disp, 0, sizeof(ms->disp));
+        ms->hires = 0;
+        ms->dirty = 0;
+        memset(ms->rplFlags, 0, sizeof(ms->rplFlags));
+        memset(ms->mem, 0, sizeof(ms->mem));
+        chip8_seed(ms, rand());
 
         /* Zero the key state */
         for(size_t i = 0; i < 16; i++){
@@ -147,6 +489,35 @@ struct mState *chip8_init(void){
          * http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#2.4 */
         for(size_t i = 0; i < FONT_LEN; i++)
                 ms->mem[i] = font[i];
+        for(size_t i = 0; i < BIG_FONT_LEN; i++)
+                ms->mem[FONT_LEN + i] = bigFont[i];
+#ifdef CHIP8_JIT_CORE
+        /* Hardened systems refuse writable, executable memory. The chip is
+         * interpreted instead, see run_engine */
+        ms->jit = jit_init();
+        if(ms->jit == NULL)
+                fprintf(stderr, "Could not map memory for the JIT, interpreting instead\n");
+#endif
+        decode_invalidate_all(ms);
+
+        /* Setup mutexs */
+        pthread_mutex_init(&ms->timerMutex, NULL);
+        pthread_mutex_init(&ms->keyMutex, NULL);
+        pthread_mutex_init(&ms->paceMutex, NULL);
+
+        /* Setup the conditon variables */
+        pthread_cond_init(&ms->incomingKeyEvent, NULL);
+        pthread_cond_init(&ms->timerTicked, NULL);
+
+        return ms;
+stackFail:
+        free(ms);
+        return NULL;
+}
+
+struct mState *chip8_init(void){
+        struct mState *ms = chip8_alloc();
+        if(ms == NULL) return NULL;
 
         /* init the UI */
         ms->display = ui_init();
@@ -155,23 +526,303 @@ struct mState *chip8_init(void){
 
         return ms;
 uiInitFail:
-mStateInitFail:
-        free(ms);
+        chip8_destroy(&ms);
         return NULL;
 }
 
+/* Creates a chip8 with no UI. No window, GL context or display copy is ever
+ * created, the machine is driven synchronously by chip8_run_headless */
+struct mState *chip8_init_headless(void){
+        struct mState *ms = chip8_alloc();
+        if(ms == NULL) return NULL;
+        ms->headless = 1;
+        ms->insPerFrame = CHIP8_DEFAULT_IPF;
+        return ms;
+}
+
+void chip8_seed(struct mState *ms, uint32_t seed){
+        /* xorshift never leaves zero */
+        ms->rngState = (seed != 0) ? seed : 0x9E3779B9;
+}
+
 void chip8_destroy(struct mState **ms){
         if(*ms == NULL) return;
-        ui_destroy(&(*ms)->display);
+        if((*ms)->display != NULL)
+                ui_destroy(&(*ms)->display);
+        pthread_cond_destroy(&(*ms)->incomingKeyEvent);
+        pthread_cond_destroy(&(*ms)->timerTicked);
+        pthread_mutex_destroy(&(*ms)->timerMutex);
+        pthread_mutex_destroy(&(*ms)->keyMutex);
+        pthread_mutex_destroy(&(*ms)->paceMutex);
+#ifdef CHIP8_JIT_CORE
+        jit_destroy(&(*ms)->jit);
+#endif
         free((*ms)->stack);
         free(*ms);
         *ms = NULL;
 }
 
-static void clear_display(struct mState *ms){
-        for(int i = 0; i < 32; i++)
-                for(int j = 0; j < 8; j++)
-                        ms->disp[i][j] = 0;
+/* The lines with a pixel set. Nothing outside the current mode's part of
+ * the display is ever set, switching modes clears it */
+static uint64_t drawn_lines(struct mState *ms){
+        uint64_t lines = 0;
+        for(int i = 0; i < CHIP8_LINES; i++)
+                lines |= (uint64_t) ((ms->disp[i][0] | ms->disp[i][1]) != 0) << i;
+        return lines;
+}
+
+/* Returns the lines that were not already clear */
+static uint64_t clear_display(struct mState *ms){
+        uint64_t lines = drawn_lines(ms);
+        memset(ms->disp, 0, sizeof(ms->disp));
+        return lines;
+}
+
+/* 00FE and 00FF. The display is cleared, the modes lay pixels out
+ * differently. A switch marks every line, so the UI and the sinks see it
+ * even when the display was blank */
+static uint64_t set_resolution(struct mState *ms, uint8_t hires){
+        uint64_t lines = clear_display(ms);
+        if(ms->hires == hires)
+                return lines;
+        ms->hires = hires;
+        return CHIP8_ALL_LINES;
+}
+
+/* 00CN, moves every line down n lines of the current mode, the ones
+ * pushed off the bottom are lost */
+static uint64_t scroll_down(struct mState *ms, uint8_t n){
+        size_t height = ms->hires ? CHIP8_LINES : CHIP8_LINES / 2;
+        uint64_t lines = drawn_lines(ms);
+        if(n == 0 || lines == 0)
+                return 0;
+        memmove(ms->disp[n], ms->disp[0], (height - n) * sizeof(ms->disp[0]));
+        memset(ms->disp[0], 0, n * sizeof(ms->disp[0]));
+        return lines | drawn_lines(ms);
+}
+
+/* 00FB and 00FC, moves every line 4 pixels of the current mode right, or
+ * left. A line is a shift of its one word in low resolution, and of its
+ * two read as one 128 bit number in high */
+static uint64_t scroll_sideways(struct mState *ms, int left){
+        uint64_t lines = drawn_lines(ms);
+        for(uint64_t todo = lines; todo != 0; todo &= todo - 1){
+                uint64_t *line = ms->disp[__builtin_ctzll(todo)];
+                if(ms->hires){
+                        unsigned __int128 v = (unsigned __int128) line[0] << 64 | line[1];
+                        v = left ? v << 4 : v >> 4;
+                        line[0] = v >> 64;
+                        line[1] = v;
+                } else {
+                        line[0] = left ? line[0] << 4 : line[0] >> 4;
+                }
+        }
+        return lines;
+}
+
+/* The SUPER-CHIP 00CN, and 00FB to 00FF. 00FD exits the program, it
+ * stays on the instruction until the chip is stopped */
+static void run_schip_op(struct mState *ms, uint16_t ins){
+        if((ins & 0xFFF0) == 0x00C0)
+                publish_display(ms, scroll_down(ms, ins & 0xF));
+        else if(ins == 0x00FB)
+                publish_display(ms, scroll_sideways(ms, 0));
+        else if(ins == 0x00FC)
+                publish_display(ms, scroll_sideways(ms, 1));
+        else if(ins == 0x00FD)
+                return;
+        else
+                publish_display(ms, set_resolution(ms, ins == 0x00FF));
+        ms->pc += 2;
+}
+
+/* Marks the lines that changed as dirty, for the sinks at the end of the
+ * frame, and as unpublished, for flush_display to hand to the UI */
+static void publish_display(struct mState *ms, uint64_t lines){
+        ms->dirty |= lines;
+        ms->unpublished |= lines;
+}
+
+/* Hands the lines drawn since the last time to the UI. Drawing only marks
+ * lines, the display is handed over at the end of every frame, or every
+ * turbo frames, on the virtual clock, and free running after a batch at
+ * most CHIP8_PRESENT_HZ times a second, and before waiting, so fast
+ * forwarding is not held back by copying displays no one sees */
+static void flush_display(struct mState *ms){
+        if(ms->unpublished == 0)
+                return;
+        if(ms->display != NULL)
+                ui_set_chip8_display(ms->display, ms->disp, ms->unpublished, ms->hires);
+        ms->unpublished = 0;
+        ms->lastPublish = now_ns();
+}
+
+/* Fetches, and executes the instruction at the program counter */
+#if defined(CHIP8_PREDECODE_CORE) || defined(CHIP8_THREADED_CORE) || defined(CHIP8_JIT_CORE)
+void chip8_step(struct mState *ms){
+#ifdef CHIP8_PROFILE
+        if(ms->profile != NULL)
+                profile_step(ms->profile, ms);
+#endif
+        decode_execute(ms);
+        ms->count++;
+}
+#else
+void chip8_step(struct mState *ms){
+        uint16_t ins;
+        uint8_t lsins, msins;
+#ifdef CHIP8_PROFILE
+        if(ms->profile != NULL)
+                profile_step(ms->profile, ms);
+#endif
+        msins = ms->mem[ms->pc];
+        lsins = ms->mem[ms->pc + 1];
+        ins = ((uint16_t) (msins)) << 8;
+        ins |= lsins;
+        run_instruction(ms, ins);
+        ms->count++;
+}
+#endif
+
+/* Executes up to n instructions like chip8_run_batch, delivering the key
+ * events of a recording, or replay, at the instruction counts they belong
+ * to */
+static uint64_t run_with_input(struct mState *ms, uint64_t n){
+        if(ms->input == NULL)
+                return chip8_run_batch(ms, n);
+        uint64_t done = 0;
+        while(done < n){
+                input_deliver(ms->input, ms);
+                uint64_t m = n - done;
+                uint64_t next = input_next(ms->input);
+                if(next - ms->count < m)
+                        m = next - ms->count;
+                uint64_t ran = chip8_run_batch(ms, m);
+                done += ran;
+                if(ran < m)
+                        break;
+        }
+        return done;
+}
+
+/* Runs one frame on the virtual clock, insPerFrame instructions followed
+ * by a timer tick. Returns 0, or -1 if the PC left memory */
+int chip8_run_frame(struct mState *ms){
+        run_with_input(ms, ms->insPerFrame);
+        if((uint16_t) ms->pc > 4094){
+                puts("PC > memory size");
+                return -1;
+        }
+        end_frame(ms);
+        return 0;
+}
+
+/* Executes up to n instructions one at a time with chip8_step */
+static inline uint64_t step_engine(struct mState *ms, uint64_t n){
+        uint64_t i;
+        for(i = 0; i < n && (uint16_t) ms->pc <= 4094; i++)
+                chip8_step(ms);
+        return i;
+}
+
+/* Executes up to n instructions with the engine of the build, stopping
+ * early if the PC leaves memory. Profiling builds step through chip8_step
+ * with every engine, so each instruction is seen, and a JIT build without
+ * its code buffer steps too */
+#if defined(CHIP8_THREADED_CORE) && !defined(CHIP8_PROFILE)
+static uint64_t run_engine(struct mState *ms, uint64_t n){
+        return threaded_run(ms, n);
+}
+#elif defined(CHIP8_JIT_CORE) && !defined(CHIP8_PROFILE)
+static uint64_t run_engine(struct mState *ms, uint64_t n){
+        if(ms->jit == NULL)
+                return step_engine(ms, n);
+        return jit_run(ms, n);
+}
+#else
+static uint64_t run_engine(struct mState *ms, uint64_t n){
+        return step_engine(ms, n);
+}
+#endif
+
+static inline uint16_t fetch(struct mState *ms, uint16_t addr){
+        return ((uint16_t) ms->mem[addr]) << 8 | ms->mem[addr + 1];
+}
+
+/* Recognizes the loops programs spin in with nothing to do until the delay
+ * timer next ticks, or ever: FX07 3XNN 1NNN back to the FX07, a jump to
+ * itself, and 00FD, which stays on itself once the program exits. Returns
+ * the number of instructions in the loop the PC is in, setting start to
+ * the address of the first, or 0 if the PC is not in one or the loop is
+ * about to exit */
+static int idle_loop(struct mState *ms, uint16_t *start){
+        uint16_t pc = ms->pc;
+#ifdef CHIP8_PROFILE
+        /* The profile has to see every instruction */
+        if(ms->profile != NULL)
+                return 0;
+#endif
+        if(pc > 4094)
+                return 0;
+        if(fetch(ms, pc) == (0x1000 | pc) || fetch(ms, pc) == 0x00FD){
+                *start = pc;
+                return 1;
+        }
+        for(int phase = 0; phase < 3 && 2 * phase <= pc; phase++){
+                uint16_t a = pc - 2 * phase;
+                if(a > 4090)
+                        continue;
+                uint16_t get = fetch(ms, a);
+                uint16_t skip = fetch(ms, a + 2);
+                uint8_t x = (get >> 8) & 0xF;
+                if((get & 0xF0FF) != 0xF007 || (skip & 0xFF00) != (0x3000 | x << 8) ||
+                                fetch(ms, a + 4) != (0x1000 | a))
+                        continue;
+                uint8_t nn = skip & 0xFF;
+                /* FX07 is yet to load VX, unless the PC is at the skip */
+                if(ms->dTimer == nn || (phase == 1 && ms->registers[x] == nn))
+                        return 0;
+                *start = a;
+                return 3;
+        }
+        return 0;
+}
+
+/* Executes n instructions of the idle loop at start, len instructions
+ * long, at once. Nothing they read changes until the timers tick, so the
+ * only differences they make are the PC, the count, and the register FX07
+ * loads */
+static void skip_idle(struct mState *ms, uint16_t start, int len, uint64_t n){
+        int phase = (ms->pc - start) / 2;
+        if(len == 3 && n > (uint64_t) (3 - phase) % 3)
+                ms->registers[ms->mem[start] & 0xF] = ms->dTimer;
+        ms->pc = start + 2 * ((phase + n) % len);
+        ms->count += n;
+}
+
+/* Executes up to n instructions, stopping early if the PC leaves memory.
+ * Once the chip is in an idle loop the rest of the instructions are
+ * skipped, ending in exactly the state running them would. The running
+ * flag is not checked, callers check it between batches. Returns the
+ * number of instructions executed */
+uint64_t chip8_run_batch(struct mState *ms, uint64_t n){
+        uint64_t done = 0;
+        while(done < n){
+                uint16_t start;
+                int len = idle_loop(ms, &start);
+                if(len != 0){
+                        skip_idle(ms, start, len, n - done);
+                        return n;
+                }
+                uint64_t m = n - done;
+                if(m > CHIP8_IDLE_CHECK)
+                        m = CHIP8_IDLE_CHECK;
+                uint64_t ran = run_engine(ms, m);
+                done += ran;
+                if(ran < m)
+                        break;
+        }
+        return done;
 }
 
 
@@ -180,8 +831,7 @@ void run_instruction(struct mState *ms, uint16_t ins){
         switch(opc){
                 case 0x0:
                         if(ins == 0x00E0) {
-                                clear_display(ms);
-                                ui_set_chip8_display(ms->display, ms->disp);
+                                publish_display(ms, clear_display(ms));
                                 ms->pc += 2;
                         } else if(ins == 0x00EE){
                                 if(ms->stackSize == 0){
@@ -190,6 +840,8 @@ void run_instruction(struct mState *ms, uint16_t ins){
                                         ms->pc = ms->stack[ms->stackSize - 1];
                                         ms->stackSize--;
                                 }
+                        } else if(chip8_schip_op(ins)){
+                                run_schip_op(ms, ins);
                         } else {
                                 ms->pc = get12bit(ins);
                         }
@@ -322,7 +974,7 @@ void run_instruction(struct mState *ms, uint16_t ins){
                 case 0xC:{
                         uint8_t rID;
                         getRegister(ins, &rID);
-                        ms->registers[rID] = (rand() % 256) & get8bit(ins);
+                        ms->registers[rID] = next_random(ms) & get8bit(ins);
                         ms->pc += 2;
                         }break;
                 case 0xD:{
@@ -332,40 +984,43 @@ void run_instruction(struct mState *ms, uint16_t ins){
                         get2Registers(ins, &rID1, &rID2);
                         uint8_t x = ms->registers[rID1];
                         uint8_t y = ms->registers[rID2];
+                        uint8_t width = ms->hires ? 128 : 64;
+                        uint8_t height = ms->hires ? 64 : 32;
+                        /* DXY0 draws a 16x16 sprite of two bytes a row */
+                        uint8_t rows = (n == 0) ? 16 : n;
                         /* wrap X to fit in the screan */
-                        x = x % 64;
+                        x = x % width;
                         /* wrap y to fit in the screen */
-                        y = y % 32;
-                        for(size_t i = 0; i < n; i++){
-                                uint8_t rData = ms->mem[ms->iRegister + i];
-                                /* wrap row if the row is greater > 32 */
-                                uint8_t *row = ms->disp[(y + i) % 32];
-                                uint8_t vf = 0;
-                                /*The first byte that needs updating */
-                                uint8_t sCell = x / 8;
-                                /* The number needed to change in the next byte */
-                                uint8_t overLap = x % 8;
-                                /* The second byte that needs updating */
-                                uint8_t eCell = (x / 8) + (overLap != 0);
-
-                                /* Wrap sprite to the start of the line */
-                                if(eCell > 7)
-                                        eCell = 0;
-                                if(sCell == eCell){
-                                        vf = ((row[sCell] & rData) != 0);
-                                                row[sCell] ^= rData;
+                        y = y % height;
+                        uint64_t hit = 0;
+                        uint64_t lines = 0;
+                        for(size_t i = 0; i < rows; i++){
+                                /* Put the sprite row at the left edge, and
+                                 * rotate it into place, wrapping the part
+                                 * past the right edge to the start */
+                                uint64_t rData;
+                                if(n == 0)
+                                        rData = (uint64_t) (ms->mem[(ms->iRegister + 2 * i) & 0xFFF] << 8 |
+                                                        ms->mem[(ms->iRegister + 2 * i + 1) & 0xFFF]) << 48;
+                                else
+                                        rData = (uint64_t) ms->mem[(ms->iRegister + i) & 0xFFF] << 56;
+                                /* wrap row if the row is past the bottom */
+                                uint64_t *row = ms->disp[(y + i) % height];
+                                if(ms->hires){
+                                        unsigned __int128 r = (unsigned __int128) rData << 64;
+                                        r = (r >> x) | (r << ((128 - x) & 127));
+                                        hit |= (row[0] & (uint64_t) (r >> 64)) | (row[1] & (uint64_t) r);
+                                        row[0] ^= r >> 64;
+                                        row[1] ^= r;
                                 } else {
-                                        if(row[sCell] & (rData >> overLap))
-                                                vf = 1;
-
-                                        row[sCell] ^= rData >> overLap;
-                                        if(row[eCell] & (rData << (8 - overLap)))
-                                                vf = 1;
-                                        row[eCell] ^= rData << (8 - overLap);
+                                        rData = (rData >> x) | (rData << ((64 - x) & 63));
+                                        hit |= row[0] & rData;
+                                        row[0] ^= rData;
                                 }
-                                ms->registers[0xF] = vf;
+                                lines |= (uint64_t) (rData != 0) << ((y + i) % height);
                         }
-                        ui_set_chip8_display(ms->display, ms->disp);
+                        ms->registers[0xF] = (hit != 0);
+                        publish_display(ms, lines);
                         ms->pc += 2;
                         /* TODO: render the screen */
                         }break;
@@ -375,13 +1030,13 @@ void run_instruction(struct mState *ms, uint16_t ins){
                         getRegister(ins, &rID);
                         switch(sopc){
                                 case 0x9E:
-                                        if(ms->keys[ms->registers[rID]])
+                                        if(ms->keys[ms->registers[rID] & 0xF])
                                                 ms->pc += 4;
                                         else
                                                 ms->pc += 2;
                                         break;
                                 case 0xA1:
-                                        if(!ms->keys[ms->registers[rID]])
+                                        if(!ms->keys[ms->registers[rID] & 0xF])
                                                 ms->pc += 4;
                                         else
                                                 ms->pc += 2;
@@ -395,14 +1050,32 @@ void run_instruction(struct mState *ms, uint16_t ins){
                         getRegister(ins, &rID);
                         switch(sopc){
                                 case 0x07:
-                                        pthread_mutex_lock(&ms->timerMutex);
                                         ms->registers[rID] = ms->dTimer;
-                                        pthread_mutex_unlock(&ms->timerMutex);
                                         break;
                                 case 0x0A:{
                                         struct timespec ts;
+                                        if(ms->insPerFrame != 0){
+                                                /* Blocking would stop the virtual clock, and nothing
+                                                 * can wake a headless chip, so poll for a key press
+                                                 * by re-executing this instruction until one
+                                                 * arrives */
+                                                pthread_mutex_lock(&ms->keyMutex);
+                                                if(!ms->waitingForKey){
+                                                        ms->lastEvent.type = Released;
+                                                        ms->waitingForKey = 1;
+                                                }
+                                                if(ms->lastEvent.type != Pressed){
+                                                        pthread_mutex_unlock(&ms->keyMutex);
+                                                        return;
+                                                }
+                                                ms->registers[rID] = ms->lastEvent.key;
+                                                ms->waitingForKey = 0;
+                                                pthread_mutex_unlock(&ms->keyMutex);
+                                                break;
+                                        }
                                         //ts.tv_nsec = 500000000;
                                         ms->lastEvent.type = Released;
+                                        flush_display(ms);
                                         while(ms->running){
                                                 //gettimeofday(&now, NULL);
                                                 //clock_gettime(CLOCK_REALTIME, &ts);
@@ -421,14 +1094,12 @@ void run_instruction(struct mState *ms, uint16_t ins){
                                         //pthread_mutex_unlock(&ms->keyMutex);
                                         }break;
                                 case 0x15:
-                                        pthread_mutex_lock(&ms->timerMutex);
                                         ms->dTimer = ms->registers[rID];
-                                        pthread_mutex_unlock(&ms->timerMutex);
                                         break;
                                 case 0x18:
-                                        pthread_mutex_lock(&ms->timerMutex);
+                                        if(ms->audio != NULL)
+                                                chip8_sound_edge(ms);
                                         ms->sTimer = ms->registers[rID];
-                                        pthread_mutex_unlock(&ms->timerMutex);
                                         break;
                                 case 0x1E:
                                         ms->iRegister += ms->registers[rID];
@@ -436,18 +1107,29 @@ void run_instruction(struct mState *ms, uint16_t ins){
                                 case 0x29:
                                         ms->iRegister = ms->registers[rID] * 5;
                                         break;
+                                case 0x30:
+                                        ms->iRegister = FONT_LEN + (ms->registers[rID] & 0xF) * 10;
+                                        break;
                                 case 0x33:
-                                        ms->mem[ms->iRegister] = ms->registers[rID] / 100;
-                                        ms->mem[ms->iRegister + 1] = (ms->registers[rID] % 100) / 10;
-                                        ms->mem[ms->iRegister + 2] = (ms->registers[rID] % 10);
+                                        ms->mem[ms->iRegister & 0xFFF] = ms->registers[rID] / 100;
+                                        ms->mem[(ms->iRegister + 1) & 0xFFF] = (ms->registers[rID] % 100) / 10;
+                                        ms->mem[(ms->iRegister + 2) & 0xFFF] = (ms->registers[rID] % 10);
+                                        decode_invalidate(ms, ms->iRegister, 3);
                                         break;
                                 case 0x55:
+                                        decode_invalidate(ms, ms->iRegister, rID + 1);
                                         for(size_t i = 0; i <= rID; i++)
-                                                ms->mem[ms->iRegister++] = ms->registers[i];
+                                                ms->mem[ms->iRegister++ & 0xFFF] = ms->registers[i];
                                         break;
                                 case 0x65:
                                         for(size_t i = 0; i <= rID; i++)
-                                                ms->registers[i] = ms->mem[ms->iRegister++];
+                                                ms->registers[i] = ms->mem[ms->iRegister++ & 0xFFF];
+                                        break;
+                                case 0x75:
+                                        memcpy(ms->rplFlags, ms->registers, rID + 1);
+                                        break;
+                                case 0x85:
+                                        memcpy(ms->registers, ms->rplFlags, rID + 1);
                                         break;
                         }
                         ms->pc += 2;
@@ -459,18 +1141,24 @@ void run_instruction(struct mState *ms, uint16_t ins){
 void chip8_run(struct mState *ms){
         /* set the state to running */
         ms->running = 1;
+        decode_invalidate_all(ms);
         
         /* Start the UI */
-        ui_run(ms->display);
-
-        /* Setup mutexs */
-        pthread_mutex_init(&ms->timerMutex, NULL);
-        pthread_mutex_init(&ms->keyMutex, NULL);
-
-        /* Setup the conditon variables */
-        pthread_cond_init(&ms->incomingKeyEvent, NULL);
+        if(ms->display != NULL)
+                ui_run(ms->display);
 
-        pthread_create(&ms->tThread, NULL, timerThread, ((void *) ms));
+        /* On the virtual clock the execution thread ticks the timers */
+        ms->timerThreadStarted = (ms->insPerFrame == 0);
+        ms->tickStart = now_ns();
+        atomic_store(&ms->ticks, 0);
+        pthread_mutex_lock(&ms->paceMutex);
+        ms->clockWall = ms->tickStart;
+        ms->clockEmulated = 0;
+        pthread_mutex_unlock(&ms->paceMutex);
+        if(ms->audio != NULL)
+                chip8_set_audio(ms, ms->audio);
+        if(ms->timerThreadStarted)
+                pthread_create(&ms->tThread, NULL, timerThread, ((void *) ms));
         pthread_create(&ms->eThread, NULL, executionThread, ((void *) ms));
 }
 
@@ -478,20 +1166,150 @@ void chip8_halt(struct mState *ms){
         /* stop the threads */
         ms->running = 0;
         pthread_cond_broadcast(&ms->incomingKeyEvent);
+        pthread_mutex_lock(&ms->timerMutex);
+        pthread_cond_broadcast(&ms->timerTicked);
+        pthread_mutex_unlock(&ms->timerMutex);
 
         /* wait for the threads to terminate */
         pthread_join(ms->eThread, NULL);
-        pthread_join(ms->tThread, NULL);
+        if(ms->timerThreadStarted)
+                pthread_join(ms->tThread, NULL);
+        ms->timerThreadStarted = 0;
 
         /* Stop the UI */
-        ui_halt(ms->display);
-        
-        /* destroy the condition varibales */
-        pthread_cond_destroy(&ms->incomingKeyEvent);
+        if(ms->display != NULL)
+                ui_halt(ms->display);
+}
 
-        /* destroy the mutexs */
-        pthread_mutex_destroy(&ms->timerMutex);
-        pthread_mutex_destroy(&ms->keyMutex);
+/* Runs the chip on the calling thread until maxInstructions instructions or
+ * maxFrames 60 Hz frames have been executed, whichever comes first. A limit
+ * of 0 is ignored, if both are 0 nothing is run. The chip runs on the
+ * virtual clock as fast as the host allows, the timers are ticked once per
+ * frame of insPerFrame instructions. Returns the number of instructions
+ * executed */
+uint64_t chip8_run_headless(struct mState *ms, uint64_t maxInstructions, uint64_t maxFrames){
+        uint64_t start = ms->count;
+        uint64_t frames = 0;
+        if(maxInstructions == 0 && maxFrames == 0)
+                return 0;
+        if(ms->insPerFrame == 0)
+                ms->insPerFrame = CHIP8_DEFAULT_IPF;
+        decode_invalidate_all(ms);
+        ms->running = 1;
+        while(ms->running){
+                uint64_t n = ms->insPerFrame;
+                if(maxInstructions != 0 && maxInstructions - (ms->count - start) < n)
+                        n = maxInstructions - (ms->count - start);
+                run_with_input(ms, n);
+                if((uint16_t) ms->pc > 4094){
+                        puts("PC > memory size");
+                        break;
+                }
+                /* The instruction limit ended the run part way through a
+                 * frame */
+                if(n < ms->insPerFrame)
+                        break;
+                end_frame(ms);
+                frames++;
+                if(maxFrames != 0 && frames >= maxFrames)
+                        break;
+        }
+        ms->running = 0;
+        return ms->count - start;
+}
+
+/* Plays the chip's buzzer on audio from the next frame, or wall clock
+ * tick, on, or stops playing it if audio is NULL. The chip must not be
+ * running */
+void chip8_set_audio(struct mState *ms, struct audio *audio){
+        ms->audio = audio;
+        if(audio == NULL)
+                return;
+        ms->soundBase = audio->position;
+        ms->soundFrame = ms->frames;
+        atomic_store(&ms->soundEdge, audio->position);
+}
+
+/* Notes the sample FX18 is executing at, so the tone starts, or stops, on
+ * it. The threaded engine only counts instructions at the end of a batch,
+ * with it the edge falls on the start of the batch */
+void chip8_sound_edge(struct mState *ms){
+        uint64_t rate = ms->audio->rate;
+        uint64_t sample;
+        if(ms->insPerFrame != 0){
+                uint64_t ipf = ms->insPerFrame;
+                uint64_t into = ms->count - ms->frameStart;
+                if(into >= ipf)
+                        into = ipf - 1;
+                sample = tick_sample(ms, ms->frames - ms->soundFrame) + into * rate / (60 * ipf);
+        } else {
+                pthread_mutex_lock(&ms->paceMutex);
+                uint64_t elapsed = emulated_ns(ms, now_ns());
+                pthread_mutex_unlock(&ms->paceMutex);
+                sample = ms->soundBase + elapsed / 1000000000ULL * rate + elapsed % 1000000000ULL * rate / 1000000000ULL;
+        }
+        atomic_store(&ms->soundEdge, sample);
+}
+
+/* Runs the emulated clock factor times as fast as the wall clock, timers,
+ * frames and any rate limit included, or at normal speed if factor is 0
+ * or 1. Factors above CHIP8_MAX_TURBO are clamped. The chip may be
+ * running, the change is made from the current emulated time on */
+void chip8_set_turbo(struct mState *ms, uint32_t factor){
+        if(factor == 0)
+                factor = 1;
+        if(factor > CHIP8_MAX_TURBO)
+                factor = CHIP8_MAX_TURBO;
+        pthread_mutex_lock(&ms->paceMutex);
+        uint64_t now = now_ns();
+        ms->clockEmulated = emulated_ns(ms, now);
+        ms->clockWall = now;
+        atomic_store(&ms->turbo, factor);
+        pthread_mutex_unlock(&ms->paceMutex);
+}
+
+/* Limits a free running chip to rate instructions per second, or lets it
+ * run as fast as the host allows if rate is 0. Takes effect from the next
+ * batch, the chip may be running */
+void chip8_set_rate(struct mState *ms, uint32_t rate){
+        pthread_mutex_lock(&ms->paceMutex);
+        ms->insPerSecond = rate;
+        pthread_mutex_unlock(&ms->paceMutex);
+}
+
+/* Copies how closely the chip has kept to its rate since it was set */
+void chip8_get_pace(struct mState *ms, struct chip8_pace *pace){
+        pthread_mutex_lock(&ms->paceMutex);
+        *pace = ms->pace;
+        pthread_mutex_unlock(&ms->paceMutex);
+}
+
+void chip8_pace_report(struct mState *ms, FILE *fp){
+        struct chip8_pace p;
+        chip8_get_pace(ms, &p);
+        if(p.rate == 0 || p.elapsed == 0)
+                return;
+        fprintf(fp, "PACE: %.0f instructions/s of %u, %lu deadlines, late by %.1f us on average, %.1f us at most, %lu resyncs\n",
+                        p.instructions * 1e9 / p.elapsed, p.rate,
+                        (unsigned long) p.deadlines,
+                        (p.deadlines != 0) ? p.lateTotal / 1e3 / p.deadlines : 0.0,
+                        p.lateMax / 1e3, (unsigned long) p.resyncs);
+}
+
+/* Writes the registers, and display as text to fp */
+void chip8_dump_state(struct mState *ms, FILE *fp){
+        fprintf(fp, "PC: 0x%03x I: 0x%03x DT: 0x%02x ST: 0x%02x SP: %lu COUNT: %lu\n",
+                        ms->pc, ms->iRegister, ms->dTimer, ms->sTimer,
+                        ms->stackSize, ms->count);
+        for(int i = 0; i < 16; i++)
+                fprintf(fp, "V%X: 0x%02x%c", i, ms->registers[i], (i % 8 == 7) ? '\n' : ' ');
+        int width = ms->hires ? 128 : 64;
+        int height = ms->hires ? 64 : 32;
+        for(int y = 0; y < height; y++){
+                for(int x = 0; x < width; x++)
+                        fputc((ms->disp[y][x / 64] >> (63 - x % 64)) & 1 ? '#' : '.', fp);
+                fputc('\n', fp);
+        }
 }
 
 struct runtime_error *chip8_load_rom(struct mState *ms, char *file){
@@ -514,6 +1332,7 @@ struct runtime_error *chip8_load_rom(struct mState *ms, char *file){
         }
 
         fread(ms->mem + 0x200,  1, len, fp);
+        decode_invalidate(ms, 0x200, len);
 
         fclose(fp);
         return NULL;
@@ -16,13 +16,63 @@
  */
 #ifndef _SRC_CHIP8_H
 #define _SRC_CHIP8_H
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "decode.h"
 #include "runtime_error.h"
 #include "ui.h"
 
+/* The display is CHIP8_LINES lines of two words. In low resolution only
+ * the first word of the first 32 lines is used, 64x32, in the SUPER-CHIP
+ * high resolution mode all of it, 128x64 */
+#define CHIP8_LINES 64
+
+/* A dirty mask with every line of the display set */
+#define CHIP8_ALL_LINES UINT64_MAX
+
+/* Bytes of the SUPER-CHIP flag registers FX75 and FX85 save, and load */
+#define CHIP8_RPL_FLAGS 16
+
+struct audio;
+struct capture;
+struct input;
+struct jit;
+struct profile;
+struct rewind;
+struct scheduler;
+
+/* Instructions executed per 60 Hz frame when running on the virtual clock,
+ * unless insPerFrame says otherwise */
+#define CHIP8_DEFAULT_IPF 10
+
+/* Instructions run between checks of the running flag when free running */
+#define CHIP8_BATCH_SIZE 1024
+
+/* Instructions run between checks for an idle loop, see chip8_run_batch */
+#define CHIP8_IDLE_CHECK 256
+
+/* Length of a 60 Hz tick in ns, rounded up so waking a whole number of
+ * them after a tick never lands before the next one */
+#define CHIP8_TICK_NS 16666667
+
+/* Most displays a free running chip hands the UI a second */
+#define CHIP8_PRESENT_HZ 120
+
+/* Fast forward factors, see chip8_set_turbo */
+#define CHIP8_DEFAULT_TURBO 10
+#define CHIP8_MAX_TURBO 50
+
+/* A chip limited to insPerSecond runs batches of this many per second */
+#define CHIP8_PACE_HZ 1000
+/* Longest sleep between checks of the running flag, in ns */
+#define CHIP8_PACE_MAX_SLEEP 50000000ULL
+/* A chip further behind its schedule than this, in ns, starts a new one */
+#define CHIP8_PACE_MAX_LAG 100000000ULL
+
 enum keyEventType{Pressed, Released};
 
 struct keyEvent {
@@ -30,27 +80,100 @@ struct keyEvent {
         uint8_t key;
 };
 
+/* How closely a free running chip keeps to insPerSecond, since the rate
+ * was last set, see chip8_get_pace */
+struct chip8_pace {
+        uint32_t rate;
+        /* Instructions executed, and ns passed, leaving out the time lost
+         * falling behind */
+        uint64_t instructions;
+        uint64_t elapsed;
+        /* Batches that reached their deadline, and how late they were for
+         * it, in ns */
+        uint64_t deadlines;
+        uint64_t lateTotal;
+        uint64_t lateMax;
+        /* Times the chip fell more than CHIP8_PACE_MAX_LAG behind, and
+         * started a new schedule */
+        uint64_t resyncs;
+};
+
 struct mState {
         uint64_t count;
         uint8_t registers[16];
         uint16_t iRegister;
         int16_t pc;
         int16_t *stack;
-        uint8_t disp[32][8];
+        /* Two words a line, pixel x of line y is bit 63 - x % 64 of
+         * disp[y][x / 64]. A line read as one 128 bit number, first word
+         * on top, has pixel x in bit 127 - x, so horizontal scrolls are
+         * shifts of it, and vertical ones moves of whole lines */
+        uint64_t disp[CHIP8_LINES][2];
+        /* Set in the 128x64 mode, 00FF sets it, 00FE clears it */
+        uint8_t hires;
+        /* Lines drawn on since the last frame ended, bit y for line y */
+        uint64_t dirty;
+        /* Lines drawn on since the display was last handed to the UI, and
+         * when that was. See flush_display */
+        uint64_t unpublished;
+        uint64_t lastPublish;
         size_t stackSize;
         size_t stackCapacity;
+        /* Addresses formed from I, by DXYN and FX33 to FX65, wrap around
+         * at the end of memory, so I itself may point past it */
         uint8_t mem[4096];
+        /* Predecoded instructions, see decode.h. Memory written directly
+         * instead of by instructions must be invalidated with
+         * decode_invalidate, chip8_run and chip8_run_headless invalidate
+         * everything when they start */
+        struct decoded icache[DECODE_CACHE_SIZE];
+        /* Translated blocks when built with engine=jit, NULL otherwise */
+        struct jit *jit;
 
         uint8_t keys[16];
         struct keyEvent lastEvent;
 
         struct ui *display;
 
-        /* Timers */
-        uint8_t dTimer;
-        uint8_t sTimer;
+        /* Timers. Free running the timer thread counts them down while the
+         * execution thread reads and sets them, they are atomic so neither
+         * has to take a lock */
+        _Atomic uint8_t dTimer;
+        _Atomic uint8_t sTimer;
+        /* Frames run on the virtual clock, and the count the last one
+         * started at */
+        uint64_t frames;
+        uint64_t frameStart;
+        /* Free running, the CLOCK_MONOTONIC time in ns the timer thread
+         * started counting from, and the 60 Hz ticks it has applied since */
+        uint64_t tickStart;
+        atomic_uint_fast64_t ticks;
+
+        /* Instructions per 60 Hz frame. When non zero the execution thread
+         * ticks the timers itself after every insPerFrame instructions,
+         * instead of the timer thread ticking them on the wall clock. Must
+         * not change while the chip is running */
+        uint32_t insPerFrame;
+        uint8_t timerThreadStarted;
+        /* Instructions per second when free running, 0 for as fast as the
+         * host allows, protected by paceMutex, see chip8_set_rate */
+        uint32_t insPerSecond;
+        struct chip8_pace pace;
+        pthread_mutex_t paceMutex;
+        /* Fast forward factor, 1 at normal speed, see chip8_set_turbo. The
+         * emulated clock runs turbo times as fast as the wall clock, and
+         * read clockEmulated ns at the CLOCK_MONOTONIC time clockWall. All
+         * three are written under paceMutex */
+        atomic_uint_fast32_t turbo;
+        uint64_t clockWall;
+        uint64_t clockEmulated;
 
-        /* Mutexs */
+        /* State of the random number generator used by CXNN */
+        uint32_t rngState;
+        /* The SUPER-CHIP flag registers, the HP48's RPL user flags */
+        uint8_t rplFlags[CHIP8_RPL_FLAGS];
+
+        /* Mutexs. timerMutex only guards waiting on timerTicked */
         pthread_mutex_t timerMutex;
         pthread_mutex_t keyMutex;
         /* The timer thread */
@@ -61,16 +184,98 @@ struct mState {
         /* shared running flag */
         uint8_t running;
 
+        /* Set when the chip was created without a UI */
+        uint8_t headless;
+        /* Set while a headless FX0A is polling for a key press */
+        uint8_t waitingForKey;
+
         /* The incoming key press pthread_cond_t */
         pthread_cond_t incomingKeyEvent;
+        /* Signalled by the timer thread when it ticks the delay timer while
+         * idleWaiting is set */
+        pthread_cond_t timerTicked;
+        /* Set while the execution thread sleeps in an idle loop, see
+         * wait_while_idle */
+        atomic_bool idleWaiting;
+
+        /* The scheduler running the chip, see sched.h. sched is protected
+         * by keyMutex, schedState by the scheduler's lock */
+        struct scheduler *sched;
+        struct mState *schedNext;
+        uint8_t schedState;
+
+        /* When not NULL a snapshot is added to this history at the end of
+         * every frame on the virtual clock, see rewind.h. The chip does not
+         * own it */
+        struct rewind *rewind;
+        /* When not NULL the display is queued on this sink at the end of
+         * every frame on the virtual clock, see capture.h. The chip does
+         * not own it */
+        struct capture *capture;
+        /* When not NULL every instruction is counted in this profile
+         * before it is executed, in builds with profile=true only, see
+         * profile.h. The chip does not own it */
+        struct profile *profile;
+        /* When not NULL key events are recorded to, or replayed from, this
+         * log, see input.h. Only used on the virtual clock. The chip does
+         * not own it */
+        struct input *input;
+        /* When not NULL the buzzer is played on this sink by whichever
+         * thread ticks the timers, see audio.h and chip8_set_audio. The
+         * chip does not own it */
+        struct audio *audio;
+        /* The sample the sink was at when the chip's first frame, or wall
+         * clock tick, started, and that frame */
+        uint64_t soundBase;
+        uint64_t soundFrame;
+        /* The sample FX18 last set the sound timer at */
+        atomic_uint_fast64_t soundEdge;
 };
 
 void run_instruction(struct mState *ms, uint16_t ins);
 struct mState *chip8_init(void);
+struct mState *chip8_init_headless(void);
 void chip8_destroy(struct mState **ms);
 void chip8_run(struct mState *ms);
 void chip8_halt(struct mState *ms);
+void chip8_step(struct mState *ms);
+uint64_t chip8_run_batch(struct mState *ms, uint64_t n);
+int chip8_run_frame(struct mState *ms);
+void chip8_seed(struct mState *ms, uint32_t seed);
+uint64_t chip8_run_headless(struct mState *ms, uint64_t maxInstructions, uint64_t maxFrames);
+void chip8_dump_state(struct mState *ms, FILE *fp);
 struct runtime_error *chip8_load_rom(struct mState *ms, char *file);
 void chip8_key_event_notify(struct mState *ms, struct keyEvent);
 void chip8_wait_for_ui_stop(struct mState *ms);
+void chip8_set_rate(struct mState *ms, uint32_t rate);
+void chip8_get_pace(struct mState *ms, struct chip8_pace *pace);
+void chip8_pace_report(struct mState *ms, FILE *fp);
+void chip8_set_audio(struct mState *ms, struct audio *audio);
+void chip8_set_turbo(struct mState *ms, uint32_t factor);
+void chip8_sound_edge(struct mState *ms);
+
+/* Whether a 0NNN instruction is one of the SUPER-CHIP ones, 00CN, and
+ * 00FB to 00FF, rather than a jump. Their addresses are in the
+ * interpreter's own memory, so no program jumps there */
+static inline int chip8_schip_op(uint16_t ins){
+        return (ins & 0xFFF0) == 0x00C0 || (ins >= 0x00FB && ins <= 0x00FF);
+}
+
+/* The number of 60 Hz ticks due elapsed ns after the timers started. The
+ * count is worked out from the elapsed time instead of added up a tick at a
+ * time, so late wake ups are caught up and rounding never accumulates */
+static inline uint64_t chip8_ticks_due(uint64_t elapsed){
+        return elapsed / 1000000000ULL * 60 + elapsed % 1000000000ULL * 60 / 1000000000ULL;
+}
+
+/* Executes the instruction at the program counter from the predecoded
+ * cache. Instructions at odd addresses are not cached */
+static inline void decode_execute(struct mState *ms){
+        if(ms->pc & 1){
+                run_instruction(ms, ((uint16_t) ms->mem[ms->pc]) << 8 | ms->mem[ms->pc + 1]);
+                return;
+        }
+        struct decoded *d = &ms->icache[ms->pc >> 1];
+        d->handler(ms, d);
+}
 #endif
@@ -0,0 +1,164 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <stdio.h>
+
+#include "chip8.h"
+#include "decode.h"
+#include "jit.h"
+#include "ops.h"
+
+/* The simple, hot instructions get their own handler. Anything that
+ * touches the display, the keyboard wait, random numbers or writes to
+ * memory is handed back to run_instruction so there is only one copy of
+ * that behaviour. */
+
+static void op_decode(struct mState *ms, const struct decoded *d);
+
+static const op_handler handlers[OP_COUNT] = {
+        [OP_DECODE] = op_decode,
+        [OP_INTERPRET] = op_interpret,
+        [OP_RETURN] = op_return,
+        [OP_JUMP] = op_jump,
+        [OP_CALL] = op_call,
+        [OP_SKIP_EQ_IMM] = op_skip_eq_imm,
+        [OP_SKIP_NE_IMM] = op_skip_ne_imm,
+        [OP_SKIP_EQ] = op_skip_eq,
+        [OP_SKIP_NE] = op_skip_ne,
+        [OP_LOAD_IMM] = op_load_imm,
+        [OP_ADD_IMM] = op_add_imm,
+        [OP_MOVE] = op_move,
+        [OP_OR] = op_or,
+        [OP_AND] = op_and,
+        [OP_XOR] = op_xor,
+        [OP_ADD] = op_add,
+        [OP_SUB] = op_sub,
+        [OP_SHR] = op_shr,
+        [OP_SUBN] = op_subn,
+        [OP_SHL] = op_shl,
+        [OP_LOAD_I] = op_load_i,
+        [OP_JUMP_V0] = op_jump_v0,
+        [OP_SKIP_KEY] = op_skip_key,
+        [OP_SKIP_NOT_KEY] = op_skip_not_key,
+        [OP_GET_DELAY] = op_get_delay,
+        [OP_SET_DELAY] = op_set_delay,
+        [OP_SET_SOUND] = op_set_sound,
+        [OP_ADD_I] = op_add_i,
+        [OP_FONT] = op_font,
+        [OP_LOAD_REGS] = op_load_regs
+};
+
+static uint8_t select_kind(uint16_t ins){
+        switch(ins >> 12){
+                case 0x0:
+                        if(ins == 0x00E0) return OP_INTERPRET;
+                        if(ins == 0x00EE) return OP_RETURN;
+                        if(chip8_schip_op(ins)) return OP_INTERPRET;
+                        return OP_JUMP;
+                case 0x1: return OP_JUMP;
+                case 0x2: return OP_CALL;
+                case 0x3: return OP_SKIP_EQ_IMM;
+                case 0x4: return OP_SKIP_NE_IMM;
+                case 0x5: return (ins & 7) ? OP_INTERPRET : OP_SKIP_EQ;
+                case 0x6: return OP_LOAD_IMM;
+                case 0x7: return OP_ADD_IMM;
+                case 0x8:
+                        switch(ins & 0xF){
+                                case 0x0: return OP_MOVE;
+                                case 0x1: return OP_OR;
+                                case 0x2: return OP_AND;
+                                case 0x3: return OP_XOR;
+                                case 0x4: return OP_ADD;
+                                case 0x5: return OP_SUB;
+                                case 0x6: return OP_SHR;
+                                case 0x7: return OP_SUBN;
+                                case 0xE: return OP_SHL;
+                        }
+                        return OP_INTERPRET;
+                case 0x9: return OP_SKIP_NE;
+                case 0xA: return OP_LOAD_I;
+                case 0xB: return OP_JUMP_V0;
+                case 0xE:
+                        if((ins & 0xFF) == 0x9E) return OP_SKIP_KEY;
+                        if((ins & 0xFF) == 0xA1) return OP_SKIP_NOT_KEY;
+                        return OP_INTERPRET;
+                case 0xF:
+                        switch(ins & 0xFF){
+                                case 0x07: return OP_GET_DELAY;
+                                case 0x15: return OP_SET_DELAY;
+                                case 0x18: return OP_SET_SOUND;
+                                case 0x1E: return OP_ADD_I;
+                                case 0x29: return OP_FONT;
+                                case 0x65: return OP_LOAD_REGS;
+                        }
+                        return OP_INTERPRET;
+        }
+        return OP_INTERPRET;
+}
+
+/* Fills in the entry from the instruction in memory */
+void decode_entry(struct mState *ms, struct decoded *e){
+        uint16_t addr = (e - ms->icache) * 2;
+        e->ins = ((uint16_t) ms->mem[addr]) << 8 | ms->mem[addr + 1];
+        e->nnn = e->ins & 0xFFF;
+        e->x = (e->ins >> 8) & 0xF;
+        e->y = (e->ins >> 4) & 0xF;
+        e->nn = e->ins & 0xFF;
+        e->kind = select_kind(e->ins);
+        e->handler = handlers[e->kind];
+}
+
+/* The handler of every entry that has not been decoded yet */
+static void op_decode(struct mState *ms, const struct decoded *d){
+        struct decoded *e = (struct decoded *) d;
+        decode_entry(ms, e);
+        e->handler(ms, e);
+}
+
+/* Marks the entries covering [addr, addr + len) as needing to be decoded
+ * again. Addresses wrap around at the end of memory, like those formed
+ * from I */
+void decode_invalidate(struct mState *ms, uint16_t addr, size_t len){
+        if(len == 0)
+                return;
+        if(len > 4096)
+                len = 4096;
+        addr &= 0xFFF;
+        if(addr + len > 4096){
+                decode_invalidate(ms, 0, addr + len - 4096);
+                len = 4096 - addr;
+        }
+        size_t last = addr + len - 1;
+        for(size_t i = addr / 2; i <= last / 2; i++){
+                ms->icache[i].handler = op_decode;
+                ms->icache[i].kind = OP_DECODE;
+        }
+#ifdef CHIP8_JIT_CORE
+        if(ms->jit != NULL)
+                jit_invalidate(ms->jit, addr, last - addr + 1);
+#endif
+}
+
+void decode_invalidate_all(struct mState *ms){
+        for(size_t i = 0; i < DECODE_CACHE_SIZE; i++){
+                ms->icache[i].handler = op_decode;
+                ms->icache[i].kind = OP_DECODE;
+        }
+#ifdef CHIP8_JIT_CORE
+        if(ms->jit != NULL)
+                jit_flush(ms->jit);
+#endif
+}
@@ -0,0 +1,90 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_DECODE_H
+#define _SRC_DECODE_H
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A cache of predecoded instructions. There is one entry for every even
+ * address in memory, each holding the handler for the instruction stored
+ * there along with its operands already extracted. Entries start out
+ * pointing at a handler that decodes the instruction on first use, writes
+ * to memory put the affected entries back into that state.
+ */
+
+#define DECODE_CACHE_SIZE 2048
+
+/* What kind of instruction an entry holds, the threaded engine dispatches
+ * on this instead of calling the handler */
+enum op_kind {
+        OP_DECODE = 0,
+        OP_INTERPRET,
+        OP_RETURN,
+        OP_JUMP,
+        OP_CALL,
+        OP_SKIP_EQ_IMM,
+        OP_SKIP_NE_IMM,
+        OP_SKIP_EQ,
+        OP_SKIP_NE,
+        OP_LOAD_IMM,
+        OP_ADD_IMM,
+        OP_MOVE,
+        OP_OR,
+        OP_AND,
+        OP_XOR,
+        OP_ADD,
+        OP_SUB,
+        OP_SHR,
+        OP_SUBN,
+        OP_SHL,
+        OP_LOAD_I,
+        OP_JUMP_V0,
+        OP_SKIP_KEY,
+        OP_SKIP_NOT_KEY,
+        OP_GET_DELAY,
+        OP_SET_DELAY,
+        OP_SET_SOUND,
+        OP_ADD_I,
+        OP_FONT,
+        OP_LOAD_REGS,
+        OP_COUNT
+};
+
+struct mState;
+struct decoded;
+
+typedef void (*op_handler)(struct mState *ms, const struct decoded *d);
+
+struct decoded {
+        op_handler handler;
+        /* The raw instruction, for handlers that fall back to
+         * run_instruction */
+        uint16_t ins;
+        uint16_t nnn;
+        uint8_t x;
+        uint8_t y;
+        uint8_t nn;
+        uint8_t kind;
+};
+
+void decode_entry(struct mState *ms, struct decoded *e);
+void decode_invalidate(struct mState *ms, uint16_t addr, size_t len);
+void decode_invalidate_all(struct mState *ms);
+/* decode_execute, which runs the instruction at the program counter from
+ * the cache, is in chip8.h so it can be inlined into the execution loop */
+
+#endif
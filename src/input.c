@@ -0,0 +1,252 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+
+#include "input.h"
+#include "savestate.h"
+
+#define HEADER_LEN 24
+#define EVENT_PRESSED 0x10
+
+static const uint8_t magic[4] = {'C', '8', 'I', 'N'};
+
+static inline void put16(uint8_t *p, uint16_t v){
+        p[0] = v;
+        p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t *p, uint32_t v){
+        put16(p, v);
+        put16(p + 2, v >> 16);
+}
+
+static inline uint16_t get16(const uint8_t *p){
+        return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t *p){
+        return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+/* Reads the varint at *pos, returns -1 if it runs past len */
+static int get_varint(const uint8_t *p, size_t len, size_t *pos, uint64_t *v){
+        *v = 0;
+        for(int shift = 0; *pos < len && shift < 64; shift += 7){
+                uint8_t b = p[(*pos)++];
+                *v |= (uint64_t) (b & 0x7F) << shift;
+                if(!(b & 0x80))
+                        return 0;
+        }
+        return -1;
+}
+
+static void put_varint(FILE *fp, uint64_t v){
+        while(v >= 0x80){
+                fputc((v & 0x7F) | 0x80, fp);
+                v >>= 7;
+        }
+        fputc(v, fp);
+}
+
+/* Identifies the program the log belongs to */
+static uint32_t memory_crc(struct mState *ms){
+        return chip8_crc32(ms->mem + 0x200, sizeof(ms->mem) - 0x200);
+}
+
+/* Applies a key event the way chip8_key_event_notify does, with keyMutex
+ * held */
+static void apply(struct mState *ms, struct keyEvent ke){
+        ms->lastEvent = ke;
+        ms->keys[ke.key] = (ke.type == Pressed);
+}
+
+/* Starts recording the key events of ms to file. The chip must be on the
+ * virtual clock, and not running yet. Returns NULL if file can not be
+ * written */
+struct input *input_record(struct mState *ms, char *file){
+        uint8_t header[HEADER_LEN] = {0};
+        struct input *in = calloc(1, sizeof(struct input));
+        if(in == NULL) return NULL;
+        in->mode = INPUT_RECORD;
+        in->next = UINT64_MAX;
+        in->fp = fopen(file, "wb");
+        if(in->fp == NULL){
+                fprintf(stderr, "Could not open input log \"%s\"\n", file);
+                goto openFail;
+        }
+        memcpy(header, magic, sizeof(magic));
+        put16(header + 4, INPUT_VERSION);
+        put32(header + 8, ms->rngState);
+        put32(header + 12, ms->insPerFrame);
+        put32(header + 16, memory_crc(ms));
+        if(fwrite(header, 1, HEADER_LEN, in->fp) != HEADER_LEN){
+                fprintf(stderr, "Could not write input log \"%s\"\n", file);
+                goto writeFail;
+        }
+        return in;
+writeFail:
+        fclose(in->fp);
+openFail:
+        free(in);
+        return NULL;
+}
+
+/* Loads the events in file to replay on ms, and gives ms the random
+ * number generator, and clock it was recorded with. ms must hold the
+ * program the log was recorded with, and not be running yet. Returns NULL
+ * if the log can not be read, is damaged, or belongs to another program */
+struct input *input_replay(struct mState *ms, char *file){
+        struct input *in = calloc(1, sizeof(struct input));
+        if(in == NULL) return NULL;
+        in->mode = INPUT_REPLAY;
+        FILE *fp = fopen(file, "rb");
+        if(fp == NULL){
+                fprintf(stderr, "Could not open input log \"%s\"\n", file);
+                goto openFail;
+        }
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if(size < HEADER_LEN){
+                fprintf(stderr, "\"%s\" is not an input log\n", file);
+                goto readFail;
+        }
+        in->len = size;
+        in->log = malloc(in->len);
+        if(in->log == NULL || fread(in->log, 1, in->len, fp) != in->len){
+                fprintf(stderr, "Could not read input log \"%s\"\n", file);
+                goto readFail;
+        }
+        fclose(fp);
+        fp = NULL;
+
+        if(memcmp(in->log, magic, sizeof(magic)) != 0 || get16(in->log + 4) != INPUT_VERSION){
+                fprintf(stderr, "\"%s\" is not an input log, or is from another version\n", file);
+                goto badLog;
+        }
+        if(get32(in->log + 12) == 0){
+                fprintf(stderr, "\"%s\" was not recorded on the virtual clock\n", file);
+                goto badLog;
+        }
+        if(get32(in->log + 16) != memory_crc(ms)){
+                fprintf(stderr, "\"%s\" was recorded with another program\n", file);
+                goto badLog;
+        }
+        /* Every event must be whole before any is replayed */
+        in->pos = HEADER_LEN;
+        while(in->pos < in->len){
+                uint64_t delta;
+                if(get_varint(in->log, in->len, &in->pos, &delta) != 0 || in->pos == in->len){
+                        fprintf(stderr, "\"%s\" is cut short\n", file);
+                        goto badLog;
+                }
+                in->pos++;
+        }
+
+        ms->rngState = get32(in->log + 8);
+        ms->insPerFrame = get32(in->log + 12);
+        in->pos = HEADER_LEN;
+        in->next = 0;
+        if(in->pos < in->len)
+                get_varint(in->log, in->len, &in->pos, &in->next);
+        return in;
+badLog:
+readFail:
+        if(fp != NULL)
+                fclose(fp);
+        free(in->log);
+openFail:
+        free(in);
+        return NULL;
+}
+
+/* Stops recording, or replaying, and writes out what was recorded */
+void input_close(struct input **in){
+        if(*in == NULL) return;
+        if((*in)->fp != NULL && (ferror((*in)->fp) | fclose((*in)->fp)))
+                fprintf(stderr, "Could not write the input log\n");
+        free((*in)->log);
+        free(*in);
+        *in = NULL;
+}
+
+/* Called by chip8_key_event_notify with keyMutex held. Returns 1 if the
+ * event was taken, and must not be applied now */
+int input_queue(struct input *in, struct keyEvent ke){
+        if(in->mode == INPUT_REPLAY){
+                /* The log owns the keyboard */
+                in->dropped++;
+        } else if(in->queued == INPUT_QUEUE_LEN){
+                in->dropped++;
+        } else {
+                in->queue[in->queued++] = ke;
+        }
+        return 1;
+}
+
+/* Applies the events due at the chip's instruction count, called by the
+ * execution thread between batches of instructions. Recorded events are
+ * written down against the count they were applied at */
+void input_deliver(struct input *in, struct mState *ms){
+        if(!in->started){
+                in->base = ms->count;
+                in->started = 1;
+        }
+        uint64_t now = ms->count - in->base;
+        pthread_mutex_lock(&ms->keyMutex);
+        if(in->mode == INPUT_RECORD){
+                for(size_t i = 0; i < in->queued; i++){
+                        struct keyEvent ke = in->queue[i];
+                        apply(ms, ke);
+                        put_varint(in->fp, now - in->last);
+                        fputc(ke.key | ((ke.type == Pressed) ? EVENT_PRESSED : 0), in->fp);
+                        in->last = now;
+                        in->events++;
+                }
+                in->queued = 0;
+        } else {
+                /* Events the chip ran past are late, but not lost */
+                while(in->pos < in->len && in->next <= now){
+                        uint8_t e = in->log[in->pos++];
+                        struct keyEvent ke = {
+                                .type = (e & EVENT_PRESSED) ? Pressed : Released,
+                                .key = e & 0xF
+                        };
+                        apply(ms, ke);
+                        in->events++;
+                        uint64_t delta = 0;
+                        if(in->pos < in->len)
+                                get_varint(in->log, in->len, &in->pos, &delta);
+                        in->next += delta;
+                }
+        }
+        pthread_mutex_unlock(&ms->keyMutex);
+}
+
+/* The instruction count of the next event to replay, so the batch can stop
+ * there, or UINT64_MAX if there is none */
+uint64_t input_next(struct input *in){
+        if(in->mode != INPUT_REPLAY || in->pos >= in->len || !in->started)
+                return UINT64_MAX;
+        return in->base + in->next;
+}
+
+void input_report(struct input *in, FILE *fp){
+        fprintf(fp, "INPUT: %s %lu key events, %lu ignored\n",
+                        (in->mode == INPUT_RECORD) ? "recorded" : "replayed",
+                        in->events, in->dropped);
+}
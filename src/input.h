@@ -0,0 +1,88 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_INPUT_H
+#define _SRC_INPUT_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+
+/* Records the key events of a chip running on the virtual clock against
+ * the instruction count they took effect at, or replays them at exactly
+ * the same instructions, so a session repeats however fast it runs.
+ *
+ * While recording, chip8_key_event_notify queues events instead of
+ * applying them, the execution thread applies them, and writes them down,
+ * between batches of instructions, which is at the start of every frame.
+ * While replaying, batches are split so every event lands on the
+ * instruction it was recorded at, and events from the keyboard are
+ * ignored. The free running clock ticks the timers on the wall clock, so
+ * neither works without the virtual clock.
+ *
+ * A log is a 24 byte header, the magic "C8IN", the version as 16 bits, 16
+ * reserved bits, the random number generator's state, instructions per
+ * frame, the CRC-32 of memory from 0x200 on when recording began, and 32
+ * reserved bits, all little endian. Every event follows as the number of
+ * instructions since the event before, or since the chip began running,
+ * as a LEB128 varint, and a byte holding the key in its low 4 bits and 1
+ * in bit 4 for a press.
+ */
+
+#define INPUT_VERSION 1
+/* Key events waiting for the execution thread while recording */
+#define INPUT_QUEUE_LEN 64
+
+enum input_mode {
+        INPUT_RECORD,
+        INPUT_REPLAY
+};
+
+struct input {
+        enum input_mode mode;
+        FILE *fp;
+
+        /* ms->count when the chip began running, set by the first
+         * input_deliver, and the count of the last event */
+        uint64_t base;
+        uint64_t last;
+        uint8_t started;
+
+        /* Events from chip8_key_event_notify, protected by keyMutex */
+        struct keyEvent queue[INPUT_QUEUE_LEN];
+        size_t queued;
+
+        /* The events being replayed, and the position of the next one */
+        uint8_t *log;
+        size_t len;
+        size_t pos;
+        uint64_t next;
+
+        /* Statistics */
+        uint64_t events;
+        uint64_t dropped;
+};
+
+struct input *input_record(struct mState *ms, char *file);
+struct input *input_replay(struct mState *ms, char *file);
+void input_close(struct input **in);
+int input_queue(struct input *in, struct keyEvent ke);
+void input_deliver(struct input *in, struct mState *ms);
+uint64_t input_next(struct input *in);
+void input_report(struct input *in, FILE *fp);
+
+#endif
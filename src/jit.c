@@ -0,0 +1,462 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifdef CHIP8_JIT_CORE
+#if !defined(__x86_64__)
+#error "The JIT only targets x86-64"
+#endif
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chip8.h"
+#include "jit.h"
+
+/* The host registers V0-VF are kept in while a block runs: al, cl, dl, sil,
+ * and r8b-r11b. They are all caller saved so blocks need no prologue, rdi
+ * holds the mState for the whole block */
+static const uint8_t hostRegs[] = {0, 1, 2, 6, 8, 9, 10, 11};
+#define HOST_REGS 8
+
+#define REGISTERS_OFFSET offsetof(struct mState, registers)
+#define I_OFFSET offsetof(struct mState, iRegister)
+#define PC_OFFSET offsetof(struct mState, pc)
+#define COUNT_OFFSET offsetof(struct mState, count)
+
+/* Opcodes of the 8 bit "op r/m8, r8" forms */
+#define OP_ADD 0x00
+#define OP_OR 0x08
+#define OP_AND 0x20
+#define OP_SUB 0x28
+#define OP_XOR 0x30
+#define OP_CMP 0x38
+#define OP_MOV 0x88
+
+/* The /digit of the 8 bit "op r/m8, imm8" forms */
+#define DIGIT_ADD 0
+#define DIGIT_AND 4
+#define DIGIT_CMP 7
+
+struct emitter {
+        uint8_t *buf;
+        size_t len;
+        size_t cap;
+        int overflow;
+        /* The host register holding each V register, or -1 */
+        int8_t map[16];
+        uint8_t dirty[16];
+        uint8_t used;
+};
+
+static void emit8(struct emitter *e, uint8_t b){
+        if(e->len < e->cap)
+                e->buf[e->len++] = b;
+        else
+                e->overflow = 1;
+}
+
+static void emit16(struct emitter *e, uint16_t v){
+        emit8(e, v & 0xFF);
+        emit8(e, v >> 8);
+}
+
+static void emit32(struct emitter *e, uint32_t v){
+        emit16(e, v & 0xFFFF);
+        emit16(e, v >> 16);
+}
+
+/* Always emitted for byte registers, so 6 means sil and not dh */
+static void rex(struct emitter *e, int w, int r, int b){
+        emit8(e, 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3));
+}
+
+static void modrm_reg(struct emitter *e, int reg, int rm){
+        emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [rdi + disp32] */
+static void modrm_mem(struct emitter *e, int reg, uint32_t disp){
+        emit8(e, 0x80 | ((reg & 7) << 3) | 7);
+        emit32(e, disp);
+}
+
+static void alu_rr(struct emitter *e, uint8_t op, int dst, int src){
+        rex(e, 0, src, dst);
+        emit8(e, op);
+        modrm_reg(e, src, dst);
+}
+
+static void alu_ri(struct emitter *e, int digit, int dst, uint8_t imm){
+        rex(e, 0, 0, dst);
+        emit8(e, 0x80);
+        modrm_reg(e, digit, dst);
+        emit8(e, imm);
+}
+
+static void mov_ri(struct emitter *e, int dst, uint8_t imm){
+        rex(e, 0, 0, dst);
+        emit8(e, 0xB0 | (dst & 7));
+        emit8(e, imm);
+}
+
+static void setb(struct emitter *e, int dst){
+        rex(e, 0, 0, dst);
+        emit8(e, 0x0F);
+        emit8(e, 0x92);
+        modrm_reg(e, 0, dst);
+}
+
+/* shl is /4, shr is /5 */
+static void shift(struct emitter *e, int digit, int dst, uint8_t count){
+        rex(e, 0, 0, dst);
+        emit8(e, 0xC0);
+        modrm_reg(e, digit, dst);
+        emit8(e, count);
+}
+
+static void neg(struct emitter *e, int dst){
+        rex(e, 0, 0, dst);
+        emit8(e, 0xF6);
+        modrm_reg(e, 3, dst);
+}
+
+static void load_v(struct emitter *e, int host, uint8_t x){
+        rex(e, 0, host, 7);
+        emit8(e, 0x8A);
+        modrm_mem(e, host, REGISTERS_OFFSET + x);
+}
+
+static void store_v(struct emitter *e, int host, uint8_t x){
+        rex(e, 0, host, 7);
+        emit8(e, 0x88);
+        modrm_mem(e, host, REGISTERS_OFFSET + x);
+}
+
+/* mov word [rdi + disp32], imm16, 9 bytes */
+static void store_word(struct emitter *e, uint32_t disp, uint16_t imm){
+        emit8(e, 0x66);
+        emit8(e, 0xC7);
+        modrm_mem(e, 0, disp);
+        emit16(e, imm);
+}
+
+/* add qword [rdi + count], n */
+static void add_count(struct emitter *e, uint32_t n){
+        rex(e, 1, 0, 7);
+        emit8(e, 0x81);
+        modrm_mem(e, 0, COUNT_OFFSET);
+        emit32(e, n);
+}
+
+/* Number of host registers the V registers in mask still need */
+static int needs(struct emitter *e, uint16_t mask){
+        int n = 0;
+        for(int x = 0; x < 16; x++)
+                if((mask >> x) & 1 && e->map[x] < 0)
+                        n++;
+        return n;
+}
+
+/* Returns the host register holding Vx. It is loaded from memory the
+ * first time it is used, unless the instruction only writes to it */
+static int use_v(struct emitter *e, uint8_t x, int load){
+        if(e->map[x] < 0){
+                e->map[x] = hostRegs[e->used++];
+                if(load)
+                        load_v(e, e->map[x], x);
+        }
+        return e->map[x];
+}
+
+static int def_v(struct emitter *e, uint8_t x, int load){
+        int r = use_v(e, x, load);
+        e->dirty[x] = 1;
+        return r;
+}
+
+/* Writes the modified V registers back. mov leaves the flags alone */
+static void writeback(struct emitter *e){
+        for(int x = 0; x < 16; x++)
+                if(e->dirty[x])
+                        store_v(e, e->map[x], x);
+}
+
+static void emit_exit(struct emitter *e, uint16_t pc, int n){
+        writeback(e);
+        if(n != 0)
+                add_count(e, n);
+        store_word(e, PC_OFFSET, pc);
+        emit8(e, 0xC3);
+}
+
+/* Translates one instruction. Returns 0 if the block continues, 1 if the
+ * instruction ended the block, and -1 if it can not be translated */
+static int translate_instruction(struct emitter *e, uint16_t ins, uint16_t addr, int n){
+        uint8_t x = (ins >> 8) & 0xF;
+        uint8_t y = (ins >> 4) & 0xF;
+        uint8_t nn = ins & 0xFF;
+        int rx, ry, rf;
+        switch(ins >> 12){
+                case 0x1:
+                        emit_exit(e, ins & 0xFFF, n + 1);
+                        return 1;
+                case 0x3:
+                case 0x4:
+                        if(needs(e, 1 << x) + e->used > HOST_REGS)
+                                return -1;
+                        rx = use_v(e, x, 1);
+                        /* add and the write back stores leave the flags from a
+                         * compare alone, but add_count does not, so count
+                         * first */
+                        add_count(e, n + 1);
+                        writeback(e);
+                        store_word(e, PC_OFFSET, addr + 2);
+                        alu_ri(e, DIGIT_CMP, rx, nn);
+                        /* 3XNN skips when equal, 4XNN when not */
+                        emit8(e, (ins >> 12) == 0x3 ? 0x75 : 0x74);
+                        emit8(e, 9);
+                        store_word(e, PC_OFFSET, addr + 4);
+                        emit8(e, 0xC3);
+                        return 1;
+                case 0x5:
+                case 0x9:
+                        if(ins & 0xF)
+                                return -1;
+                        if(needs(e, (1 << x) | (1 << y)) + e->used > HOST_REGS)
+                                return -1;
+                        rx = use_v(e, x, 1);
+                        ry = use_v(e, y, 1);
+                        add_count(e, n + 1);
+                        writeback(e);
+                        store_word(e, PC_OFFSET, addr + 2);
+                        alu_rr(e, OP_CMP, rx, ry);
+                        emit8(e, (ins >> 12) == 0x5 ? 0x75 : 0x74);
+                        emit8(e, 9);
+                        store_word(e, PC_OFFSET, addr + 4);
+                        emit8(e, 0xC3);
+                        return 1;
+                case 0x6:
+                        if(needs(e, 1 << x) + e->used > HOST_REGS)
+                                return -1;
+                        mov_ri(e, def_v(e, x, 0), nn);
+                        return 0;
+                case 0x7:
+                        if(needs(e, 1 << x) + e->used > HOST_REGS)
+                                return -1;
+                        alu_ri(e, DIGIT_ADD, def_v(e, x, 1), nn);
+                        return 0;
+                case 0x8:{
+                        uint8_t sopc = ins & 0xF;
+                        uint16_t mask = (1 << x) | (1 << y);
+                        /* The flag setting forms are only translated when VF is
+                         * neither operand, the interpreter's ordering of the
+                         * VF write is then invisible */
+                        if(sopc >= 0x4){
+                                if(x == 0xF || y == 0xF)
+                                        return -1;
+                                mask |= 1 << 0xF;
+                        }
+                        if(sopc > 0x7 && sopc != 0xE)
+                                return -1;
+                        if(needs(e, mask) + e->used > HOST_REGS)
+                                return -1;
+                        ry = use_v(e, y, 1);
+                        switch(sopc){
+                                case 0x0:
+                                        alu_rr(e, OP_MOV, def_v(e, x, 0), ry);
+                                        break;
+                                case 0x1:
+                                        alu_rr(e, OP_OR, def_v(e, x, 1), ry);
+                                        break;
+                                case 0x2:
+                                        alu_rr(e, OP_AND, def_v(e, x, 1), ry);
+                                        break;
+                                case 0x3:
+                                        alu_rr(e, OP_XOR, def_v(e, x, 1), ry);
+                                        break;
+                                case 0x4:
+                                        /* VF is the carry out */
+                                        rx = def_v(e, x, 1);
+                                        rf = def_v(e, 0xF, 0);
+                                        alu_rr(e, OP_ADD, rx, ry);
+                                        setb(e, rf);
+                                        break;
+                                case 0x5:
+                                        /* VF = Vy < Vx */
+                                        rx = def_v(e, x, 1);
+                                        rf = def_v(e, 0xF, 0);
+                                        alu_rr(e, OP_CMP, ry, rx);
+                                        setb(e, rf);
+                                        alu_rr(e, OP_SUB, rx, ry);
+                                        break;
+                                case 0x6:
+                                        ry = def_v(e, y, 1);
+                                        rx = def_v(e, x, 0);
+                                        rf = def_v(e, 0xF, 0);
+                                        alu_rr(e, OP_MOV, rf, ry);
+                                        alu_ri(e, DIGIT_AND, rf, 1);
+                                        shift(e, 5, ry, 1);
+                                        alu_rr(e, OP_MOV, rx, ry);
+                                        break;
+                                case 0x7:
+                                        /* VF = Vx < Vy, Vx = Vy - Vx */
+                                        rx = def_v(e, x, 1);
+                                        rf = def_v(e, 0xF, 0);
+                                        if(x == y){
+                                                /* Vx and Vy share a host
+                                                 * register, neg would clobber
+                                                 * both */
+                                                mov_ri(e, rf, 0);
+                                                mov_ri(e, rx, 0);
+                                                break;
+                                        }
+                                        alu_rr(e, OP_CMP, rx, ry);
+                                        setb(e, rf);
+                                        neg(e, rx);
+                                        alu_rr(e, OP_ADD, rx, ry);
+                                        break;
+                                case 0xE:
+                                        ry = def_v(e, y, 1);
+                                        rx = def_v(e, x, 0);
+                                        rf = def_v(e, 0xF, 0);
+                                        alu_rr(e, OP_MOV, rf, ry);
+                                        shift(e, 5, rf, 7);
+                                        shift(e, 4, ry, 1);
+                                        alu_rr(e, OP_MOV, rx, ry);
+                                        break;
+                        }
+                        return 0;
+                        }
+                case 0xA:
+                        store_word(e, I_OFFSET, ins & 0xFFF);
+                        return 0;
+        }
+        return -1;
+}
+
+/* Translates the block starting at pc */
+static void translate(struct mState *ms, struct jit *j, uint16_t pc){
+        struct emitter e;
+        uint16_t addr = pc;
+        int n = 0;
+        uint16_t i = pc >> 1;
+
+        if(JIT_CODE_SIZE - j->used < 4096)
+                jit_flush(j);
+
+        e.buf = j->code + j->used;
+        e.len = 0;
+        e.cap = JIT_CODE_SIZE - j->used;
+        e.overflow = 0;
+        e.used = 0;
+        memset(e.map, -1, sizeof(e.map));
+        memset(e.dirty, 0, sizeof(e.dirty));
+
+        for(;;){
+                if(n == JIT_MAX_BLOCK || addr > 4094){
+                        emit_exit(&e, addr, n);
+                        break;
+                }
+                uint16_t ins = ((uint16_t) ms->mem[addr]) << 8 | ms->mem[addr + 1];
+                size_t mark = e.len;
+                int r = translate_instruction(&e, ins, addr, n);
+                if(r < 0){
+                        e.len = mark;
+                        if(n == 0){
+                                j->state[i] = JIT_INTERPRET;
+                                return;
+                        }
+                        emit_exit(&e, addr, n);
+                        break;
+                }
+                n++;
+                addr += 2;
+                if(r == 1)
+                        break;
+        }
+        if(e.overflow){
+                j->state[i] = JIT_INTERPRET;
+                return;
+        }
+        j->blocks[i] = (jit_block) e.buf;
+        j->lengths[i] = n;
+        j->state[i] = JIT_COMPILED;
+        memset(j->covered + pc, 1, (size_t) n * 2);
+        j->used += e.len;
+        j->compiled++;
+}
+
+struct jit *jit_init(void){
+        struct jit *j = calloc(1, sizeof(struct jit));
+        if(j == NULL) return NULL;
+        j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(j->code == MAP_FAILED){
+                free(j);
+                return NULL;
+        }
+        return j;
+}
+
+void jit_destroy(struct jit **j){
+        if(*j == NULL) return;
+        munmap((*j)->code, JIT_CODE_SIZE);
+        free(*j);
+        *j = NULL;
+}
+
+/* Throws away every translated block */
+void jit_flush(struct jit *j){
+        memset(j->state, JIT_UNKNOWN, sizeof(j->state));
+        memset(j->covered, 0, sizeof(j->covered));
+        j->used = 0;
+        j->flushes++;
+}
+
+/* Called for every write to memory, flushes all blocks if the write hit
+ * translated code */
+void jit_invalidate(struct jit *j, uint16_t addr, size_t len){
+        for(size_t i = addr; i < addr + len && i < 4096; i++){
+                if(j->covered[i]){
+                        jit_flush(j);
+                        return;
+                }
+        }
+}
+
+/* Executes exactly n instructions, or until the PC leaves memory. A block
+ * is only entered when it fits in what is left of n, otherwise the
+ * instruction is interpreted. Returns the number of instructions executed */
+uint64_t jit_run(struct mState *ms, uint64_t n){
+        struct jit *j = ms->jit;
+        uint64_t start = ms->count;
+        while(ms->count - start < n && (uint16_t) ms->pc <= 4094){
+                uint16_t pc = ms->pc;
+                if(pc & 1){
+                        chip8_step(ms);
+                        continue;
+                }
+                uint16_t i = pc >> 1;
+                if(j->state[i] == JIT_UNKNOWN)
+                        translate(ms, j, pc);
+                if(j->state[i] == JIT_COMPILED && j->lengths[i] <= n - (ms->count - start))
+                        j->blocks[i](ms);
+                else
+                        chip8_step(ms);
+        }
+        return ms->count - start;
+}
+#endif
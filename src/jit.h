@@ -0,0 +1,63 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_JIT_H
+#define _SRC_JIT_H
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A dynamic recompiler that translates straight line runs of CHIP-8
+ * instructions into x86-64 code. A block holds the register, immediate and
+ * ALU instructions, V0-VF live in host registers while it runs. Blocks end
+ * at a skip or jump, which are translated, or at any other instruction,
+ * which is left to the interpreter.
+ */
+
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCK 64
+
+struct mState;
+
+typedef void (*jit_block)(struct mState *ms);
+
+enum jit_block_state {
+        JIT_UNKNOWN = 0,
+        JIT_COMPILED,
+        /* The instruction at this address can not start a block */
+        JIT_INTERPRET
+};
+
+struct jit {
+        uint8_t *code;
+        size_t used;
+        jit_block blocks[2048];
+        /* Number of CHIP-8 instructions in each block */
+        uint8_t lengths[2048];
+        uint8_t state[2048];
+        /* Non zero for every byte of memory that has been translated */
+        uint8_t covered[4096];
+        /* Statistics */
+        uint64_t compiled;
+        uint64_t flushes;
+};
+
+struct jit *jit_init(void);
+void jit_destroy(struct jit **j);
+void jit_flush(struct jit *j);
+void jit_invalidate(struct jit *j, uint16_t addr, size_t len);
+uint64_t jit_run(struct mState *ms, uint64_t n);
+
+#endif
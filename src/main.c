@@ -1,36 +1,310 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "audio.h"
+#include "capture.h"
 #include "chip8.h"
+#include "input.h"
+#include "profile.h"
+#include "rewind.h"
+#include "savestate.h"
 
 void usage(int argc, char *argv[]){
-        printf("%s <ROM>\n", argv[0]);
+        printf("%s [-r ipf | -R ips] [-T factor] [-s seed] [-l state] [-k keys | -K keys] [-H [-i instructions] [-f frames] [-d] [-S state] [-w KB] [-p prefix | -y video] [-x scale]] [-a wav | -A] [-P stacks] <ROM>\n", argv[0]);
+        printf("  -r N  run N instructions per 60 Hz frame on the virtual clock\n");
+        printf("  -R N  run at most N instructions per second, and report how closely\n");
+        printf("        the chip kept to it\n");
+        printf("  -T N  run N times as fast while Tab is held, %d by default\n", CHIP8_DEFAULT_TURBO);
+        printf("  -s N  seed the random number generator with N\n");
+        printf("  -l F  restore the save state in F after loading the ROM\n");
+        printf("  -k F  record every key event to F, on the virtual clock\n");
+        printf("  -K F  replay the key events recorded in F, with the seed, and clock they\n");
+        printf("        were recorded with\n");
+        printf("  -H    run headless, without creating a window\n");
+        printf("  -i N  stop a headless run after N instructions\n");
+        printf("  -f N  stop a headless run after N 60 Hz frames\n");
+        printf("  -d    dump the registers, and display when a headless run stops\n");
+        printf("  -S F  write a save state to F when a headless run stops\n");
+        printf("  -w N  keep up to N KB of rewind history, and report its size\n");
+        printf("  -p P  write every frame of a headless run to P000000.ppm, P000001.ppm, ...\n");
+        printf("  -y F  write every frame of a headless run to the Y4M video F, - for stdout\n");
+        printf("  -x N  scale captured frames by N, rounded up to even, %d by default\n", CAPTURE_DEFAULT_SCALE);
+        printf("  -a F  write the buzzer to the WAV file F\n");
+        printf("  -A    play the buzzer, needs a build with audio=alsa\n");
+        printf("  -P F  profile the run, report the busiest instructions, and write folded\n");
+        printf("        call stacks to F, needs a build with profile=true\n");
 }
 
 
 int main(int argc, char *argv[]){
         struct mState *chip;
         struct runtime_error *re;
+        int headless = 0;
+        int dump = 0;
+        uint64_t instructions = 0;
+        uint64_t frames = 0;
+        uint32_t ipf = 0;
+        uint32_t ips = 0;
+        uint32_t turbo = CHIP8_DEFAULT_TURBO;
+        uint32_t seed = 0;
+        int seeded = 0;
+        char *loadState = NULL;
+        char *saveState = NULL;
+        size_t rewindBudget = 0;
+        struct rewind *history = NULL;
+        char *capturePath = NULL;
+        enum capture_format captureFormat = CAPTURE_PPM;
+        uint32_t captureScale = CAPTURE_DEFAULT_SCALE;
+        struct capture *capture = NULL;
+        char *audioPath = NULL;
+        int play = 0;
+        struct audio *audio = NULL;
+        char *profilePath = NULL;
+        char *recordPath = NULL;
+        char *replayPath = NULL;
+        struct input *input = NULL;
+        struct profile *profile = NULL;
+        FILE *report = stdout;
+        int opt;
         
         srand(time(NULL));
 
-        if(argc < 2){
+        while((opt = getopt(argc, argv, "Hi:f:dr:R:T:s:l:S:w:p:y:x:a:AP:k:K:")) != -1){
+                switch(opt){
+                        case 'H':
+                                headless = 1;
+                                break;
+                        case 'i':
+                                instructions = strtoull(optarg, NULL, 0);
+                                break;
+                        case 'f':
+                                frames = strtoull(optarg, NULL, 0);
+                                break;
+                        case 'd':
+                                dump = 1;
+                                break;
+                        case 'r':
+                                ipf = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'R':
+                                ips = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'T':
+                                turbo = strtoul(optarg, NULL, 0);
+                                break;
+                        case 's':
+                                seed = strtoul(optarg, NULL, 0);
+                                seeded = 1;
+                                break;
+                        case 'l':
+                                loadState = optarg;
+                                break;
+                        case 'S':
+                                saveState = optarg;
+                                break;
+                        case 'w':
+                                rewindBudget = strtoull(optarg, NULL, 0) * 1024;
+                                break;
+                        case 'p':
+                                capturePath = optarg;
+                                captureFormat = CAPTURE_PPM;
+                                break;
+                        case 'y':
+                                capturePath = optarg;
+                                captureFormat = CAPTURE_Y4M;
+                                break;
+                        case 'x':
+                                captureScale = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'a':
+                                audioPath = optarg;
+                                break;
+                        case 'A':
+                                play = 1;
+                                break;
+                        case 'P':
+                                profilePath = optarg;
+                                break;
+                        case 'k':
+                                recordPath = optarg;
+                                break;
+                        case 'K':
+                                replayPath = optarg;
+                                break;
+                        default:
+                                usage(argc, argv);
+                                return -1;
+                }
+        }
+
+        if(optind >= argc){
                 usage(argc, argv);
                 return 0;
         }
+
+        if(headless && instructions == 0 && frames == 0){
+                fprintf(stderr, "A headless run needs an instruction or frame limit\n");
+                return -1;
+        }
+        /* stdout may be the video, then the reports go to stderr */
+        if(captureFormat == CAPTURE_Y4M && strcmp(capturePath, "-") == 0)
+                report = stderr;
         
-        chip = chip8_init();
+        chip = headless ? chip8_init_headless() : chip8_init();
+        if(chip == NULL){
+                fprintf(stderr, "Failed to create the chip8\n");
+                return -1;
+        }
 
-        re = chip8_load_rom(chip, argv[1]);
+        if(ipf != 0)
+                chip->insPerFrame = ipf;
+        chip8_set_rate(chip, ips);
+        if(chip->display != NULL)
+                chip->display->turbo = turbo;
+        if(seeded)
+                chip8_seed(chip, seed);
+
+        re = chip8_load_rom(chip, argv[optind]);
         if(re != NULL){
                 printf("%s\n", re->msg);
                 return -1;
         }
+        if(loadState != NULL){
+                re = chip8_load_state_file(chip, loadState);
+                if(re != NULL){
+                        printf("%s\n", re->msg);
+                        return -1;
+                }
+        }
+        if(recordPath != NULL || replayPath != NULL){
+                /* Events are tied to instruction counts, which only mean
+                 * the same thing twice on the virtual clock */
+                if(chip->insPerFrame == 0)
+                        chip->insPerFrame = CHIP8_DEFAULT_IPF;
+                input = (replayPath != NULL) ? input_replay(chip, replayPath) : input_record(chip, recordPath);
+                if(input == NULL){
+                        fprintf(stderr, "Failed to open the input log\n");
+                        return -1;
+                }
+                chip->input = input;
+        }
+        if(ips != 0 && (headless || chip->insPerFrame != 0))
+                fprintf(stderr, "-R only limits a free running chip, on the virtual clock -r sets the rate\n");
+        if(profilePath != NULL){
+#ifndef CHIP8_PROFILE
+                fprintf(stderr, "Profiling needs a build with profile=true\n");
+                return -1;
+#endif
+                profile = profile_init(chip);
+                if(profile == NULL){
+                        fprintf(stderr, "Failed to create the profile\n");
+                        return -1;
+                }
+                chip->profile = profile;
+        }
+        if(audioPath != NULL || play){
+                /* Like the frame capture, queue the whole of a short
+                 * headless run */
+                size_t ringLen = AUDIO_DEFAULT_RING;
+                uint64_t samples = frames * AUDIO_DEFAULT_RATE / 60;
+                if(headless && samples > ringLen)
+                        ringLen = (samples < AUDIO_MAX_RING) ? samples : AUDIO_MAX_RING;
+                if(play)
+                        ringLen = AUDIO_PLAY_RING;
+#ifdef CHIP8_ALSA
+                const struct audio_backend *backend = play ? &audio_alsa : &audio_wav;
+#else
+                const struct audio_backend *backend = &audio_wav;
+                if(play){
+                        fprintf(stderr, "Playing the buzzer needs a build with audio=alsa\n");
+                        return -1;
+                }
+#endif
+                audio = audio_init(backend, play ? NULL : audioPath, AUDIO_DEFAULT_RATE, ringLen);
+                if(audio == NULL){
+                        fprintf(stderr, "Failed to start the audio\n");
+                        return -1;
+                }
+                chip8_set_audio(chip, audio);
+        }
 
-        chip8_run(chip);
+        if(headless){
+                if(rewindBudget != 0){
+                        history = rewind_init(chip, rewindBudget, REWIND_DEFAULT_INTERVAL);
+                        if(history == NULL){
+                                fprintf(stderr, "Failed to create the rewind history\n");
+                                return -1;
+                        }
+                        chip->rewind = history;
+                }
+                if(capturePath != NULL){
+                        /* A headless run is faster than the disk, so queue
+                         * the whole run when it is short enough */
+                        size_t queueLen = CAPTURE_DEFAULT_QUEUE;
+                        if(frames > queueLen)
+                                queueLen = (frames < CAPTURE_MAX_QUEUE) ? frames : CAPTURE_MAX_QUEUE;
+                        capture = capture_init(captureFormat, capturePath, captureScale, queueLen);
+                        if(capture == NULL){
+                                fprintf(stderr, "Failed to start the frame capture\n");
+                                return -1;
+                        }
+                        chip->capture = capture;
+                }
+                chip8_run_headless(chip, instructions, frames);
+                if(history != NULL)
+                        rewind_report(history, report);
+                if(capture != NULL){
+                        /* stdout may be the video, so the report goes to stderr */
+                        chip->capture = NULL;
+                        capture_stop(capture);
+                        capture_report(capture, stderr);
+                }
+                if(dump)
+                        chip8_dump_state(chip, report);
+                if(saveState != NULL){
+                        re = chip8_save_state_file(chip, saveState);
+                        if(re != NULL){
+                                fprintf(report, "%s\n", re->msg);
+                                chip8_destroy(&chip);
+                                return -1;
+                        }
+                }
+        } else {
+                chip8_run(chip);
 
-        chip8_wait_for_ui_stop(chip);
+                chip8_wait_for_ui_stop(chip);
+                /* The execution thread must stop before the logs it writes
+                 * to are closed */
+                chip8_halt(chip);
+                chip8_pace_report(chip, stdout);
+        }
+
+        if(audio != NULL){
+                chip8_set_audio(chip, NULL);
+                audio_stop(audio);
+                audio_report(audio, stderr);
+        }
+        if(input != NULL){
+                chip->input = NULL;
+                input_report(input, report);
+                input_close(&input);
+        }
+        if(profilePath != NULL){
+                chip->profile = NULL;
+                profile_report(profile, report);
+                FILE *fp = fopen(profilePath, "w");
+                if(fp == NULL || profile_write_folded(profile, fp) != 0)
+                        fprintf(stderr, "Could not write the call stacks to \"%s\"\n", profilePath);
+                if(fp != NULL)
+                        fclose(fp);
+        }
       
         chip8_destroy(&chip);
+        rewind_destroy(&history);
+        capture_destroy(&capture);
+        audio_destroy(&audio);
+        profile_destroy(&profile);
         return 0;
 }
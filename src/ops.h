@@ -0,0 +1,183 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_OPS_H
+#define _SRC_OPS_H
+#include <stdio.h>
+
+#include "chip8.h"
+#include "decode.h"
+
+/* The instructions that are executed straight from a predecoded entry. They
+ * are inline so the threaded engine can paste them into its dispatch loop,
+ * the predecoded engine takes their address for its handler table */
+
+static inline void op_interpret(struct mState *ms, const struct decoded *d){
+        run_instruction(ms, d->ins);
+}
+
+static inline void op_return(struct mState *ms, const struct decoded *d){
+        if(ms->stackSize == 0){
+                puts("return called when stack is empty");
+        } else {
+                ms->pc = ms->stack[ms->stackSize - 1];
+                ms->stackSize--;
+        }
+}
+
+static inline void op_jump(struct mState *ms, const struct decoded *d){
+        ms->pc = d->nnn;
+}
+
+static inline void op_call(struct mState *ms, const struct decoded *d){
+        if(ms->stackSize == ms->stackCapacity){
+                puts("stack overflow!");
+                printf("%x %x\n", d->ins, ms->pc);
+        } else {
+                ms->stack[ms->stackSize++] = ms->pc + 2;
+                ms->pc = d->nnn;
+        }
+}
+
+static inline void op_skip_eq_imm(struct mState *ms, const struct decoded *d){
+        ms->pc += (ms->registers[d->x] == d->nn) ? 4 : 2;
+}
+
+static inline void op_skip_ne_imm(struct mState *ms, const struct decoded *d){
+        ms->pc += (ms->registers[d->x] != d->nn) ? 4 : 2;
+}
+
+static inline void op_skip_eq(struct mState *ms, const struct decoded *d){
+        ms->pc += (ms->registers[d->x] == ms->registers[d->y]) ? 4 : 2;
+}
+
+static inline void op_skip_ne(struct mState *ms, const struct decoded *d){
+        ms->pc += (ms->registers[d->x] != ms->registers[d->y]) ? 4 : 2;
+}
+
+static inline void op_load_imm(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] = d->nn;
+        ms->pc += 2;
+}
+
+static inline void op_add_imm(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] += d->nn;
+        ms->pc += 2;
+}
+
+static inline void op_move(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] = ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_or(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] |= ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_and(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] &= ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_xor(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] ^= ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_add(struct mState *ms, const struct decoded *d){
+        ms->registers[0xF] = ms->registers[d->y] > (255 - ms->registers[d->x]);
+        ms->registers[d->x] += ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_sub(struct mState *ms, const struct decoded *d){
+        ms->registers[0xF] = ms->registers[d->y] < ms->registers[d->x];
+        ms->registers[d->x] -= ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_shr(struct mState *ms, const struct decoded *d){
+        ms->registers[0xF] = ms->registers[d->y] & 1;
+        ms->registers[d->y] = ms->registers[d->y] >> 1;
+        ms->registers[d->x] = ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_subn(struct mState *ms, const struct decoded *d){
+        ms->registers[0xF] = ms->registers[d->x] < ms->registers[d->y];
+        ms->registers[d->x] = ms->registers[d->y] - ms->registers[d->x];
+        ms->pc += 2;
+}
+
+static inline void op_shl(struct mState *ms, const struct decoded *d){
+        ms->registers[0xF] = (ms->registers[d->y] & 0x80) > 0;
+        ms->registers[d->y] = ms->registers[d->y] << 1;
+        ms->registers[d->x] = ms->registers[d->y];
+        ms->pc += 2;
+}
+
+static inline void op_load_i(struct mState *ms, const struct decoded *d){
+        ms->iRegister = d->nnn;
+        ms->pc += 2;
+}
+
+static inline void op_jump_v0(struct mState *ms, const struct decoded *d){
+        ms->pc = ms->registers[0] + d->nnn;
+}
+
+static inline void op_skip_key(struct mState *ms, const struct decoded *d){
+        ms->pc += ms->keys[ms->registers[d->x] & 0xF] ? 4 : 2;
+}
+
+static inline void op_skip_not_key(struct mState *ms, const struct decoded *d){
+        ms->pc += !ms->keys[ms->registers[d->x] & 0xF] ? 4 : 2;
+}
+
+static inline void op_get_delay(struct mState *ms, const struct decoded *d){
+        ms->registers[d->x] = ms->dTimer;
+        ms->pc += 2;
+}
+
+static inline void op_set_delay(struct mState *ms, const struct decoded *d){
+        ms->dTimer = ms->registers[d->x];
+        ms->pc += 2;
+}
+
+static inline void op_set_sound(struct mState *ms, const struct decoded *d){
+        if(ms->audio != NULL)
+                chip8_sound_edge(ms);
+        ms->sTimer = ms->registers[d->x];
+        ms->pc += 2;
+}
+
+static inline void op_add_i(struct mState *ms, const struct decoded *d){
+        ms->iRegister += ms->registers[d->x];
+        ms->pc += 2;
+}
+
+static inline void op_font(struct mState *ms, const struct decoded *d){
+        ms->iRegister = ms->registers[d->x] * 5;
+        ms->pc += 2;
+}
+
+static inline void op_load_regs(struct mState *ms, const struct decoded *d){
+        for(size_t i = 0; i <= d->x; i++)
+                ms->registers[i] = ms->mem[ms->iRegister++ & 0xFFF];
+        ms->pc += 2;
+}
+
+#endif
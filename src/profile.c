@@ -0,0 +1,245 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+
+#include "profile.h"
+
+#define PROFILE_TOP_PCS 20
+
+static const char *classNames[PROF_CLASSES] = {
+        [PROF_CLS] = "00E0", [PROF_RET] = "00EE", [PROF_SYS] = "0NNN",
+        [PROF_JP] = "1NNN", [PROF_CALL] = "2NNN", [PROF_SE_IMM] = "3XNN",
+        [PROF_SNE_IMM] = "4XNN", [PROF_SE] = "5XY0", [PROF_LD_IMM] = "6XNN",
+        [PROF_ADD_IMM] = "7XNN", [PROF_LD] = "8XY0", [PROF_OR] = "8XY1",
+        [PROF_AND] = "8XY2", [PROF_XOR] = "8XY3", [PROF_ADD] = "8XY4",
+        [PROF_SUB] = "8XY5", [PROF_SHR] = "8XY6", [PROF_SUBN] = "8XY7",
+        [PROF_SHL] = "8XYE", [PROF_SNE] = "9XY0", [PROF_LD_I] = "ANNN",
+        [PROF_JP_V0] = "BNNN", [PROF_RND] = "CXNN", [PROF_DRW] = "DXYN",
+        [PROF_SKP] = "EX9E", [PROF_SKNP] = "EXA1", [PROF_LD_DT] = "FX07",
+        [PROF_LD_K] = "FX0A", [PROF_SET_DT] = "FX15", [PROF_SET_ST] = "FX18",
+        [PROF_ADD_I] = "FX1E", [PROF_FONT] = "FX29", [PROF_BCD] = "FX33",
+        [PROF_STORE] = "FX55", [PROF_LOAD] = "FX65", [PROF_SCD] = "00CN",
+        [PROF_SCR] = "00FB", [PROF_SCL] = "00FC", [PROF_EXIT] = "00FD",
+        [PROF_LOW] = "00FE", [PROF_HIGH] = "00FF", [PROF_BIG_FONT] = "FX30",
+        [PROF_SAVE_FLAGS] = "FX75", [PROF_LOAD_FLAGS] = "FX85",
+        [PROF_UNKNOWN] = "????"
+};
+
+static const uint8_t aluClasses[16] = {
+        PROF_LD, PROF_OR, PROF_AND, PROF_XOR, PROF_ADD, PROF_SUB, PROF_SHR,
+        PROF_SUBN, PROF_UNKNOWN, PROF_UNKNOWN, PROF_UNKNOWN, PROF_UNKNOWN,
+        PROF_UNKNOWN, PROF_UNKNOWN, PROF_SHL, PROF_UNKNOWN
+};
+
+static const uint8_t simpleClasses[16] = {
+        PROF_SYS, PROF_JP, PROF_CALL, PROF_SE_IMM, PROF_SNE_IMM, PROF_SE,
+        PROF_LD_IMM, PROF_ADD_IMM, PROF_UNKNOWN, PROF_SNE, PROF_LD_I,
+        PROF_JP_V0, PROF_RND, PROF_DRW, PROF_UNKNOWN, PROF_UNKNOWN
+};
+
+/* Which class of instruction ins is, as run_instruction sees it */
+enum profile_class profile_classify(uint16_t ins){
+        switch(ins >> 12){
+                case 0x0:
+                        if(ins == 0x00E0) return PROF_CLS;
+                        if(ins == 0x00EE) return PROF_RET;
+                        if((ins & 0xFFF0) == 0x00C0) return PROF_SCD;
+                        if(ins >= 0x00FB && ins <= 0x00FF)
+                                return PROF_SCR + (ins - 0x00FB);
+                        return PROF_SYS;
+                case 0x8:
+                        return aluClasses[ins & 0xF];
+                case 0xE:
+                        if((ins & 0xFF) == 0x9E) return PROF_SKP;
+                        if((ins & 0xFF) == 0xA1) return PROF_SKNP;
+                        return PROF_UNKNOWN;
+                case 0xF:
+                        switch(ins & 0xFF){
+                                case 0x07: return PROF_LD_DT;
+                                case 0x0A: return PROF_LD_K;
+                                case 0x15: return PROF_SET_DT;
+                                case 0x18: return PROF_SET_ST;
+                                case 0x1E: return PROF_ADD_I;
+                                case 0x29: return PROF_FONT;
+                                case 0x30: return PROF_BIG_FONT;
+                                case 0x33: return PROF_BCD;
+                                case 0x55: return PROF_STORE;
+                                case 0x65: return PROF_LOAD;
+                                case 0x75: return PROF_SAVE_FLAGS;
+                                case 0x85: return PROF_LOAD_FLAGS;
+                        }
+                        return PROF_UNKNOWN;
+        }
+        return simpleClasses[ins >> 12];
+}
+
+const char *profile_class_name(enum profile_class c){
+        return (c < PROF_CLASSES) ? classNames[c] : classNames[PROF_UNKNOWN];
+}
+
+/* Starts profiling ms from the instruction at its program counter, which
+ * becomes the root of the call tree */
+struct profile *profile_init(struct mState *ms){
+        struct profile *p = calloc(1, sizeof(struct profile));
+        if(p == NULL) return NULL;
+        p->capacity = 256;
+        p->nodes = malloc(p->capacity * sizeof(struct profile_node));
+        if(p->nodes == NULL) goto nodesFail;
+        memset(&p->nodes[0], 0, sizeof(struct profile_node));
+        p->nodes[0].addr = ms->pc;
+        p->nodeCount = 1;
+        return p;
+nodesFail:
+        free(p);
+        return NULL;
+}
+
+void profile_destroy(struct profile **p){
+        if(*p == NULL) return;
+        free((*p)->nodes);
+        free(*p);
+        *p = NULL;
+}
+
+/* Moves into the subroutine at addr called from the current chain */
+static void enter(struct profile *p, uint16_t addr){
+        if(p->hidden != 0){
+                p->hidden++;
+                p->truncated++;
+                return;
+        }
+        struct profile_node *cur = &p->nodes[p->current];
+        uint32_t n;
+        for(n = cur->child; n != 0; n = p->nodes[n].sibling)
+                if(p->nodes[n].addr == addr){
+                        p->current = n;
+                        return;
+                }
+
+        if(p->nodeCount == p->capacity){
+                struct profile_node *grown = NULL;
+                if(p->capacity < PROFILE_MAX_NODES)
+                        grown = realloc(p->nodes, p->capacity * 2 * sizeof(struct profile_node));
+                if(grown == NULL){
+                        /* Stay in the caller until the matching return */
+                        p->hidden++;
+                        p->truncated++;
+                        return;
+                }
+                p->nodes = grown;
+                p->capacity *= 2;
+                cur = &p->nodes[p->current];
+        }
+        n = p->nodeCount++;
+        p->nodes[n].addr = addr;
+        p->nodes[n].parent = p->current;
+        p->nodes[n].child = 0;
+        p->nodes[n].sibling = cur->child;
+        p->nodes[n].self = 0;
+        cur->child = n;
+        p->current = n;
+}
+
+static void leave(struct profile *p){
+        if(p->hidden != 0)
+                p->hidden--;
+        else if(p->current == 0)
+                p->unmatched++;
+        else
+                p->current = p->nodes[p->current].parent;
+}
+
+/* Counts the instruction at the program counter, call it before the
+ * instruction is executed */
+void profile_step(struct profile *p, struct mState *ms){
+        uint16_t pc = ms->pc;
+        uint16_t ins = (uint16_t) ms->mem[pc] << 8 | ms->mem[pc + 1];
+        enum profile_class c = profile_classify(ins);
+        p->classes[c]++;
+        p->pcs[pc]++;
+        p->total++;
+        p->nodes[p->current].self++;
+        /* A call that overflows the stack, or a return with an empty one,
+         * goes nowhere */
+        if(c == PROF_CALL && ms->stackSize < ms->stackCapacity)
+                enter(p, ins & 0xFFF);
+        else if(c == PROF_RET && ms->stackSize != 0)
+                leave(p);
+}
+
+static double share(struct profile *p, uint64_t n){
+        return (p->total != 0) ? 100.0 * n / p->total : 0.0;
+}
+
+/* Writes the instruction classes, and the busiest addresses, most executed
+ * first */
+void profile_report(struct profile *p, FILE *fp){
+        uint8_t done[PROF_CLASSES] = {0};
+        fprintf(fp, "PROFILE: %lu instructions, %u call chains, %lu calls too deep, %lu returns without a call\n",
+                        p->total, p->nodeCount, p->truncated, p->unmatched);
+        for(;;){
+                int best = -1;
+                for(int c = 0; c < PROF_CLASSES; c++)
+                        if(!done[c] && p->classes[c] != 0 && (best < 0 || p->classes[c] > p->classes[best]))
+                                best = c;
+                if(best < 0) break;
+                done[best] = 1;
+                fprintf(fp, "PROFILE: %s %12lu %5.1f%%\n", classNames[best],
+                                p->classes[best], share(p, p->classes[best]));
+        }
+
+        uint64_t below = UINT64_MAX;
+        int last = -1;
+        for(int n = 0; n < PROFILE_TOP_PCS; n++){
+                /* The next busiest address after last, ties in address
+                 * order */
+                int best = -1;
+                for(int pc = 0; pc < 4096; pc++){
+                        uint64_t v = p->pcs[pc];
+                        if(v == 0 || v > below || (v == below && pc <= last))
+                                continue;
+                        if(best < 0 || v > p->pcs[best])
+                                best = pc;
+                }
+                if(best < 0) break;
+                below = p->pcs[best];
+                last = best;
+                fprintf(fp, "PROFILE: 0x%03x %12lu %5.1f%%\n", best, below, share(p, below));
+        }
+}
+
+/* Writes one line for every call chain that executed instructions itself,
+ * outermost subroutine first, followed by its count. Returns 0, or -1 if
+ * writing failed */
+int profile_write_folded(struct profile *p, FILE *fp){
+        uint16_t *chain = malloc(p->nodeCount * sizeof(uint16_t));
+        if(chain == NULL) return -1;
+        for(uint32_t n = 0; n < p->nodeCount; n++){
+                if(p->nodes[n].self == 0)
+                        continue;
+                size_t depth = 0;
+                for(uint32_t a = n; ; a = p->nodes[a].parent){
+                        chain[depth++] = p->nodes[a].addr;
+                        if(a == 0) break;
+                }
+                while(depth-- > 0)
+                        fprintf(fp, "0x%03x%c", chain[depth], (depth != 0) ? ';' : ' ');
+                fprintf(fp, "%lu\n", p->nodes[n].self);
+        }
+        free(chain);
+        return ferror(fp) ? -1 : 0;
+}
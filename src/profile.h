@@ -0,0 +1,89 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_PROFILE_H
+#define _SRC_PROFILE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+
+/* Counts the instructions a chip executes, by class of instruction, by
+ * address, and by emulated call stack. The stack is followed through 2NNN
+ * and 00EE, every distinct chain of subroutines is a node in a tree, and
+ * each instruction is counted against the node it ran in. The tree is
+ * written as folded stacks, one line per chain, which flamegraph.pl and
+ * speedscope read as is.
+ *
+ * The chip only calls profile_step when built with profile=true, see
+ * chip8_step, other builds carry no trace of it in the execution loop.
+ */
+
+/* Call chains beyond this many are counted against their caller */
+#define PROFILE_MAX_NODES 65536
+
+enum profile_class {
+        PROF_CLS, PROF_RET, PROF_SYS, PROF_JP, PROF_CALL, PROF_SE_IMM,
+        PROF_SNE_IMM, PROF_SE, PROF_LD_IMM, PROF_ADD_IMM, PROF_LD, PROF_OR,
+        PROF_AND, PROF_XOR, PROF_ADD, PROF_SUB, PROF_SHR, PROF_SUBN, PROF_SHL,
+        PROF_SNE, PROF_LD_I, PROF_JP_V0, PROF_RND, PROF_DRW, PROF_SKP,
+        PROF_SKNP, PROF_LD_DT, PROF_LD_K, PROF_SET_DT, PROF_SET_ST, PROF_ADD_I,
+        PROF_FONT, PROF_BCD, PROF_STORE, PROF_LOAD, PROF_SCD, PROF_SCR,
+        PROF_SCL, PROF_EXIT, PROF_LOW, PROF_HIGH, PROF_BIG_FONT,
+        PROF_SAVE_FLAGS, PROF_LOAD_FLAGS, PROF_UNKNOWN,
+        PROF_CLASSES
+};
+
+struct profile_node {
+        /* The address the subroutine was called at, and its caller */
+        uint16_t addr;
+        uint32_t parent;
+        /* The first subroutine called from here, and the next one called
+         * from the caller */
+        uint32_t child;
+        uint32_t sibling;
+        /* Instructions executed in this chain, not counting callees */
+        uint64_t self;
+};
+
+struct profile {
+        uint64_t classes[PROF_CLASSES];
+        uint64_t pcs[4096];
+        uint64_t total;
+
+        /* The call tree, node 0 is the code running when profiling began */
+        struct profile_node *nodes;
+        uint32_t nodeCount;
+        uint32_t capacity;
+        uint32_t current;
+        /* Calls not in the tree that have not returned yet */
+        uint32_t hidden;
+        /* Calls, and returns, that did not fit in the tree, or had no
+         * caller */
+        uint64_t truncated;
+        uint64_t unmatched;
+};
+
+struct profile *profile_init(struct mState *ms);
+void profile_destroy(struct profile **p);
+enum profile_class profile_classify(uint16_t ins);
+const char *profile_class_name(enum profile_class c);
+void profile_step(struct profile *p, struct mState *ms);
+void profile_report(struct profile *p, FILE *fp);
+int profile_write_folded(struct profile *p, FILE *fp);
+
+#endif
@@ -0,0 +1,358 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+#include <time.h>
+
+#include "rewind.h"
+#include "savestate.h"
+
+/* Numbers in packed snapshots are 7 bits a byte, low bits first, with the
+ * top bit set on every byte but the last */
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v){
+        while(v >= 0x80){
+                *p++ = v | 0x80;
+                v >>= 7;
+        }
+        *p++ = v;
+        return p;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *p, uint64_t *v){
+        int shift = 0;
+        *v = 0;
+        do {
+                *v |= (uint64_t) (*p & 0x7F) << shift;
+                shift += 7;
+        } while(*p++ & 0x80);
+        return p;
+}
+
+/* Snapshots are packed as a list of runs, the number of bytes that match
+ * the base, the number that do not, then those bytes XORed with the base.
+ * A literal run only ends at MIN_MATCH matching bytes, fewer cost less
+ * than starting another run */
+#define MIN_MATCH 3
+/* Enough for two varints of any length a snapshot can have */
+#define MAX_HEADER 20
+
+static inline uint8_t base_at(const uint8_t *base, size_t i){
+        return (base != NULL) ? base[i] : 0;
+}
+
+/* Packs image XORed with base, or on its own if base is NULL, into out.
+ * Returns the packed length */
+static size_t pack(const uint8_t *image, const uint8_t *base, size_t len, uint8_t *out){
+        uint8_t *p = out;
+        size_t i = 0;
+        while(i < len){
+                size_t start = i;
+                while(i < len && image[i] == base_at(base, i))
+                        i++;
+                if(i == len)
+                        break;
+                size_t lit = i, same = 0;
+                while(i < len && same < MIN_MATCH){
+                        same = (image[i] == base_at(base, i)) ? same + 1 : 0;
+                        i++;
+                }
+                if(same == MIN_MATCH)
+                        i -= MIN_MATCH;
+                p = put_varint(p, lit - start);
+                p = put_varint(p, i - lit);
+                for(size_t k = lit; k < i; k++)
+                        *p++ = image[k] ^ base_at(base, k);
+        }
+        return p - out;
+}
+
+/* XORs a packed snapshot of len bytes into out */
+static void unpack(const uint8_t *p, size_t len, uint8_t *out){
+        const uint8_t *end = p + len;
+        size_t i = 0;
+        while(p < end){
+                uint64_t skip, lit;
+                p = get_varint(p, &skip);
+                p = get_varint(p, &lit);
+                i += skip;
+                for(size_t k = 0; k < lit; k++)
+                        out[i++] ^= *p++;
+        }
+}
+
+/* A snapshot in a group, its count less the one before it, and its
+ * packed length, as varints, then the packed snapshot */
+struct record {
+        const uint8_t *data;
+        uint64_t count;
+        uint64_t len;
+        const uint8_t *next;
+};
+
+static inline void read_record(const uint8_t *r, uint64_t count, struct record *rec){
+        uint64_t since;
+        r = get_varint(r, &since);
+        r = get_varint(r, &rec->len);
+        rec->count = count + since;
+        rec->data = r;
+        rec->next = r + rec->len;
+}
+
+static inline struct rewind_group *group(struct rewind *rw, size_t n){
+        return &rw->groups[(rw->head + n) % rw->capacity];
+}
+
+static void drop_oldest(struct rewind *rw){
+        struct rewind_group *g = group(rw, 0);
+        rw->bytes -= g->cap;
+        free(g->data);
+        rw->head = (rw->head + 1) % rw->capacity;
+        rw->size--;
+}
+
+static void drop_newest(struct rewind *rw){
+        struct rewind_group *g = group(rw, rw->size - 1);
+        rw->bytes -= g->cap;
+        free(g->data);
+        rw->size--;
+}
+
+/* Doubles the ring, keeping the groups in order */
+static int grow(struct rewind *rw){
+        size_t capacity = rw->capacity * 2;
+        struct rewind_group *groups = malloc(capacity * sizeof(struct rewind_group));
+        if(groups == NULL) return -1;
+        for(size_t n = 0; n < rw->size; n++)
+                groups[n] = *group(rw, n);
+        free(rw->groups);
+        rw->groups = groups;
+        rw->capacity = capacity;
+        rw->head = 0;
+        return 0;
+}
+
+/* Appends the packed snapshot in rw->packed to g, returns -1 if g can not
+ * grow */
+static int append(struct rewind *rw, struct rewind_group *g, uint64_t count, size_t len){
+        if(g->len + MAX_HEADER + len > g->cap){
+                size_t cap = (g->cap != 0) ? g->cap * 2 : 1024;
+                while(cap < g->len + MAX_HEADER + len)
+                        cap *= 2;
+                uint8_t *data = realloc(g->data, cap);
+                if(data == NULL) return -1;
+                rw->bytes += cap - g->cap;
+                g->data = data;
+                g->cap = cap;
+        }
+        uint8_t *r = g->data + g->len;
+        r = put_varint(r, count - g->last);
+        r = put_varint(r, len);
+        memcpy(r, rw->packed, len);
+        g->len = r + len - g->data;
+        g->last = count;
+        g->snapshots++;
+        return 0;
+}
+
+/* Gives a finished group back the space it did not use */
+static void shrink(struct rewind *rw, struct rewind_group *g){
+        uint8_t *data = realloc(g->data, g->len);
+        if(data == NULL) return;
+        rw->bytes -= g->cap - g->len;
+        g->data = data;
+        g->cap = g->len;
+}
+
+/* Creates a history for ms of at most budget bytes, with a keyframe every
+ * keyInterval frames. The history is only filled once it is attached to
+ * the chip's rewind field, or by calling rewind_capture */
+struct rewind *rewind_init(struct mState *ms, size_t budget, uint32_t keyInterval){
+        struct rewind *rw = calloc(1, sizeof(struct rewind));
+        if(rw == NULL) return NULL;
+        rw->budget = budget;
+        rw->keyInterval = (keyInterval != 0) ? keyInterval : 1;
+        rw->imageLen = chip8_state_max_size(ms);
+        rw->capacity = 16;
+        rw->groups = malloc(rw->capacity * sizeof(struct rewind_group));
+        if(rw->groups == NULL) goto groupsFail;
+        rw->last = calloc(rw->imageLen, 1);
+        if(rw->last == NULL) goto lastFail;
+        rw->image = calloc(rw->imageLen, 1);
+        if(rw->image == NULL) goto imageFail;
+        /* The worst case is a run for every MIN_MATCH + 1 bytes */
+        rw->packed = malloc(rw->imageLen * 2 + MAX_HEADER);
+        if(rw->packed == NULL) goto packedFail;
+        return rw;
+packedFail:
+        free(rw->image);
+imageFail:
+        free(rw->last);
+lastFail:
+        free(rw->groups);
+groupsFail:
+        free(rw);
+        return NULL;
+}
+
+void rewind_destroy(struct rewind **rw){
+        if(*rw == NULL) return;
+        while((*rw)->size > 0)
+                drop_oldest(*rw);
+        free((*rw)->groups);
+        free((*rw)->last);
+        free((*rw)->image);
+        free((*rw)->packed);
+        free(*rw);
+        *rw = NULL;
+}
+
+/* Adds a snapshot of ms to the history, dropping the oldest groups if it
+ * no longer fits. A snapshot that can not be allocated is skipped, and
+ * the next one is a keyframe */
+void rewind_capture(struct rewind *rw, struct mState *ms){
+        size_t len = chip8_state_size(ms);
+        struct runtime_error *re = chip8_save_state(ms, rw->image, rw->imageLen);
+        if(re != NULL){
+                runtime_error_destroy(&re);
+                return;
+        }
+        /* The checksum changes every frame, it is put back by
+         * chip8_state_seal when the snapshot is restored */
+        memset(rw->image + len - 4, 0, rw->imageLen - len + 4);
+
+        struct rewind_group *g = (rw->size != 0) ? group(rw, rw->size - 1) : NULL;
+        int key = g == NULL || rw->broken || g->snapshots >= rw->keyInterval;
+        size_t packed = pack(rw->image, key ? NULL : rw->last, rw->imageLen, rw->packed);
+        if(key){
+                if(g != NULL)
+                        shrink(rw, g);
+                if(rw->size == rw->capacity && grow(rw) != 0)
+                        goto dropped;
+                g = group(rw, rw->size);
+                g->count = g->last = ms->count;
+                g->data = NULL;
+                g->len = 0;
+                g->cap = 0;
+                g->snapshots = 0;
+                if(append(rw, g, ms->count, packed) != 0)
+                        goto dropped;
+                rw->size++;
+        } else if(append(rw, g, ms->count, packed) != 0){
+                goto dropped;
+        }
+        memcpy(rw->last, rw->image, rw->imageLen);
+        rw->broken = 0;
+        rw->captures++;
+
+        while(rw->bytes > rw->budget && rw->size > 1)
+                drop_oldest(rw);
+        return;
+dropped:
+        rw->broken = 1;
+        rw->dropped++;
+}
+
+/* Puts ms back to the point it had executed count instructions. Snapshots
+ * taken after that point are forgotten. The chip must be on the virtual
+ * clock, and not executing */
+struct runtime_error *rewind_to(struct rewind *rw, struct mState *ms, uint64_t count){
+        char errmsg[512];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(ms->insPerFrame == 0)
+                return runtime_error_init("Rewinding needs the virtual clock");
+        if(count > ms->count){
+                snprintf(errmsg, 512, "Can not rewind forward from instruction %lu to %lu", ms->count, count);
+                return runtime_error_init(errmsg);
+        }
+
+        size_t n = rw->size;
+        while(n > 0 && group(rw, n - 1)->count > count)
+                n--;
+        if(n == 0){
+                snprintf(errmsg, 512, "Instruction %lu is older than the rewind history", count);
+                return runtime_error_init(errmsg);
+        }
+        struct rewind_group *g = group(rw, n - 1);
+
+        /* Apply the keyframe, and every snapshot after it up to count */
+        struct record rec, found;
+        uint32_t snapshots = 0;
+        memset(rw->last, 0, rw->imageLen);
+        read_record(g->data, g->count, &rec);
+        do {
+                unpack(rec.data, rec.len, rw->last);
+                found = rec;
+                snapshots++;
+                if(rec.next == g->data + g->len)
+                        break;
+                read_record(rec.next, rec.count, &rec);
+        } while(rec.count <= count);
+
+        memcpy(rw->image, rw->last, rw->imageLen);
+        chip8_state_seal(rw->image);
+        struct runtime_error *re = chip8_load_state(ms, rw->image, rw->imageLen);
+        if(re != NULL)
+                return re;
+        uint64_t replay = count - found.count;
+
+        /* Forget everything after it, the group carries on from there */
+        while(rw->size > n)
+                drop_newest(rw);
+        g->len = found.next - g->data;
+        g->last = found.count;
+        g->snapshots = snapshots;
+        rw->broken = 0;
+
+        struct rewind *attached = ms->rewind;
+        ms->rewind = NULL;
+        chip8_run_headless(ms, replay, 0);
+        ms->rewind = attached;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        rw->rewinds++;
+        rw->lastReplayed = replay;
+        rw->lastLatency = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+        if(rw->lastLatency > rw->maxLatency)
+                rw->maxLatency = rw->lastLatency;
+        return NULL;
+}
+
+/* Rewinds ms by n instructions */
+struct runtime_error *rewind_step_back(struct rewind *rw, struct mState *ms, uint64_t n){
+        char errmsg[512];
+        if(n > ms->count){
+                snprintf(errmsg, 512, "Can not step back %lu instructions from instruction %lu", n, ms->count);
+                return runtime_error_init(errmsg);
+        }
+        return rewind_to(rw, ms, ms->count - n);
+}
+
+/* Writes the size of the history, how far back it reaches, and how long
+ * rewinding took */
+void rewind_report(struct rewind *rw, FILE *fp){
+        uint64_t snapshots = 0;
+        for(size_t n = 0; n < rw->size; n++)
+                snapshots += group(rw, n)->snapshots;
+        fprintf(fp, "REWIND: %lu snapshots (%lu keyframes) in %lu of %lu bytes, %lu bytes per snapshot\n",
+                        snapshots, rw->size, rw->bytes, rw->budget,
+                        (snapshots != 0) ? rw->bytes / snapshots : 0);
+        if(rw->size != 0)
+                fprintf(fp, "REWIND: from instruction %lu, %lu captured, %lu dropped\n",
+                                group(rw, 0)->count, rw->captures, rw->dropped);
+        fprintf(fp, "REWIND: %lu rewinds, last replayed %lu instructions in %lu ns, slowest %lu ns\n",
+                        rw->rewinds, rw->lastReplayed, rw->lastLatency, rw->maxLatency);
+}
@@ -0,0 +1,92 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_REWIND_H
+#define _SRC_REWIND_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "runtime_error.h"
+
+/* A history of snapshots of a chip on the virtual clock, taken at the end
+ * of every frame. Every keyInterval'th snapshot is a keyframe, the save
+ * state of the chip, see savestate.h, the rest hold only the bytes that
+ * differ from the snapshot before them, XORed with it. Both are stored
+ * with runs of zeros removed, a keyframe and the snapshots that depend on
+ * it are kept together in one group. When the history outgrows its budget
+ * the oldest group is dropped.
+ *
+ * Rewinding rebuilds the latest snapshot at or before the instruction
+ * count asked for from its keyframe, and re-executes forward from there, so
+ * it never runs more than one frame of instructions. Key presses during a
+ * frame are not recorded, a rewind sees the keys held at the end of the
+ * frame before.
+ */
+
+#define REWIND_DEFAULT_BUDGET (16 * 1024 * 1024)
+#define REWIND_DEFAULT_INTERVAL 600
+
+/* A keyframe followed by the snapshots that depend on it */
+struct rewind_group {
+        /* ms->count when the keyframe, and the newest snapshot were taken */
+        uint64_t count;
+        uint64_t last;
+        uint8_t *data;
+        size_t len;
+        size_t cap;
+        uint32_t snapshots;
+};
+
+struct rewind {
+        /* Groups, oldest first, in a ring of capacity groups */
+        struct rewind_group *groups;
+        size_t capacity;
+        size_t head;
+        size_t size;
+
+        /* Bytes held by the groups, and the most they may hold */
+        size_t bytes;
+        size_t budget;
+        uint32_t keyInterval;
+        /* Set when a snapshot was skipped, the next one can not be a
+         * delta */
+        uint8_t broken;
+
+        /* The newest snapshot, and scratch space, each imageLen bytes */
+        size_t imageLen;
+        uint8_t *last;
+        uint8_t *image;
+        uint8_t *packed;
+
+        /* Statistics */
+        uint64_t captures;
+        uint64_t dropped;
+        uint64_t rewinds;
+        uint64_t lastReplayed;
+        uint64_t lastLatency;
+        uint64_t maxLatency;
+};
+
+struct rewind *rewind_init(struct mState *ms, size_t budget, uint32_t keyInterval);
+void rewind_destroy(struct rewind **rw);
+void rewind_capture(struct rewind *rw, struct mState *ms);
+struct runtime_error *rewind_to(struct rewind *rw, struct mState *ms, uint64_t count);
+struct runtime_error *rewind_step_back(struct rewind *rw, struct mState *ms, uint64_t n);
+void rewind_report(struct rewind *rw, FILE *fp);
+
+#endif
@@ -21,7 +21,7 @@
 struct runtime_error *runtime_error_init(char *msg){
         struct runtime_error *re = malloc(sizeof(struct runtime_error));
         if(re == NULL) goto mFail;
-        re->msg = calloc(strlen(msg), sizeof(char));
+        re->msg = calloc(strlen(msg) + 1, sizeof(char));
         if(re->msg == NULL) goto msgFail;
         strcpy(re->msg, msg);
 
@@ -0,0 +1,303 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "savestate.h"
+
+#define HEADER_LEN 12
+/* count, pc, I, V0-VF, the timers, stack size, rngState, keys, display,
+ * the mode, the flags and memory */
+#define MACHINE_LEN (8 + 2 + 2 + 16 + 1 + 1 + 2 + 4 + 16 + CHIP8_LINES * 16 + 1 + CHIP8_RPL_FLAGS + 4096)
+#define DISPLAY_OFFSET 52
+#define MODE_OFFSET (DISPLAY_OFFSET + CHIP8_LINES * 16)
+#define FLAGS_OFFSET (MODE_OFFSET + 1)
+#define MEMORY_OFFSET (FLAGS_OFFSET + CHIP8_RPL_FLAGS)
+/* Version 1 has the 64x32 display, a word a line, and no mode or flags */
+#define MACHINE_LEN_V1 (DISPLAY_OFFSET + 32 * 8 + 4096)
+#define MEMORY_OFFSET_V1 (DISPLAY_OFFSET + 32 * 8)
+#define CRC_LEN 4
+
+static const uint8_t magic[4] = {'C', '8', 'S', 'S'};
+
+/* CRC-32 (IEEE 802.3) eight bytes at a time, crcTable[k][n] is the CRC of
+ * byte n followed by k zero bytes */
+static uint32_t crcTable[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+        for(uint32_t n = 0; n < 256; n++){
+                uint32_t c = n;
+                for(int k = 0; k < 8; k++)
+                        c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+                crcTable[0][n] = c;
+        }
+        for(uint32_t n = 0; n < 256; n++)
+                for(int k = 1; k < 8; k++)
+                        crcTable[k][n] = (crcTable[k - 1][n] >> 8) ^ crcTable[0][crcTable[k - 1][n] & 0xFF];
+}
+
+static uint32_t crc32(const uint8_t *buf, size_t len){
+        uint32_t crc = 0xFFFFFFFF;
+        size_t i = 0;
+        pthread_once(&crcOnce, crc_init);
+        for(; i + 8 <= len; i += 8){
+                uint32_t lo = crc ^ (buf[i] | buf[i + 1] << 8 | buf[i + 2] << 16 | (uint32_t) buf[i + 3] << 24);
+                crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+                        crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+                        crcTable[3][buf[i + 4]] ^ crcTable[2][buf[i + 5]] ^
+                        crcTable[1][buf[i + 6]] ^ crcTable[0][buf[i + 7]];
+        }
+        for(; i < len; i++)
+                crc = (crc >> 8) ^ crcTable[0][(crc ^ buf[i]) & 0xFF];
+        return ~crc;
+}
+
+static inline uint8_t *put16(uint8_t *p, uint16_t v){
+        p[0] = v;
+        p[1] = v >> 8;
+        return p + 2;
+}
+
+static inline uint8_t *put32(uint8_t *p, uint32_t v){
+        p = put16(p, v);
+        return put16(p, v >> 16);
+}
+
+static inline uint8_t *put64(uint8_t *p, uint64_t v){
+        p = put32(p, v);
+        return put32(p, v >> 32);
+}
+
+/* Display words are stored most significant byte first, so the leftmost
+ * pixel of a line is the top bit of its first byte */
+static inline uint8_t *put_line(uint8_t *p, uint64_t v){
+        for(int i = 0; i < 8; i++)
+                p[i] = v >> (56 - 8 * i);
+        return p + 8;
+}
+
+static inline uint16_t get16(const uint8_t *p){
+        return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t *p){
+        return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static inline uint64_t get64(const uint8_t *p){
+        return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static inline uint64_t get_line(const uint8_t *p){
+        uint64_t v = 0;
+        for(int i = 0; i < 8; i++)
+                v = v << 8 | p[i];
+        return v;
+}
+
+/* The number of bytes chip8_save_state needs for the chip as it is now */
+size_t chip8_state_size(struct mState *ms){
+        return HEADER_LEN + MACHINE_LEN + ms->stackSize * 2 + CRC_LEN;
+}
+
+/* The largest state the chip can have, with its stack full */
+size_t chip8_state_max_size(struct mState *ms){
+        return HEADER_LEN + MACHINE_LEN + ms->stackCapacity * 2 + CRC_LEN;
+}
+
+/* Writes the machine to buf. The chip must not be executing, the keys are
+ * read under keyMutex, and the timers are atomics, read without a lock */
+struct runtime_error *chip8_save_state(struct mState *ms, uint8_t *buf, size_t size){
+        char errmsg[512];
+        size_t len = chip8_state_size(ms);
+        if(size < len){
+                snprintf(errmsg, 512, "Save state needs %lu bytes, the buffer is %lu bytes", len, size);
+                return runtime_error_init(errmsg);
+        }
+
+        uint8_t *p = buf;
+        memcpy(p, magic, sizeof(magic));
+        p = put16(p + sizeof(magic), SAVESTATE_VERSION);
+        p = put16(p, 0);
+        p = put32(p, len);
+
+        p = put64(p, ms->count);
+        p = put16(p, ms->pc);
+        p = put16(p, ms->iRegister);
+        memcpy(p, ms->registers, 16);
+        p += 16;
+        *p++ = ms->dTimer;
+        *p++ = ms->sTimer;
+        p = put16(p, ms->stackSize);
+        p = put32(p, ms->rngState);
+        pthread_mutex_lock(&ms->keyMutex);
+        memcpy(p, ms->keys, 16);
+        pthread_mutex_unlock(&ms->keyMutex);
+        p += 16;
+        for(int i = 0; i < CHIP8_LINES; i++){
+                p = put_line(p, ms->disp[i][0]);
+                p = put_line(p, ms->disp[i][1]);
+        }
+        *p++ = ms->hires;
+        memcpy(p, ms->rplFlags, CHIP8_RPL_FLAGS);
+        p += CHIP8_RPL_FLAGS;
+        memcpy(p, ms->mem, 4096);
+        p += 4096;
+        for(size_t i = 0; i < ms->stackSize; i++)
+                p = put16(p, ms->stack[i]);
+
+        put32(p, crc32(buf, len - CRC_LEN));
+        return NULL;
+}
+
+/* Replaces the machine with the one in buf. Nothing is changed unless the
+ * whole state is valid. Version 1 states load in the 64x32 mode, with the
+ * flags cleared. The chip must not be executing, it can be halted, or
+ * between frames run by a scheduler */
+struct runtime_error *chip8_load_state(struct mState *ms, const uint8_t *buf, size_t size){
+        char errmsg[512];
+        if(size < HEADER_LEN + MACHINE_LEN_V1 + CRC_LEN || memcmp(buf, magic, sizeof(magic)) != 0)
+                return runtime_error_init("Not a save state");
+        uint16_t version = get16(buf + 4);
+        if(version != 1 && version != SAVESTATE_VERSION){
+                snprintf(errmsg, 512, "Save state version %u is not supported, expected %u", version, SAVESTATE_VERSION);
+                return runtime_error_init(errmsg);
+        }
+        size_t machineLen = (version == 1) ? MACHINE_LEN_V1 : MACHINE_LEN;
+        size_t len = get32(buf + 8);
+        const uint8_t *p = buf + HEADER_LEN;
+        size_t stackSize = get16(p + 30);
+        if(len > size || len != HEADER_LEN + machineLen + stackSize * 2 + CRC_LEN){
+                snprintf(errmsg, 512, "Save state is %lu bytes, it should be %lu", size, len);
+                return runtime_error_init(errmsg);
+        }
+        if(get32(buf + len - CRC_LEN) != crc32(buf, len - CRC_LEN))
+                return runtime_error_init("Save state checksum does not match");
+        if(stackSize > ms->stackCapacity){
+                snprintf(errmsg, 512, "Save state stack of %lu entries does not fit in %lu", stackSize, ms->stackCapacity);
+                return runtime_error_init(errmsg);
+        }
+        /* The engines index memory with them, so they have to be in it */
+        uint16_t pc = get16(p + 8);
+        if(pc > 0xFFF){
+                snprintf(errmsg, 512, "Save state PC 0x%X is outside memory", pc);
+                return runtime_error_init(errmsg);
+        }
+        for(size_t i = 0; i < stackSize; i++){
+                uint16_t addr = get16(p + machineLen + i * 2);
+                if(addr > 0xFFF){
+                        snprintf(errmsg, 512, "Save state stack entry 0x%X is outside memory", addr);
+                        return runtime_error_init(errmsg);
+                }
+        }
+
+        ms->count = get64(p);
+        ms->pc = pc;
+        ms->iRegister = get16(p + 10);
+        memcpy(ms->registers, p + 12, 16);
+        ms->dTimer = p[28];
+        ms->sTimer = p[29];
+        ms->stackSize = stackSize;
+        ms->rngState = get32(p + 32);
+        pthread_mutex_lock(&ms->keyMutex);
+        memcpy(ms->keys, p + 36, 16);
+        pthread_mutex_unlock(&ms->keyMutex);
+        if(version == 1){
+                memset(ms->disp, 0, sizeof(ms->disp));
+                for(int i = 0; i < 32; i++)
+                        ms->disp[i][0] = get_line(p + DISPLAY_OFFSET + i * 8);
+                ms->hires = 0;
+                memset(ms->rplFlags, 0, CHIP8_RPL_FLAGS);
+                memcpy(ms->mem, p + MEMORY_OFFSET_V1, 4096);
+        } else {
+                for(int i = 0; i < CHIP8_LINES; i++){
+                        ms->disp[i][0] = get_line(p + DISPLAY_OFFSET + i * 16);
+                        ms->disp[i][1] = get_line(p + DISPLAY_OFFSET + i * 16 + 8);
+                }
+                ms->hires = p[MODE_OFFSET] != 0;
+                memcpy(ms->rplFlags, p + FLAGS_OFFSET, CHIP8_RPL_FLAGS);
+                memcpy(ms->mem, p + MEMORY_OFFSET, 4096);
+        }
+        p += machineLen;
+        for(size_t i = 0; i < stackSize; i++)
+                ms->stack[i] = get16(p + i * 2);
+
+        decode_invalidate_all(ms);
+        ms->dirty = CHIP8_ALL_LINES;
+        if(ms->display != NULL)
+                ui_set_chip8_display(ms->display, ms->disp, CHIP8_ALL_LINES, ms->hires);
+        return NULL;
+}
+
+/* Rewrites the checksum of a state built, or changed, outside
+ * chip8_save_state from the length in its header */
+void chip8_state_seal(uint8_t *buf){
+        size_t len = get32(buf + 8);
+        put32(buf + len - CRC_LEN, crc32(buf, len - CRC_LEN));
+}
+
+/* The CRC-32 states are checked with, for other data worth checking */
+uint32_t chip8_crc32(const uint8_t *buf, size_t len){
+        return crc32(buf, len);
+}
+
+struct runtime_error *chip8_save_state_file(struct mState *ms, char *file){
+        char errmsg[512];
+        struct runtime_error *re;
+        size_t len = chip8_state_size(ms);
+        uint8_t *buf = malloc(len);
+        if(buf == NULL)
+                return runtime_error_init("Could not allocate the save state");
+        re = chip8_save_state(ms, buf, len);
+        if(re != NULL) goto done;
+
+        FILE *fp = fopen(file, "wb");
+        if(fp == NULL || fwrite(buf, 1, len, fp) != len){
+                snprintf(errmsg, 512, "Could not write save state file: \"%s\"", file);
+                re = runtime_error_init(errmsg);
+        }
+        if(fp != NULL && fclose(fp) != 0 && re == NULL){
+                snprintf(errmsg, 512, "Could not write save state file: \"%s\"", file);
+                re = runtime_error_init(errmsg);
+        }
+done:
+        free(buf);
+        return re;
+}
+
+struct runtime_error *chip8_load_state_file(struct mState *ms, char *file){
+        char errmsg[512];
+        struct runtime_error *re;
+        size_t size = chip8_state_max_size(ms);
+        FILE *fp = fopen(file, "rb");
+        if(fp == NULL){
+                snprintf(errmsg, 512, "Could not open save state file: \"%s\"", file);
+                return runtime_error_init(errmsg);
+        }
+        uint8_t *buf = malloc(size);
+        if(buf == NULL){
+                fclose(fp);
+                return runtime_error_init("Could not allocate the save state");
+        }
+        size_t len = fread(buf, 1, size, fp);
+        fclose(fp);
+        re = chip8_load_state(ms, buf, len);
+        free(buf);
+        return re;
+}
@@ -0,0 +1,49 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_SAVESTATE_H
+#define _SRC_SAVESTATE_H
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "runtime_error.h"
+
+/* Save states hold the emulated machine only: the registers, I, PC, the
+ * stack, timers, keys, display and its mode, the SUPER-CHIP flags, memory,
+ * the random number generator and the instruction count. How the chip is
+ * clocked, its threads, locks and UI are left alone.
+ *
+ * Every value is little endian. A state is a 12 byte header, the magic
+ * "C8SS", the version as 16 bits, 16 reserved bits, and the length of the
+ * whole state as 32 bits, then the machine, with the stack last, and a
+ * CRC-32 of everything before it.
+ */
+
+/* Version 2 holds the 128x64 display, and the SUPER-CHIP state, version 1
+ * states still load */
+#define SAVESTATE_VERSION 2
+
+size_t chip8_state_size(struct mState *ms);
+size_t chip8_state_max_size(struct mState *ms);
+struct runtime_error *chip8_save_state(struct mState *ms, uint8_t *buf, size_t size);
+struct runtime_error *chip8_load_state(struct mState *ms, const uint8_t *buf, size_t size);
+void chip8_state_seal(uint8_t *buf);
+uint32_t chip8_crc32(const uint8_t *buf, size_t len);
+struct runtime_error *chip8_save_state_file(struct mState *ms, char *file);
+struct runtime_error *chip8_load_state_file(struct mState *ms, char *file);
+
+#endif
@@ -0,0 +1,336 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "sched.h"
+
+static void *worker(void *data);
+
+static void queue_push(struct sched_queue *q, struct mState *ms){
+        ms->schedNext = NULL;
+        pthread_mutex_lock(&q->lock);
+        if(q->tail != NULL)
+                q->tail->schedNext = ms;
+        else
+                q->head = ms;
+        q->tail = ms;
+        pthread_mutex_unlock(&q->lock);
+}
+
+static struct mState *queue_pop(struct sched_queue *q){
+        pthread_mutex_lock(&q->lock);
+        struct mState *ms = q->head;
+        if(ms != NULL){
+                q->head = ms->schedNext;
+                if(q->head == NULL)
+                        q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return ms;
+}
+
+/* Queues the chip, waking a worker if any are asleep */
+static void enqueue(struct scheduler *s, struct sched_queue *q, struct mState *ms){
+        queue_push(q, ms);
+        atomic_fetch_add(&s->queued, 1);
+        if(atomic_load(&s->idle) != 0){
+                pthread_mutex_lock(&s->lock);
+                pthread_cond_signal(&s->work);
+                pthread_mutex_unlock(&s->lock);
+        }
+}
+
+/* Spreads new and woken chips over the workers */
+static struct sched_queue *next_queue(struct scheduler *s){
+        return &s->workers[atomic_fetch_add(&s->nextQueue, 1) % s->workerCount].queue;
+}
+
+/* Takes a chip from the worker's own queue, or steals one from another
+ * worker's, starting from a random victim */
+static struct mState *take(struct sched_worker *w){
+        struct scheduler *s = w->s;
+        struct mState *ms = queue_pop(&w->queue);
+        if(ms == NULL){
+                uint32_t x = w->rngState;
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                w->rngState = x;
+                for(size_t i = 0; i < s->workerCount && ms == NULL; i++){
+                        size_t victim = (x + i) % s->workerCount;
+                        if(victim == w->id)
+                                continue;
+                        ms = queue_pop(&s->workers[victim].queue);
+                }
+                if(ms != NULL)
+                        atomic_fetch_add(&s->steals, 1);
+        }
+        if(ms != NULL)
+                atomic_fetch_sub(&s->queued, 1);
+        return ms;
+}
+
+/* Takes the chip off the scheduler for good. Called with the chip's key
+ * mutex, and the scheduler lock held */
+static void finish(struct scheduler *s, struct mState *ms){
+        if(ms->schedState == SCHED_ACTIVE)
+                s->active--;
+        ms->schedState = SCHED_DONE;
+        ms->sched = NULL;
+        ms->running = 0;
+        pthread_cond_broadcast(&s->changed);
+}
+
+static void unpark(struct scheduler *s, struct mState *ms){
+        struct mState **p = &s->parked;
+        while(*p != ms)
+                p = &(*p)->schedNext;
+        *p = ms->schedNext;
+}
+
+/* Runs the chip for a slice of frames, stopping early if it starts
+ * waiting for a key */
+static void run_slice(struct scheduler *s, struct mState *ms){
+        for(uint32_t i = 0; i < s->slice && ms->running; i++){
+                if(chip8_run_frame(ms) != 0){
+                        ms->running = 0;
+                        break;
+                }
+                if(ms->waitingForKey)
+                        break;
+        }
+        atomic_fetch_add(&s->slices, 1);
+}
+
+/* Puts the chip back on the worker's queue after its slice, unless it
+ * stopped, or is still waiting for a key */
+static void reschedule(struct sched_worker *w, struct mState *ms){
+        struct scheduler *s = w->s;
+        int requeue = 0;
+        if(ms->running && !ms->waitingForKey){
+                enqueue(s, &w->queue, ms);
+                return;
+        }
+        pthread_mutex_lock(&ms->keyMutex);
+        pthread_mutex_lock(&s->lock);
+        if(!ms->running){
+                finish(s, ms);
+        }else if(ms->lastEvent.type != Pressed){
+                ms->schedState = SCHED_PARKED;
+                ms->schedNext = s->parked;
+                s->parked = ms;
+                s->active--;
+                atomic_fetch_add(&s->parks, 1);
+                pthread_cond_broadcast(&s->changed);
+        }else{
+                /* The key arrived during the slice */
+                requeue = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_unlock(&ms->keyMutex);
+        if(requeue)
+                enqueue(s, &w->queue, ms);
+}
+
+static void *worker(void *data){
+        struct sched_worker *w = (struct sched_worker *) data;
+        struct scheduler *s = w->s;
+        while(atomic_load(&s->running)){
+                struct mState *ms = take(w);
+                if(ms != NULL){
+                        run_slice(s, ms);
+                        reschedule(w, ms);
+                        continue;
+                }
+                pthread_mutex_lock(&s->lock);
+                atomic_fetch_add(&s->idle, 1);
+                while(atomic_load(&s->running) && atomic_load(&s->queued) == 0)
+                        pthread_cond_wait(&s->work, &s->lock);
+                atomic_fetch_sub(&s->idle, 1);
+                pthread_mutex_unlock(&s->lock);
+        }
+        pthread_exit(NULL);
+}
+
+/* Stops, and joins the first started workers */
+static void stop_workers(struct scheduler *s, size_t started){
+        atomic_store(&s->running, 0);
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_broadcast(&s->work);
+        pthread_mutex_unlock(&s->lock);
+        for(size_t i = 0; i < started; i++)
+                pthread_join(s->workers[i].thread, NULL);
+}
+
+/* Starts a pool of workers, one per online CPU if workers is 0. Every
+ * chip runs for slice frames at a time, SCHED_DEFAULT_SLICE if 0 */
+struct scheduler *sched_init(size_t workers, uint32_t slice){
+        if(workers == 0){
+                long n = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = (n > 0) ? n : 1;
+        }
+        if(slice == 0)
+                slice = SCHED_DEFAULT_SLICE;
+
+        struct scheduler *s = calloc(1, sizeof(struct scheduler));
+        if(s == NULL) return NULL;
+        s->workers = calloc(workers, sizeof(struct sched_worker));
+        if(s->workers == NULL) goto workersFail;
+        s->workerCount = workers;
+        s->slice = slice;
+        s->active = 0;
+        s->parked = NULL;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->work, NULL);
+        pthread_cond_init(&s->changed, NULL);
+        atomic_init(&s->running, 1);
+        atomic_init(&s->queued, 0);
+        atomic_init(&s->idle, 0);
+        atomic_init(&s->nextQueue, 0);
+        atomic_init(&s->slices, 0);
+        atomic_init(&s->steals, 0);
+        atomic_init(&s->parks, 0);
+
+        for(size_t i = 0; i < workers; i++){
+                struct sched_worker *w = &s->workers[i];
+                w->s = s;
+                w->id = i;
+                w->rngState = 0x9E3779B9 ^ (i * 0x85EBCA6B);
+                w->queue.head = NULL;
+                w->queue.tail = NULL;
+                pthread_mutex_init(&w->queue.lock, NULL);
+        }
+        size_t started;
+        for(started = 0; started < workers; started++){
+                if(pthread_create(&s->workers[started].thread, NULL, worker, &s->workers[started]) != 0)
+                        goto threadFail;
+        }
+        return s;
+threadFail:
+        stop_workers(s, started);
+        for(size_t i = 0; i < workers; i++)
+                pthread_mutex_destroy(&s->workers[i].queue.lock);
+        pthread_cond_destroy(&s->changed);
+        pthread_cond_destroy(&s->work);
+        pthread_mutex_destroy(&s->lock);
+        free(s->workers);
+workersFail:
+        free(s);
+        return NULL;
+}
+
+/* Stops the workers. Chips still scheduled are taken off the scheduler,
+ * and left as they were at the end of their last slice */
+void sched_destroy(struct scheduler **s){
+        if(*s == NULL) return;
+        struct scheduler *sc = *s;
+        stop_workers(sc, sc->workerCount);
+
+        for(size_t i = 0; i < sc->workerCount; i++){
+                struct mState *ms;
+                while((ms = queue_pop(&sc->workers[i].queue)) != NULL){
+                        pthread_mutex_lock(&ms->keyMutex);
+                        pthread_mutex_lock(&sc->lock);
+                        finish(sc, ms);
+                        pthread_mutex_unlock(&sc->lock);
+                        pthread_mutex_unlock(&ms->keyMutex);
+                }
+                pthread_mutex_destroy(&sc->workers[i].queue.lock);
+        }
+        while(sc->parked != NULL){
+                struct mState *ms = sc->parked;
+                sc->parked = ms->schedNext;
+                pthread_mutex_lock(&ms->keyMutex);
+                pthread_mutex_lock(&sc->lock);
+                finish(sc, ms);
+                pthread_mutex_unlock(&sc->lock);
+                pthread_mutex_unlock(&ms->keyMutex);
+        }
+
+        pthread_cond_destroy(&sc->changed);
+        pthread_cond_destroy(&sc->work);
+        pthread_mutex_destroy(&sc->lock);
+        free(sc->workers);
+        free(sc);
+        *s = NULL;
+}
+
+/* Schedules a chip that is not already running. It stays scheduled until
+ * it is removed, or its PC leaves memory */
+struct runtime_error *sched_add(struct scheduler *s, struct mState *ms){
+        if(ms->running)
+                return runtime_error_init("Only a stopped chip can be scheduled");
+        if(ms->insPerFrame == 0)
+                ms->insPerFrame = CHIP8_DEFAULT_IPF;
+        decode_invalidate_all(ms);
+
+        pthread_mutex_lock(&ms->keyMutex);
+        pthread_mutex_lock(&s->lock);
+        ms->sched = s;
+        ms->running = 1;
+        ms->schedState = SCHED_ACTIVE;
+        s->active++;
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_unlock(&ms->keyMutex);
+
+        enqueue(s, next_queue(s), ms);
+        return NULL;
+}
+
+/* Takes a chip off the scheduler, waiting for its current slice to end if
+ * it is running. Does nothing if the chip has already stopped */
+void sched_remove(struct scheduler *s, struct mState *ms){
+        pthread_mutex_lock(&ms->keyMutex);
+        pthread_mutex_lock(&s->lock);
+        ms->running = 0;
+        if(ms->schedState == SCHED_PARKED){
+                unpark(s, ms);
+                finish(s, ms);
+        }
+        pthread_mutex_unlock(&ms->keyMutex);
+        while(ms->schedState != SCHED_DONE)
+                pthread_cond_wait(&s->changed, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Waits until every scheduled chip is either parked, or stopped */
+void sched_wait_idle(struct scheduler *s){
+        pthread_mutex_lock(&s->lock);
+        while(s->active != 0)
+                pthread_cond_wait(&s->changed, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Puts a parked chip back on a run queue. Called by chip8_key_event_notify
+ * with the chip's key mutex held */
+void sched_wake(struct mState *ms){
+        struct scheduler *s = ms->sched;
+        int wake = 0;
+        if(s == NULL) return;
+        pthread_mutex_lock(&s->lock);
+        if(ms->schedState == SCHED_PARKED){
+                unpark(s, ms);
+                ms->schedState = SCHED_ACTIVE;
+                s->active++;
+                wake = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+        if(wake)
+                enqueue(s, next_queue(s), ms);
+}
@@ -0,0 +1,106 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_SCHED_H
+#define _SRC_SCHED_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "runtime_error.h"
+
+/* Multiplexes any number of chips onto a fixed pool of worker threads.
+ * Every worker owns a run queue, it takes the chip at the front, runs it
+ * for a slice of frames on the virtual clock, and puts it on the back. A
+ * worker with an empty queue steals from the others, and sleeps when there
+ * is nothing to steal. A chip waiting for a key in FX0A is parked off the
+ * queues until chip8_key_event_notify wakes it.
+ *
+ * Scheduled chips run on the virtual clock as fast as the workers allow,
+ * like chip8_run_headless, so a parked chip's timers stop until it wakes.
+ * They are stopped with sched_remove rather than chip8_halt.
+ */
+
+/* Frames a chip runs before going back on a queue */
+#define SCHED_DEFAULT_SLICE 4
+
+enum sched_state {
+        /* Not scheduled, or removed */
+        SCHED_DONE = 0,
+        /* On a run queue, or running on a worker */
+        SCHED_ACTIVE,
+        /* Waiting for a key press */
+        SCHED_PARKED
+};
+
+struct mState;
+struct scheduler;
+
+struct sched_queue {
+        pthread_mutex_t lock;
+        /* Linked through mState's schedNext */
+        struct mState *head;
+        struct mState *tail;
+};
+
+struct sched_worker {
+        struct scheduler *s;
+        struct sched_queue queue;
+        pthread_t thread;
+        size_t id;
+        /* Picks the first queue to steal from */
+        uint32_t rngState;
+};
+
+struct scheduler {
+        struct sched_worker *workers;
+        size_t workerCount;
+        uint32_t slice;
+
+        /* Protects everything below, and the schedState of every chip */
+        pthread_mutex_t lock;
+        /* Signalled when chips are queued while workers sleep */
+        pthread_cond_t work;
+        /* Broadcast when a chip parks, or is done */
+        pthread_cond_t changed;
+        /* Chips that are neither parked nor done */
+        size_t active;
+        /* Parked chips, linked through schedNext */
+        struct mState *parked;
+
+        /* Cleared to stop the workers */
+        atomic_bool running;
+
+        /* Chips on the run queues, and workers asleep waiting for them */
+        atomic_size_t queued;
+        atomic_size_t idle;
+        atomic_size_t nextQueue;
+
+        /* Statistics */
+        atomic_uint_fast64_t slices;
+        atomic_uint_fast64_t steals;
+        atomic_uint_fast64_t parks;
+};
+
+struct scheduler *sched_init(size_t workers, uint32_t slice);
+void sched_destroy(struct scheduler **s);
+struct runtime_error *sched_add(struct scheduler *s, struct mState *ms);
+void sched_remove(struct scheduler *s, struct mState *ms);
+void sched_wait_idle(struct scheduler *s);
+void sched_wake(struct mState *ms);
+
+#endif
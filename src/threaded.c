@@ -0,0 +1,128 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifdef CHIP8_THREADED_CORE
+#include <stdio.h>
+
+#include "chip8.h"
+#include "decode.h"
+#include "ops.h"
+#include "threaded.h"
+
+#ifndef __GNUC__
+#error "The threaded engine needs GCC's labels as values"
+#endif
+
+/* Executes from the predecoded cache. Every instruction ends by jumping
+ * straight to the code for the next one through a table of label
+ * addresses indexed by the entry's kind, so each instruction has its own
+ * indirect branch and there is no loop, or function call, in between.
+ * Control only comes back to the caller when n instructions have run, or
+ * the PC leaves memory. Returns the number of instructions executed */
+uint64_t threaded_run(struct mState *ms, uint64_t n){
+        static const void *dispatch[OP_COUNT] = {
+                [OP_DECODE] = &&decode,
+                [OP_INTERPRET] = &&interpret,
+                [OP_RETURN] = &&ret,
+                [OP_JUMP] = &&jump,
+                [OP_CALL] = &&call,
+                [OP_SKIP_EQ_IMM] = &&skip_eq_imm,
+                [OP_SKIP_NE_IMM] = &&skip_ne_imm,
+                [OP_SKIP_EQ] = &&skip_eq,
+                [OP_SKIP_NE] = &&skip_ne,
+                [OP_LOAD_IMM] = &&load_imm,
+                [OP_ADD_IMM] = &&add_imm,
+                [OP_MOVE] = &&move,
+                [OP_OR] = &&or,
+                [OP_AND] = &&and,
+                [OP_XOR] = &&xor,
+                [OP_ADD] = &&add,
+                [OP_SUB] = &&sub,
+                [OP_SHR] = &&shr,
+                [OP_SUBN] = &&subn,
+                [OP_SHL] = &&shl,
+                [OP_LOAD_I] = &&load_i,
+                [OP_JUMP_V0] = &&jump_v0,
+                [OP_SKIP_KEY] = &&skip_key,
+                [OP_SKIP_NOT_KEY] = &&skip_not_key,
+                [OP_GET_DELAY] = &&get_delay,
+                [OP_SET_DELAY] = &&set_delay,
+                [OP_SET_SOUND] = &&set_sound,
+                [OP_ADD_I] = &&add_i,
+                [OP_FONT] = &&font,
+                [OP_LOAD_REGS] = &&load_regs
+        };
+        struct decoded *d;
+        uint64_t left = n;
+
+/* Odd addresses, and addresses past the end of memory, are both caught by
+ * the one mask */
+#define NEXT() do { \
+        if(left == 0 || ((uint16_t) ms->pc & 0xF001)) \
+                goto out; \
+        left--; \
+        d = &ms->icache[ms->pc >> 1]; \
+        goto *dispatch[d->kind]; \
+} while(0)
+
+#define OP(label, fn) label: fn(ms, d); NEXT();
+
+        NEXT();
+decode:
+        decode_entry(ms, d);
+        goto *dispatch[d->kind];
+        OP(interpret, op_interpret)
+        OP(ret, op_return)
+        OP(jump, op_jump)
+        OP(call, op_call)
+        OP(skip_eq_imm, op_skip_eq_imm)
+        OP(skip_ne_imm, op_skip_ne_imm)
+        OP(skip_eq, op_skip_eq)
+        OP(skip_ne, op_skip_ne)
+        OP(load_imm, op_load_imm)
+        OP(add_imm, op_add_imm)
+        OP(move, op_move)
+        OP(or, op_or)
+        OP(and, op_and)
+        OP(xor, op_xor)
+        OP(add, op_add)
+        OP(sub, op_sub)
+        OP(shr, op_shr)
+        OP(subn, op_subn)
+        OP(shl, op_shl)
+        OP(load_i, op_load_i)
+        OP(jump_v0, op_jump_v0)
+        OP(skip_key, op_skip_key)
+        OP(skip_not_key, op_skip_not_key)
+        OP(get_delay, op_get_delay)
+        OP(set_delay, op_set_delay)
+        OP(set_sound, op_set_sound)
+        OP(add_i, op_add_i)
+        OP(font, op_font)
+        OP(load_regs, op_load_regs)
+out:
+        /* Instructions at odd addresses are not cached */
+        if(left != 0 && (ms->pc & 1) && ms->pc > 0 && ms->pc < 4095){
+                left--;
+                run_instruction(ms, ((uint16_t) ms->mem[ms->pc]) << 8 | ms->mem[ms->pc + 1]);
+                NEXT();
+        }
+#undef OP
+#undef NEXT
+        ms->count += n - left;
+        return n - left;
+}
+#endif
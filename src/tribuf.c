@@ -0,0 +1,69 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <string.h>
+
+#include "tribuf.h"
+
+void tribuf_init(struct tribuf *t){
+        memset(t->bufs, 0, sizeof(t->bufs));
+        memset(t->dirty, 0, sizeof(t->dirty));
+        memset(t->hires, 0, sizeof(t->hires));
+        memset(t->stale, 0, sizeof(t->stale));
+        t->back = 0;
+        t->middle = 1;
+        t->front = 2;
+}
+
+/* Copies the lines of disp the back buffer is missing into it, and makes
+ * it the newest display. lines are the lines that changed since the
+ * display published before, a change of mode must mark them all */
+void tribuf_publish(struct tribuf *t, uint64_t disp[TRIBUF_LINES][2], uint64_t lines, uint8_t hires){
+        for(int i = 0; i < 3; i++)
+                t->stale[i] |= lines;
+        uint64_t copy = t->stale[t->back];
+        while(copy != 0){
+                int y = __builtin_ctzll(copy);
+                t->bufs[t->back][y][0] = disp[y][0];
+                t->bufs[t->back][y][1] = disp[y][1];
+                copy &= copy - 1;
+        }
+        t->stale[t->back] = 0;
+        t->hires[t->back] = hires;
+
+        /* If the reader never took the display in the middle, its lines
+         * changed too as far as the reader knows. The reader only ever
+         * takes a fresh middle, so the writer never waits for it */
+        uint_fast8_t mid = atomic_load_explicit(&t->middle, memory_order_acquire);
+        do {
+                t->dirty[t->back] = lines;
+                if(mid & TRIBUF_FRESH)
+                        t->dirty[t->back] |= t->dirty[mid & TRIBUF_INDEX];
+        } while(!atomic_compare_exchange_weak_explicit(&t->middle, &mid,
+                                t->back | TRIBUF_FRESH, memory_order_acq_rel,
+                                memory_order_acquire));
+        t->back = mid & TRIBUF_INDEX;
+}
+
+/* Takes the newest display if there is one the reader has not seen.
+ * Returns 1 if the front buffer changed */
+int tribuf_acquire(struct tribuf *t){
+        if(!tribuf_fresh(t))
+                return 0;
+        t->front = atomic_exchange_explicit(&t->middle, t->front,
+                        memory_order_acq_rel) & TRIBUF_INDEX;
+        return 1;
+}
@@ -0,0 +1,85 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#ifndef _SRC_TRIBUF_H
+#define _SRC_TRIBUF_H
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* A wait free triple buffer handing complete displays from the execution
+ * thread to the render thread. The writer fills its back buffer and swaps
+ * it with the middle one, the reader swaps its front buffer with the middle
+ * one when the middle holds a newer display. Neither side ever waits, and
+ * the reader always gets the latest complete display.
+ *
+ * Each display comes with the lines that changed since the one before it.
+ * The writer only copies the lines its back buffer is missing, and the
+ * reader is told every line that changed since the display it took last,
+ * including those of displays it never saw.
+ *
+ * There must be only one writer, and one reader.
+ */
+
+/* Lines of two words in a display, see disp in struct mState */
+#define TRIBUF_LINES 64
+
+/* Set in middle when it holds a display the reader has not taken */
+#define TRIBUF_FRESH 0x4
+#define TRIBUF_INDEX 0x3
+
+struct tribuf {
+        uint64_t bufs[3][TRIBUF_LINES][2];
+        /* The lines of each buffer that changed since the display the
+         * reader took before it, and whether it is in the 128x64 mode.
+         * Written by the writer before the buffer is published */
+        uint64_t dirty[3];
+        uint8_t hires[3];
+        /* The lines each buffer is missing, only touched by the writer */
+        uint64_t stale[3];
+        /* Only touched by the writer */
+        uint8_t back;
+        /* Only touched by the reader */
+        uint8_t front;
+        /* The index of the buffer between them, and TRIBUF_FRESH */
+        atomic_uint_fast8_t middle;
+};
+
+void tribuf_init(struct tribuf *t);
+void tribuf_publish(struct tribuf *t, uint64_t disp[TRIBUF_LINES][2], uint64_t lines, uint8_t hires);
+int tribuf_acquire(struct tribuf *t);
+
+/* Whether there is a display the reader has not taken yet */
+static inline int tribuf_fresh(struct tribuf *t){
+        return (atomic_load_explicit(&t->middle, memory_order_acquire) & TRIBUF_FRESH) != 0;
+}
+
+/* The display the reader took last */
+static inline uint64_t (*tribuf_front(struct tribuf *t))[2]{
+        return t->bufs[t->front];
+}
+
+/* The lines of the front display that changed since the one taken before
+ * it */
+static inline uint64_t tribuf_front_dirty(struct tribuf *t){
+        return t->dirty[t->front];
+}
+
+/* Whether the front display is in the 128x64 mode */
+static inline uint8_t tribuf_front_hires(struct tribuf *t){
+        return t->hires[t->front];
+}
+
+#endif
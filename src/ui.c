@@ -12,15 +12,48 @@
  * chip-8 emulator core */
 static const char keycodes[] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
 
+/* The longest the render thread sleeps without an event, so a missed wake
+ * up can not stall it for good */
+#define RENDER_WAIT_TIMEOUT 0.5
+
 static void resize_callback(GLFWwindow* window, int width, int height);
+static void refresh_callback(GLFWwindow* window);
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
-static size_t chip8_disp_to_indices(uint8_t disp[32][8], unsigned int **indices);
 
 static void resize_callback(GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);
+    refresh_callback(window);
+}
+
+/* The window's contents were lost, or it was resized */
+static void refresh_callback(GLFWwindow* window){
+        struct ui *u = glfwGetWindowUserPointer(window);
+        if(u != NULL)
+                u->damaged = 1;
+}
+
+/* Wakes the render thread if it is waiting for events */
+static void wake_renderer(struct ui *u){
+        if(atomic_exchange(&u->waiting, 0))
+                glfwPostEmptyEvent();
+}
+
+/* Nothing drawn to a minimised, hidden, or zero sized window is seen */
+static int window_visible(GLFWwindow *win){
+        int width, height;
+        glfwGetFramebufferSize(win, &width, &height);
+        return !glfwGetWindowAttrib(win, GLFW_ICONIFIED) &&
+                glfwGetWindowAttrib(win, GLFW_VISIBLE) && width > 0 && height > 0;
 }
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods){
+        /* Fast forward while Tab is held */
+        if(key == GLFW_KEY_TAB && (action == GLFW_PRESS || action == GLFW_RELEASE)){
+                struct ui *u = glfwGetWindowUserPointer(window);
+                if(u != NULL)
+                        chip8_set_turbo(u->chip, (action == GLFW_PRESS) ? u->turbo : 1);
+                return;
+        }
         const char* key_name = glfwGetKeyName(key, scancode);
         if((action == GLFW_PRESS || action == GLFW_RELEASE) && key_name != NULL){
                 int i;
@@ -41,30 +74,6 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         }
 }
 
-static size_t chip8_disp_to_indices(uint8_t disp[32][8], unsigned int **indices){
-        if(*indices != NULL)
-                free(*indices);
-        *indices = calloc(32 * 64 * 6, sizeof(unsigned int));
-        size_t currentIndex = 0;
-        for(int y = 0; y < 32; y++){
-                for(int x = 0; x < 64; x++){
-                        uint8_t byte = disp[y][x/8];
-                        uint8_t state = byte >> (7 - (x % 8)) & 1;
-                        if(state){
-                                /* Tringale 1 */
-                                (*indices)[currentIndex++] = 65 * y + x;             // top left
-                                (*indices)[currentIndex++] = 65 * y + x + 1;         // top right
-                                (*indices)[currentIndex++] = 65 * (y + 1) + x;       // bottom left
-                                /* Triangle 2 */
-                                (*indices)[currentIndex++] = 65 * (y + 1) + x;       // bottom left
-                                (*indices)[currentIndex++] = 65 * (y + 1) + x + 1;   // bottom right
-                                (*indices)[currentIndex++] = 65 * y + x + 1;         // top right
-                        }
-
-                }
-        }
-        return currentIndex;
-}
 static void *ui_render(void *arg){
         struct ui *u = (struct ui *) arg;
         int *retVal = malloc(sizeof(int));
@@ -87,7 +96,10 @@ static void *ui_render(void *arg){
                 pthread_exit(retVal);
         }
         glfwMakeContextCurrent(win);
+        /* Swap at most once per vertical refresh */
+        glfwSwapInterval(1);
         glfwSetFramebufferSizeCallback(win, resize_callback);
+        glfwSetWindowRefreshCallback(win, refresh_callback);
         glfwSetKeyCallback(win, key_callback);
         glfwSetWindowUserPointer(win, u);
         glewExperimental = GL_TRUE;
@@ -104,62 +116,80 @@ static void *ui_render(void *arg){
                 pthread_exit(retVal);
         }
 
-        float points[4290];
-        /* calculate the ventices for a 64x32 pixel screen */
-        for(int y = 0; y < 33; y++){
-                for(int x = 0; x < 65; x ++){
-                        points[y * 130 + (x * 2)] = (-1.0f + x * 2.0f / 64.0f);
-                        points[y * 130 + (x * 2) + 1] = (0.5f - y * 2.0f / 64.0f);
-                }
-                
-        }
-        size_t indicesLen;
-        unsigned int *indices = NULL;
-        unsigned int EBO;
+        /* The display is a 2x64 texture, a texel for each word of a line
+         * holding its two 32 bit halves, the low half first as on little
+         * endian hosts. It is big enough for the 128x64 mode, so it is
+         * never allocated again, fs.glsl picks the bit for each pixel out
+         * of the part the mode uses */
+        unsigned int tex;
         unsigned int vao;
-        unsigned int vbo;
-        indicesLen = chip8_disp_to_indices(u->chip8Disp, &indices);
-
-        /* generate buffers and vertex arrays */
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        tribuf_acquire(&u->disp);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, 2, CHIP8_LINES, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, tribuf_front(&u->disp));
+
+        /* vs.glsl makes the quad's corners from gl_VertexID, but the core
+         * profile still needs a vertex array bound to draw */
         glGenVertexArrays(1, &vao);
-        glGenBuffers(1, &vbo);
-        glGenBuffers(1, &EBO);
-
-        glBindVertexArray(vao);
-
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(points), points, GL_STATIC_DRAW);
-
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * indicesLen, indices, GL_DYNAMIC_DRAW);
-
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
+        shader_use(s);
+        shader_set_int(s, "disp", 0);
         glfwSetInputMode(win, GLFW_STICKY_KEYS, GL_TRUE);
 
+        u->damaged = 1;
         do {
-                pthread_mutex_lock(&u->dispMutex);
-                if(u->newData){
-                        indicesLen = chip8_disp_to_indices(u->chip8Disp, &indices);
-                        u->newData = 0;
+                /* Sleep until the core publishes a display, or the window
+                 * needs drawing. The display is checked again after
+                 * waiting is set, so one published in between is not
+                 * missed */
+                if(!u->damaged && !tribuf_fresh(&u->disp)){
+                        atomic_store(&u->waiting, 1);
+                        if(!tribuf_fresh(&u->disp) && u->state)
+                                glfwWaitEventsTimeout(RENDER_WAIT_TIMEOUT);
+                        atomic_store(&u->waiting, 0);
                 }
-                pthread_mutex_unlock(&u->dispMutex);
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-                glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * indicesLen, indices, GL_DYNAMIC_DRAW);
-                
+                glfwPollEvents();
+                if(!window_visible(win)){
+                        /* Draw it when it comes back */
+                        u->damaged = 1;
+                        glfwWaitEventsTimeout(RENDER_WAIT_TIMEOUT);
+                        continue;
+                }
+
+                /* Only the lines of a new display that changed since the
+                 * last one are uploaded, and nothing is allocated */
+                int fresh = tribuf_acquire(&u->disp);
+                uint64_t lines = fresh ? tribuf_front_dirty(&u->disp) : 0;
+                if(lines != 0){
+                        int first = __builtin_ctzll(lines);
+                        int count = 64 - __builtin_clzll(lines) - first;
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, 2, count, GL_RG_INTEGER, GL_UNSIGNED_INT, tribuf_front(&u->disp) + first);
+                }
+                if(!fresh && !u->damaged)
+                        continue;
+                u->damaged = 0;
+
                 glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
                 glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
                 shader_use(s);
+                shader_set_bool(s, "hires", tribuf_front_hires(&u->disp));
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, tex);
                 glBindVertexArray(vao);
-                
-                glDrawElements(GL_TRIANGLES, indicesLen, GL_UNSIGNED_INT, 0);
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
                 glBindVertexArray(0);
 
+                /* Blocks until the next vertical refresh, displays
+                 * published meanwhile are picked up together */
                 glfwSwapBuffers(win);
-                glfwPollEvents();
-
         } while(u->state && !glfwWindowShouldClose(win));
+        glDeleteVertexArrays(1, &vao);
+        glDeleteTextures(1, &tex);
+        shader_delete(&s);
         glfwTerminate();
         *retVal = 0;
         pthread_mutex_lock(&u->stateMutex);
@@ -172,18 +202,18 @@ static void *ui_render(void *arg){
 struct ui *ui_init(void){
         struct ui *u = malloc(sizeof(struct ui));
         if(u == NULL) return NULL;
-        pthread_mutex_init(&u->dispMutex, NULL);
         pthread_mutex_init(&u->stateMutex, NULL);
         pthread_cond_init(&u->uiStateChange, NULL);
-        for(int i = 0; i < 32; i++)
-                for(int j = 0; j < 8; j++)
-                        u->chip8Disp[i][j] = 0x0;
+        tribuf_init(&u->disp);
+        u->published = 0;
+        u->turbo = CHIP8_DEFAULT_TURBO;
+        atomic_init(&u->waiting, 0);
+        u->damaged = 0;
         u->state = 0;
         return u;
 }
 
 void ui_destroy(struct ui **u){
-        pthread_mutex_destroy(&(*u)->dispMutex);
         pthread_mutex_destroy(&(*u)->stateMutex);
         pthread_cond_destroy(&(*u)->uiStateChange);
         if(*u != NULL){
@@ -192,13 +222,14 @@ void ui_destroy(struct ui **u){
         }
 }
 
-int ui_set_chip8_display(struct ui *u, uint8_t chip8Disp[32][8]){
-        pthread_mutex_lock(&u->dispMutex);
-        for(int i = 0; i < 32; i++)
-                for(int j = 0; j < 8; j++)
-                        u->chip8Disp[i][j] = chip8Disp[i][j];
-        u->newData = 1;
-        pthread_mutex_unlock(&u->dispMutex);
+/* Hands a complete display to the render thread, never blocks. Only the
+ * lines set in lines may differ from the display handed over before, and
+ * hires is the mode it is in, a change of mode marks every line. The
+ * core calls it at most once a frame, see flush_display */
+int ui_set_chip8_display(struct ui *u, uint64_t chip8Disp[TRIBUF_LINES][2], uint64_t lines, uint8_t hires){
+        tribuf_publish(&u->disp, chip8Disp, lines, hires);
+        u->published++;
+        wake_renderer(u);
         return u->state;
 }
 
@@ -215,6 +246,7 @@ void ui_halt(struct ui *u){
         /* request that UI stops. The UI thread will do a pthread_cond_broadcast
          * when it actually stops */
         u->state = STATE_HALTED;
+        wake_renderer(u);
         /* Wait for the thread to stop */
         pthread_join(u->tid, (void **) &retVal);
 
@@ -1,21 +1,31 @@
 #ifndef _SRC_UI_H
 #define _SRC_UI_H
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "chip8.h"
 #include "state.h"
+#include "tribuf.h"
 
 struct ui {
         /* chip8 emulator core */
         struct mState *chip;
 
-        uint8_t chip8Disp[32][8];
-        uint8_t newData;
+        /* Displays from the execution thread, see tribuf.h */
+        struct tribuf disp;
+        /* Displays handed over, only touched by the execution thread */
+        uint64_t published;
+        /* Fast forward factor while the turbo key, Tab, is held */
+        uint32_t turbo;
+        /* Set while the render thread waits for events, whoever clears it
+         * wakes the render thread */
+        atomic_bool waiting;
+        /* Set by the window callbacks when the window must be drawn again */
+        uint8_t damaged;
         enum running_state state;
 
         /* threading variables */
-        pthread_mutex_t dispMutex;
         pthread_t tid;
 
         
@@ -26,7 +36,7 @@ struct ui {
 
 struct ui *ui_init(void);
 void ui_destroy(struct ui **u);
-int ui_set_chip8_display(struct ui *u, uint8_t chip8Disp[32][8]);
+int ui_set_chip8_display(struct ui *u, uint64_t chip8Disp[TRIBUF_LINES][2], uint64_t lines, uint8_t hires);
 void ui_run(struct ui *u);
 void ui_halt(struct ui *u);
 
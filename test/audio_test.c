@@ -0,0 +1,185 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_test.h"
+
+#include "../src/audio.h"
+#include "../src/chip8.h"
+
+static char dir[] = "/tmp/chip8_audioXXXXXX";
+static char path[sizeof(dir) + 32];
+
+void audio_setup(void){
+        strcpy(dir, "/tmp/chip8_audioXXXXXX");
+        ck_assert_ptr_nonnull(mkdtemp(dir));
+        snprintf(path, sizeof(path), "%s/a.wav", dir);
+}
+
+void audio_teardown(void){
+        unlink(path);
+        rmdir(dir);
+}
+
+static uint32_t get32(const uint8_t *p){
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* FX18 part way through the second frame sounds the tone from its own
+ * sample until the timer runs out on a tick */
+START_TEST(test_audio_wav_tone){
+        static uint8_t buf[65536];
+        struct mState *ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        struct audio *a = audio_init(&audio_wav, path, 0, 0);
+        ck_assert_ptr_nonnull(a);
+        chip8_set_audio(ms, a);
+
+        ms->mem[0x200] = 0x60;
+        ms->mem[0x201] = 0x06;
+        for(int i = 1; i < 13; i++){
+                ms->mem[0x200 + 2 * i] = 0x71;
+                ms->mem[0x201 + 2 * i] = 0x01;
+        }
+        /* Instruction 13, 3 into the second frame of 10 */
+        ms->mem[0x21A] = 0xF0;
+        ms->mem[0x21B] = 0x18;
+        ms->mem[0x21C] = 0x12;
+        ms->mem[0x21D] = 0x1C;
+        chip8_run_headless(ms, 0, 10);
+        chip8_set_audio(ms, NULL);
+        audio_stop(a);
+        ck_assert_uint_eq(atomic_load(&a->samples), 10 * 735);
+        ck_assert_uint_eq(atomic_load(&a->written), 10 * 735);
+        ck_assert_uint_eq(atomic_load(&a->dropped), 0);
+        ck_assert(!atomic_load(&a->failed));
+        audio_destroy(&a);
+        ck_assert_ptr_null(a);
+        chip8_destroy(&ms);
+
+        FILE *fp = fopen(path, "rb");
+        ck_assert_ptr_nonnull(fp);
+        size_t len = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        ck_assert_uint_eq(len, 44 + 10 * 735 * 2);
+        ck_assert_mem_eq(buf, "RIFF", 4);
+        ck_assert_uint_eq(get32(buf + 4), 36 + 10 * 735 * 2);
+        ck_assert_mem_eq(buf + 8, "WAVEfmt ", 8);
+        ck_assert_uint_eq(get32(buf + 24), 44100);
+        ck_assert_mem_eq(buf + 36, "data", 4);
+        ck_assert_uint_eq(get32(buf + 40), 10 * 735 * 2);
+
+#if defined(CHIP8_THREADED_CORE) && !defined(CHIP8_PROFILE)
+        /* The threaded engine counts a batch at a time, the edge is its
+         * start. Profiling builds step one at a time with every engine */
+        int start = 735;
+#else
+        int start = 735 + 3 * 44100 / 600;
+#endif
+        int16_t *samples = (int16_t *) (buf + 44);
+        for(int i = 0; i < 10 * 735; i++){
+                if(i < start || i >= 7 * 735)
+                        ck_assert_int_eq(samples[i], 0);
+                else
+                        ck_assert_int_ne(samples[i], 0);
+        }
+        ck_assert_int_eq(samples[start], AUDIO_VOLUME);
+}
+END_TEST
+
+/* Free running the timer thread adds a tick of samples for every tick */
+START_TEST(test_audio_wall_clock){
+        struct mState *ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        ms->insPerFrame = 0;
+        struct audio *a = audio_init(&audio_null, NULL, 0, 0);
+        ck_assert_ptr_nonnull(a);
+        chip8_set_audio(ms, a);
+        ms->registers[0] = 0x10;
+        ms->mem[0x200] = 0xF0;
+        ms->mem[0x201] = 0x18;
+        ms->mem[0x202] = 0x12;
+        ms->mem[0x203] = 0x02;
+
+        chip8_run(ms);
+        struct timespec ts = {0, 500000000L};
+        nanosleep(&ts, NULL);
+        chip8_halt(ms);
+        ck_assert_uint_eq(atomic_load(&a->samples), atomic_load(&ms->ticks) * 735);
+        ck_assert_uint_eq(ms->sTimer, 0);
+        chip8_set_audio(ms, NULL);
+        audio_destroy(&a);
+        chip8_destroy(&ms);
+}
+END_TEST
+
+/* Adding samples never waits, what the ring has no room for is dropped */
+START_TEST(test_audio_drops_when_full){
+        struct audio *a = audio_init(&audio_wav, path, 0, 1000);
+        ck_assert_ptr_nonnull(a);
+        ck_assert_uint_eq(a->ringLen, 1024);
+        audio_render(a, 100000, 1);
+        ck_assert_uint_eq(atomic_load(&a->samples), 100000);
+        ck_assert_uint_ge(atomic_load(&a->dropped), 100000 - 1024);
+        audio_stop(a);
+        ck_assert_uint_eq(atomic_load(&a->written) + atomic_load(&a->dropped), 100000);
+        audio_destroy(&a);
+}
+END_TEST
+
+/* A real time backend left without samples is fed silence, and counts it */
+START_TEST(test_audio_underruns){
+        struct audio *a = audio_init(&audio_null, NULL, 0, 0);
+        ck_assert_ptr_nonnull(a);
+        audio_render(a, 4 * 735, 1);
+        struct timespec ts = {0, 300000000L};
+        nanosleep(&ts, NULL);
+        ck_assert_uint_eq(atomic_load(&a->written) >= 4 * 735, 1);
+        ck_assert_uint_ge(atomic_load(&a->underruns), 1);
+        ck_assert_uint_eq(atomic_load(&a->dropped), 0);
+        audio_destroy(&a);
+}
+END_TEST
+
+START_TEST(test_audio_rejects_bad_path){
+        snprintf(path, sizeof(path), "%s/missing/a.wav", dir);
+        ck_assert_ptr_null(audio_init(&audio_wav, path, 0, 0));
+        snprintf(path, sizeof(path), "%s/a.wav", dir);
+}
+END_TEST
+
+Suite *audio_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("audio");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_audio_wav_tone);
+        tcase_add_test(tc, test_audio_wall_clock);
+        tcase_add_test(tc, test_audio_drops_when_full);
+        tcase_add_test(tc, test_audio_underruns);
+        tcase_add_test(tc, test_audio_rejects_bad_path);
+        tcase_add_checked_fixture(tc, audio_setup, audio_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
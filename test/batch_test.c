@@ -0,0 +1,296 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_test.h"
+
+#include "../src/batch.h"
+#include "../src/chip8.h"
+
+/* Not a multiple of the lane width, so the last vector is part padding */
+#define LANES 45
+
+static struct batch *b;
+static struct mState *ref[LANES];
+
+void batch_setup(void){
+        b = batch_init(LANES);
+        ck_assert_ptr_nonnull(b);
+        for(int l = 0; l < LANES; l++){
+                ref[l] = chip8_init_headless();
+                ck_assert_ptr_nonnull(ref[l]);
+        }
+}
+
+void batch_teardown(void){
+        batch_destroy(&b);
+        for(int l = 0; l < LANES; l++)
+                chip8_destroy(&ref[l]);
+}
+
+/* Gives every lane, and its reference chip the same program, and seed */
+static void load(const uint8_t *prog, size_t len){
+        for(int l = 0; l < LANES; l++){
+                memcpy(b->chips[l]->mem + 0x200, prog, len);
+                memcpy(ref[l]->mem + 0x200, prog, len);
+                /* Groups of three lanes stay together until CXNN splits
+                 * them */
+                chip8_seed(b->chips[l], l / 3 + 1);
+                chip8_seed(ref[l], l / 3 + 1);
+        }
+}
+
+static void assert_lanes_match(void){
+        batch_sync(b);
+        for(int l = 0; l < LANES; l++){
+                struct mState *a = b->chips[l];
+                struct mState *r = ref[l];
+                ck_assert_msg(memcmp(a->registers, r->registers, sizeof(a->registers)) == 0, "registers differ in lane %d", l);
+                ck_assert_msg(a->pc == r->pc, "pc differs in lane %d", l);
+                ck_assert_msg(a->iRegister == r->iRegister, "I differs in lane %d", l);
+                ck_assert_msg(a->dTimer == r->dTimer, "delay timer differs in lane %d", l);
+                ck_assert_msg(a->sTimer == r->sTimer, "sound timer differs in lane %d", l);
+                ck_assert_msg(a->count == r->count, "count differs in lane %d", l);
+                ck_assert_msg(memcmp(a->mem, r->mem, sizeof(a->mem)) == 0, "memory differs in lane %d", l);
+                ck_assert_msg(memcmp(a->disp, r->disp, sizeof(a->disp)) == 0, "display differs in lane %d", l);
+        }
+}
+
+/* A random program of everything but calls, BNNN, key skips, and FX1E,
+ * which test_batch_grouped_ops covers.
+ * ANNN keeps I away from the program, and FX55, FX65 only move it a
+ * little, so it stays in memory for a short run */
+static void random_program(uint8_t *prog, size_t len){
+        static const uint16_t templates[] = {
+                0x1000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000,
+                0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007,
+                0x800E, 0x9000, 0xA000, 0xC000, 0xD000, 0xF007, 0xF015,
+                0xF018, 0xF029, 0xF033, 0xF055, 0xF065, 0xF00A
+        };
+        for(size_t i = 0; i + 1 < len; i += 2){
+                uint16_t t = templates[rand() % (sizeof(templates) / sizeof(templates[0]))];
+                uint16_t ins = t;
+                switch(t >> 12){
+                        case 0x1:
+                                ins |= 0x200 + (rand() % (len / 2 - 2)) * 2;
+                                break;
+                        case 0xA:
+                                ins |= 0x600 + (rand() % 0x300);
+                                break;
+                        case 0x3: case 0x4: case 0x6: case 0x7: case 0xC: case 0xD:
+                                ins |= rand() & 0xFFF;
+                                break;
+                        case 0x5: case 0x8: case 0x9:
+                                ins |= rand() & 0xFF0;
+                                break;
+                        default:
+                                if((t & 0xFF) == 0x55 || (t & 0xFF) == 0x65)
+                                        ins |= (rand() & 0x1) << 8;
+                                else
+                                        ins |= rand() & 0xF00;
+                                break;
+                }
+                prog[i] = ins >> 8;
+                prog[i + 1] = ins & 0xFF;
+        }
+        /* Loop back to the start at the end, twice in case the last
+         * instruction skips */
+        for(size_t i = len - 4; i < len; i += 2){
+                prog[i] = 0x12;
+                prog[i + 1] = 0x00;
+        }
+}
+
+/* Every lane must end up exactly where the same chip run on its own does */
+START_TEST(test_batch_matches_chips){
+        uint8_t prog[0x200];
+        for(int n = 0; n < 10; n++){
+                random_program(prog, sizeof(prog));
+                for(int l = 0; l < LANES; l++){
+                        chip8_destroy(&b->chips[l]);
+                        b->chips[l] = chip8_init_headless();
+                        chip8_destroy(&ref[l]);
+                        ref[l] = chip8_init_headless();
+                        for(int x = 0; x < 16; x++)
+                                b->chips[l]->registers[x] = ref[l]->registers[x] = rand();
+                        b->chips[l]->dTimer = ref[l]->dTimer = rand();
+                        b->chips[l]->iRegister = ref[l]->iRegister = 0x600;
+                }
+                load(prog, sizeof(prog));
+                batch_reset(b);
+                uint64_t total = batch_run(b, 50);
+                uint64_t expected = 0;
+                for(int l = 0; l < LANES; l++)
+                        expected += chip8_run_headless(ref[l], 0, 50);
+                ck_assert_uint_eq(total, expected);
+                assert_lanes_match();
+        }
+}
+END_TEST
+
+/* A lane that rewrites its own code runs the new instruction, the others
+ * keep running the original */
+START_TEST(test_batch_self_modifying){
+        static const uint8_t prog[] = {
+                0xA2, 0x0C,     /* I = 0x20C */
+                0x31, 0x01,     /* skip if V1 == 1 */
+                0x12, 0x0A,     /* jump 0x20A */
+                0x60, 0x70,     /* V0 = 0x70 */
+                0xF0, 0x55,     /* 0x20C = 0x70, so 0x20C is V0 += 0x22 */
+                0x62, 0x01,     /* V2 = 1 */
+                0x60, 0x22,     /* V0 = 0x22 */
+                0x12, 0x0E      /* loop */
+        };
+        load(prog, sizeof(prog));
+        for(int l = 0; l < LANES; l++)
+                b->chips[l]->registers[0x1] = ref[l]->registers[0x1] = l & 1;
+        batch_reset(b);
+        batch_run(b, 2);
+        for(int l = 0; l < LANES; l++)
+                chip8_run_headless(ref[l], 0, 2);
+        assert_lanes_match();
+        for(int l = 0; l < LANES; l++)
+                ck_assert_uint_eq(b->chips[l]->registers[0x0], (l & 1) ? 0x92 : 0x22);
+}
+END_TEST
+
+/* Lanes whose PC leaves memory stop, and are not counted, the rest carry on */
+START_TEST(test_batch_stopped_lanes){
+        static const uint8_t prog[] = {
+                0x71, 0x01,     /* V1 += 1 */
+                0x30, 0x01,     /* skip if V0 == 1 */
+                0x12, 0x00,     /* jump 0x200 */
+                0x1F, 0xFF      /* jump 0xFFF */
+        };
+        load(prog, sizeof(prog));
+        for(int l = 0; l < LANES; l++)
+                b->chips[l]->registers[0x0] = ref[l]->registers[0x0] = (l % 5 == 0);
+        batch_reset(b);
+        uint64_t total = batch_run(b, 10);
+        uint64_t expected = 0;
+        for(int l = 0; l < LANES; l++)
+                expected += chip8_run_headless(ref[l], 0, 10);
+        ck_assert_uint_eq(total, expected);
+        assert_lanes_match();
+        ck_assert_uint_eq(b->chips[0]->pc, 0xFFF);
+        ck_assert_uint_eq(b->chips[0]->count, 3);
+        ck_assert_uint_eq(b->chips[1]->count, 10 * CHIP8_DEFAULT_IPF);
+}
+END_TEST
+
+/* Calls, returns, key skips, and the FX ops that move I run a group at a
+ * time, with no lane falling back to run_instruction */
+START_TEST(test_batch_grouped_ops){
+        static const uint8_t prog[] = {
+                0x80, 0x30,     /* V0 = V3 */
+                0x81, 0x50,     /* V1 = V5 */
+                0xA6, 0x00,     /* I = 0x600 */
+                0xF1, 0x1E,     /* I += V1 */
+                0xE0, 0x9E,     /* skip if key V0 is pressed */
+                0x22, 0x14,     /* call 0x214 */
+                0xE0, 0xA1,     /* skip if key V0 is not pressed */
+                0xF1, 0x29,     /* I = sprite V1 */
+                0xF2, 0x65,     /* V0 to V2 = memory at I */
+                0x12, 0x00,     /* loop */
+                0x74, 0x01,     /* V4 += 1 */
+                0x00, 0xEE      /* return */
+        };
+        load(prog, sizeof(prog));
+        for(int l = 0; l < LANES; l++){
+                b->chips[l]->registers[0x3] = ref[l]->registers[0x3] = l % 16;
+                b->chips[l]->registers[0x5] = ref[l]->registers[0x5] = l;
+                b->chips[l]->keys[l % 16] = ref[l]->keys[l % 16] = (l & 2) != 0;
+                b->chips[l]->mem[0x600 + l] = ref[l]->mem[0x600 + l] = l * 3;
+        }
+        batch_reset(b);
+        uint64_t total = batch_run(b, 20);
+        uint64_t expected = 0;
+        for(int l = 0; l < LANES; l++)
+                expected += chip8_run_headless(ref[l], 0, 20);
+        ck_assert_uint_eq(total, expected);
+        ck_assert_uint_eq(b->scalarSteps, 0);
+        assert_lanes_match();
+        ck_assert_uint_ne(b->chips[0]->registers[0x4], 0);
+        ck_assert_uint_eq(b->chips[2]->registers[0x4], 0);
+}
+END_TEST
+
+/* Lanes that are all at the same PC run together */
+START_TEST(test_batch_lockstep){
+        static const uint8_t prog[] = {
+                0x70, 0x01,     /* V0 += 1 */
+                0x81, 0x04,     /* V1 += V0 */
+                0x12, 0x00      /* loop */
+        };
+        load(prog, sizeof(prog));
+        batch_reset(b);
+        ck_assert_uint_eq(batch_run(b, 30), LANES * 30 * CHIP8_DEFAULT_IPF);
+        ck_assert_uint_eq(b->scalarSteps, 0);
+        ck_assert_uint_eq(b->simdGroups, 30 * CHIP8_DEFAULT_IPF);
+        for(int l = 0; l < LANES; l++)
+                chip8_run_headless(ref[l], 0, 30);
+        assert_lanes_match();
+}
+END_TEST
+
+/* FX75 and FX85 move the registers to, and from the flags of their own
+ * lane's chip, with every register up to VX carried across */
+START_TEST(test_batch_flags){
+        static const uint8_t prog[] = {
+                0xF3, 0x75,     /* flags = V0 to V3 */
+                0x60, 0x00,     /* V0 = 0 */
+                0x61, 0x00,     /* V1 = 0 */
+                0x62, 0x00,     /* V2 = 0 */
+                0x63, 0x00,     /* V3 = 0 */
+                0xF3, 0x85,     /* V0 to V3 = flags */
+                0x12, 0x0C      /* stop */
+        };
+        load(prog, sizeof(prog));
+        for(int l = 0; l < LANES; l++)
+                for(int x = 0; x < 4; x++)
+                        b->chips[l]->registers[x] = ref[l]->registers[x] = l + x + 1;
+        batch_reset(b);
+        batch_run(b, 1);
+        for(int l = 0; l < LANES; l++)
+                chip8_run_headless(ref[l], 0, 1);
+        assert_lanes_match();
+        for(int l = 0; l < LANES; l++)
+                for(int x = 0; x < 4; x++)
+                        ck_assert_uint_eq(b->chips[l]->registers[x], l + x + 1);
+}
+END_TEST
+
+Suite *batch_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("batch");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_batch_matches_chips);
+        tcase_add_test(tc, test_batch_self_modifying);
+        tcase_add_test(tc, test_batch_stopped_lanes);
+        tcase_add_test(tc, test_batch_grouped_ops);
+        tcase_add_test(tc, test_batch_lockstep);
+        tcase_add_test(tc, test_batch_flags);
+        tcase_add_checked_fixture(tc, batch_setup, batch_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
@@ -0,0 +1,225 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture_test.h"
+
+#include "../src/capture.h"
+#include "../src/chip8.h"
+
+static char dir[] = "/tmp/chip8_captureXXXXXX";
+static char path[sizeof(dir) + 32];
+
+void capture_setup(void){
+        strcpy(dir, "/tmp/chip8_captureXXXXXX");
+        ck_assert_ptr_nonnull(mkdtemp(dir));
+}
+
+void capture_teardown(void){
+        rmdir(dir);
+}
+
+/* Reads all of file into buf, returning its size */
+static size_t slurp(char *file, uint8_t *buf, size_t size){
+        FILE *fp = fopen(file, "rb");
+        ck_assert_ptr_nonnull(fp);
+        size_t len = fread(buf, 1, size, fp);
+        fclose(fp);
+        unlink(file);
+        return len;
+}
+
+START_TEST(test_capture_ppm){
+        static uint8_t buf[65536];
+        uint64_t disp[64][2] = {{0}};
+        disp[0][0] = 1ULL << 63;
+        disp[31][0] = 1;
+        snprintf(path, sizeof(path), "%s/f", dir);
+        struct capture *c = capture_init(CAPTURE_PPM, path, 2, 4);
+        ck_assert_ptr_nonnull(c);
+        capture_frame(c, disp, 1u | 1u << 31, 0);
+        disp[0][0] = 0;
+        capture_frame(c, disp, 1u, 0);
+        capture_stop(c);
+        ck_assert_uint_eq(c->frames, 2);
+        ck_assert_uint_eq(c->written, 2);
+        ck_assert_uint_eq(c->dropped, 0);
+        capture_destroy(&c);
+        ck_assert_ptr_null(c);
+
+        const char *header = "P6\n128 64\n255\n";
+        size_t h = strlen(header);
+        snprintf(path, sizeof(path), "%s/f000000.ppm", dir);
+        ck_assert_uint_eq(slurp(path, buf, sizeof(buf)), h + 128 * 64 * 3);
+        ck_assert_mem_eq(buf, header, h);
+        /* The top left pixel covers 2x2 image pixels */
+        for(int y = 0; y < 2; y++)
+                for(int x = 0; x < 2; x++)
+                        ck_assert_uint_eq(buf[h + (y * 128 + x) * 3], 0xFF);
+        ck_assert_uint_eq(buf[h + 2 * 3], 0x00);
+        ck_assert_uint_eq(buf[h + 2 * 128 * 3], 0x00);
+        ck_assert_uint_eq(buf[h + (63 * 128 + 127) * 3 + 2], 0xFF);
+        ck_assert_uint_eq(buf[h + (61 * 128 + 127) * 3 + 2], 0x00);
+
+        snprintf(path, sizeof(path), "%s/f000001.ppm", dir);
+        ck_assert_uint_eq(slurp(path, buf, sizeof(buf)), h + 128 * 64 * 3);
+        ck_assert_uint_eq(buf[h], 0x00);
+        ck_assert_uint_eq(buf[h + (63 * 128 + 127) * 3], 0xFF);
+}
+END_TEST
+
+/* A 128x64 frame is written at the same size, its pixels half the size */
+START_TEST(test_capture_hires){
+        static uint8_t buf[65536];
+        uint64_t disp[64][2] = {{0}};
+        disp[0][0] = 1ULL << 62;
+        disp[63][1] = 1;
+        snprintf(path, sizeof(path), "%s/h", dir);
+        struct capture *c = capture_init(CAPTURE_PPM, path, 2, 4);
+        ck_assert_ptr_nonnull(c);
+        capture_frame(c, disp, UINT64_MAX, 1);
+        capture_stop(c);
+        ck_assert_uint_eq(c->written, 1);
+        capture_destroy(&c);
+
+        const char *header = "P6\n128 64\n255\n";
+        size_t h = strlen(header);
+        snprintf(path, sizeof(path), "%s/h000000.ppm", dir);
+        ck_assert_uint_eq(slurp(path, buf, sizeof(buf)), h + 128 * 64 * 3);
+        ck_assert_mem_eq(buf, header, h);
+        ck_assert_uint_eq(buf[h], 0x00);
+        ck_assert_uint_eq(buf[h + 1 * 3], 0xFF);
+        ck_assert_uint_eq(buf[h + 2 * 3], 0x00);
+        ck_assert_uint_eq(buf[h + 128 * 3 + 3], 0x00);
+        ck_assert_uint_eq(buf[h + (63 * 128 + 127) * 3], 0xFF);
+        ck_assert_uint_eq(buf[h + (63 * 128 + 126) * 3], 0x00);
+        ck_assert_uint_eq(buf[h + (62 * 128 + 127) * 3], 0x00);
+}
+END_TEST
+
+/* With the smallest scale every pixel of the 128x64 mode is still in the
+ * image, the odd columns, and rows as much as the even ones */
+START_TEST(test_capture_hires_odd_scale){
+        static uint8_t buf[65536];
+        uint64_t disp[64][2] = {{0}};
+        disp[0][0] = 1ULL << 63;
+        disp[1][0] = 1ULL << 62;
+        snprintf(path, sizeof(path), "%s/o", dir);
+        struct capture *c = capture_init(CAPTURE_PPM, path, 1, 4);
+        ck_assert_ptr_nonnull(c);
+        capture_frame(c, disp, UINT64_MAX, 1);
+        capture_stop(c);
+        ck_assert_uint_eq(c->written, 1);
+        capture_destroy(&c);
+
+        const char *header = "P6\n128 64\n255\n";
+        size_t h = strlen(header);
+        snprintf(path, sizeof(path), "%s/o000000.ppm", dir);
+        ck_assert_uint_eq(slurp(path, buf, sizeof(buf)), h + 128 * 64 * 3);
+        ck_assert_mem_eq(buf, header, h);
+        ck_assert_uint_eq(buf[h], 0xFF);
+        ck_assert_uint_eq(buf[h + 1 * 3], 0x00);
+        ck_assert_uint_eq(buf[h + (128 + 1) * 3], 0xFF);
+        ck_assert_uint_eq(buf[h + 128 * 3], 0x00);
+}
+END_TEST
+
+/* Draws the font's 0 at the top left, then spins */
+static const uint8_t prog[] = {
+        0x60, 0x00,     /* V0 = 0 */
+        0xF0, 0x29,     /* I = sprite V0 */
+        0xD0, 0x05,     /* draw V0, V0 */
+        0x12, 0x06,     /* jump 0x206 */
+};
+
+START_TEST(test_capture_y4m){
+        static uint8_t buf[65536];
+        struct mState *ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        snprintf(path, sizeof(path), "%s/v.y4m", dir);
+        ms->capture = capture_init(CAPTURE_Y4M, path, 1, CAPTURE_DEFAULT_QUEUE);
+        ck_assert_ptr_nonnull(ms->capture);
+        chip8_run_headless(ms, 0, 5);
+        capture_stop(ms->capture);
+        ck_assert_uint_eq(ms->capture->frames, 5);
+        ck_assert_uint_eq(ms->capture->written, 5);
+        capture_destroy(&ms->capture);
+        chip8_destroy(&ms);
+
+        /* A scale of 1 is rounded up to 2 */
+        const char *header = "YUV4MPEG2 W128 H64 F60:1 Ip A1:1 C420jpeg\n";
+        size_t h = strlen(header);
+        size_t frame = 6 + 128 * 64 + 2 * 64 * 32;
+        ck_assert_uint_eq(slurp(path, buf, sizeof(buf)), h + 5 * frame);
+        ck_assert_mem_eq(buf, header, h);
+        for(int i = 0; i < 5; i++){
+                uint8_t *f = buf + h + i * frame;
+                ck_assert_mem_eq(f, "FRAME\n", 6);
+                /* The top row of the 0 is 0xF0 */
+                ck_assert_uint_eq(f[6 + 0], 0xFF);
+                ck_assert_uint_eq(f[6 + 7], 0xFF);
+                ck_assert_uint_eq(f[6 + 8], 0x00);
+                ck_assert_uint_eq(f[6 + 128 + 7], 0xFF);
+                /* and the second 0x90 */
+                ck_assert_uint_eq(f[6 + 2 * 128 + 2], 0x00);
+                ck_assert_uint_eq(f[6 + 128 * 64], 128);
+                ck_assert_uint_eq(f[frame - 1], 128);
+        }
+}
+END_TEST
+
+START_TEST(test_capture_drops_after_failure){
+        uint64_t disp[64][2] = {{0}};
+        snprintf(path, sizeof(path), "%s/missing/f", dir);
+        struct capture *c = capture_init(CAPTURE_PPM, path, 1, 4);
+        ck_assert_ptr_nonnull(c);
+        for(int i = 0; i < 3; i++)
+                capture_frame(c, disp, 0, 0);
+        capture_stop(c);
+        capture_frame(c, disp, 0, 0);
+        ck_assert_uint_eq(c->frames, 4);
+        ck_assert_uint_eq(c->written, 0);
+        ck_assert_uint_eq(c->dropped, 4);
+        ck_assert_uint_eq(c->failed, 1);
+        capture_destroy(&c);
+
+        snprintf(path, sizeof(path), "%s/missing/v.y4m", dir);
+        ck_assert_ptr_null(capture_init(CAPTURE_Y4M, path, 1, 4));
+}
+END_TEST
+
+Suite *capture_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("capture");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_capture_ppm);
+        tcase_add_test(tc, test_capture_hires);
+        tcase_add_test(tc, test_capture_hires_odd_scale);
+        tcase_add_test(tc, test_capture_y4m);
+        tcase_add_test(tc, test_capture_drops_after_failure);
+        tcase_add_checked_fixture(tc, capture_setup, capture_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
@@ -18,6 +18,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "chip8_test.h"
@@ -26,6 +27,11 @@
 
 static struct mState *ms;
 
+/* The 8 pixels of line y starting at pixel 8 * b, leftmost in the top bit */
+static uint8_t disp_byte(struct mState *ms, int y, int b){
+        return ms->disp[y][0] >> (56 - 8 * b);
+}
+
 void chip8_setup(void){
         ms = chip8_init();
         ck_assert_ptr_nonnull(ms);
@@ -58,6 +64,18 @@ START_TEST(test_chip8_destroy){
 }
 END_TEST
 
+START_TEST(test_chip8_init_headless){
+        struct mState *ms;
+        ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        ck_assert_ptr_null(ms->display);
+        ck_assert_uint_eq(ms->headless, 1);
+        ck_assert_int_eq(ms->pc, 0x200);
+        chip8_destroy(&ms);
+        ck_assert_ptr_null(ms);
+}
+END_TEST
+
 START_TEST(test_chip8_load_rom){
         struct runtime_error *re;
         re = chip8_load_rom(ms, "testdata/nonexistence");
@@ -100,6 +118,58 @@ START_TEST(test_chip8_run){
 }
 END_TEST
 
+START_TEST(test_chip8_run_headless){
+        struct mState *ms = chip8_init_headless();
+        struct keyEvent ke;
+        ck_assert_ptr_nonnull(ms);
+        /* Set V0 to BB */
+        ms->mem[0x400] = 0x60;
+        ms->mem[0x401] = 0xBB;
+        /* Set the delay timer to BB */
+        ms->mem[0x402] = 0xF0;
+        ms->mem[0x403] = 0x15;
+        /* Draw the font character for B */
+        ms->registers[0x3] = 0xB;
+        ms->mem[0x404] = 0xF3;
+        ms->mem[0x405] = 0x29;
+        ms->mem[0x406] = 0xD1;
+        ms->mem[0x407] = 0x15;
+        /* loop */
+        ms->mem[0x408] = 0x14;
+        ms->mem[0x409] = 0x08;
+        ms->pc = 0x400;
+
+        ck_assert_uint_eq(chip8_run_headless(ms, 0, 0), 0);
+        ck_assert_uint_eq(chip8_run_headless(ms, 105, 0), 105);
+        ck_assert_uint_eq(ms->count, 105);
+        ck_assert_uint_eq(ms->pc, 0x408);
+        ck_assert_uint_eq(ms->registers[0x0], 0xBB);
+        /* 10 whole frames have passed */
+        ck_assert_uint_eq(ms->dTimer, 0xBB - 10);
+        /* The font character for B is drawn in the top left corner */
+        ck_assert_uint_eq(disp_byte(ms, 0, 0), 0xE0);
+        ck_assert_uint_eq(disp_byte(ms, 4, 0), 0xE0);
+
+        ck_assert_uint_eq(chip8_run_headless(ms, 0, 5), 5 * CHIP8_DEFAULT_IPF);
+        ck_assert_uint_eq(ms->dTimer, 0xBB - 15);
+
+        /* A headless FX0A polls instead of blocking */
+        ms->mem[0x40A] = 0xF2;
+        ms->mem[0x40B] = 0x0A;
+        ms->pc = 0x40A;
+        ck_assert_uint_eq(chip8_run_headless(ms, 20, 0), 20);
+        ck_assert_uint_eq(ms->pc, 0x40A);
+        ke.type = Pressed;
+        ke.key = 0x7;
+        chip8_key_event_notify(ms, ke);
+        chip8_run_headless(ms, 1, 0);
+        ck_assert_uint_eq(ms->registers[0x2], 0x7);
+        ck_assert_uint_eq(ms->pc, 0x40C);
+
+        chip8_destroy(&ms);
+}
+END_TEST
+
 START_TEST(test_wait_for_keypress_instruction){
         struct keyEvent ke;
         ms->mem[0x400] = 0xF1;
@@ -190,7 +260,11 @@ START_TEST(test_chip8_timers){
         /* start the chip */
         chip8_run(ms);
 
+        /* Sample half way between ticks, which land on whole seconds */
         nanosleep(&ts, &ts2);
+        ts2.tv_sec = 0;
+        ts2.tv_nsec = 1000000000L / 120;
+        nanosleep(&ts2, NULL);
         sSTime = ms->sTimer;
         sDTime = ms->dTimer;
         nanosleep(&ts, &ts2);
@@ -203,20 +277,353 @@ START_TEST(test_chip8_timers){
 }
 END_TEST
 
+/* Ticks are worked out from the elapsed time, so ten minutes on are
+ * exactly 36000 of them, each landing on its own boundary */
+START_TEST(test_chip8_ticks_due){
+        for(uint64_t k = 1; k <= 36000; k++){
+                uint64_t boundary = (k * 1000000000ULL + 59) / 60;
+                ck_assert_uint_eq(chip8_ticks_due(boundary), k);
+                ck_assert_uint_eq(chip8_ticks_due(boundary - 1), k - 1);
+        }
+        ck_assert_uint_eq(chip8_ticks_due(600 * 1000000000ULL), 36000);
+        ck_assert_uint_eq(chip8_ticks_due(86400 * 1000000000ULL), 5184000);
+}
+END_TEST
+
+static uint64_t monotonic_ns(void){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sampled half way between ticks, the timer thread never gets ahead of the
+ * wall clock, or more than the tick the sampler may be late by behind it,
+ * and the delay timer follows it */
+START_TEST(test_chip8_timer_drift){
+        ms->registers[0x0] = 0xFF;
+        ms->mem[0x400] = 0xF0;
+        ms->mem[0x401] = 0x15;
+        ms->mem[0x402] = 0x14;
+        ms->mem[0x403] = 0x02;
+        ms->pc = 0x400;
+
+        chip8_run(ms);
+        for(uint64_t k = 6; k <= 120; k += 6){
+                uint64_t mid = ms->tickStart + k * 1000000000ULL / 60 + 1000000000ULL / 120;
+                struct timespec ts = { mid / 1000000000ULL, mid % 1000000000ULL };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                uint64_t before = chip8_ticks_due(monotonic_ns() - ms->tickStart);
+                uint64_t ticks = atomic_load(&ms->ticks);
+                uint64_t after = chip8_ticks_due(monotonic_ns() - ms->tickStart);
+                ck_assert_uint_ge(ticks + 1, before);
+                ck_assert_uint_le(ticks, after);
+        }
+        chip8_halt(ms);
+        uint64_t ticks = atomic_load(&ms->ticks);
+        ck_assert_uint_ge(ticks, 120);
+        ck_assert_uint_eq(ms->dTimer, ticks < 0xFF ? 0xFF - ticks : 0);
+}
+END_TEST
+
+/* Sleeps until ns after the chip started */
+static void sleep_after_start(uint64_t ns){
+        uint64_t t = ms->tickStart + ns;
+        struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Fast forwarding ticks the timers turbo times as fast, and going back
+ * to normal speed carries on from where the emulated clock had got to */
+START_TEST(test_chip8_turbo){
+        ms->registers[0x0] = 0xFF;
+        ms->mem[0x400] = 0xF0;
+        ms->mem[0x401] = 0x15;
+        ms->mem[0x402] = 0x14;
+        ms->mem[0x403] = 0x02;
+        ms->pc = 0x400;
+
+        chip8_set_turbo(ms, 10);
+        ck_assert_uint_eq(atomic_load(&ms->turbo), 10);
+        chip8_run(ms);
+        sleep_after_start(300000000ULL + 1000000000ULL / 120);
+        uint64_t fast = atomic_load(&ms->ticks);
+        ck_assert_uint_ge(fast, 170);
+        ck_assert_uint_le(fast, 181);
+
+        /* The ticks due before the switch are applied on the next wake */
+        chip8_set_turbo(ms, 1);
+        sleep_after_start(400000000ULL);
+        uint64_t t1 = atomic_load(&ms->ticks);
+        sleep_after_start(900000000ULL);
+        uint64_t t2 = atomic_load(&ms->ticks);
+        chip8_halt(ms);
+        ck_assert_uint_ge(t2 - t1, 29);
+        ck_assert_uint_le(t2 - t1, 31);
+        uint64_t ticks = atomic_load(&ms->ticks);
+        ck_assert_uint_eq(ms->dTimer, ticks < 0xFF ? 0xFF - ticks : 0);
+
+        chip8_set_turbo(ms, 0);
+        ck_assert_uint_eq(atomic_load(&ms->turbo), 1);
+        chip8_set_turbo(ms, 1000);
+        ck_assert_uint_eq(atomic_load(&ms->turbo), CHIP8_MAX_TURBO);
+}
+END_TEST
+
+/* On the virtual clock fast forwarding runs turbo times as many frames */
+START_TEST(test_chip8_turbo_frames){
+        ms->insPerFrame = 10;
+        ms->mem[0x200] = 0x70;
+        ms->mem[0x201] = 0x01;
+        ms->mem[0x202] = 0x12;
+        ms->mem[0x203] = 0x00;
+
+        chip8_set_turbo(ms, 20);
+        chip8_run(ms);
+        sleep_after_start(250000000ULL);
+        chip8_halt(ms);
+        /* 15 frames at normal speed */
+        ck_assert_uint_ge(ms->frames, 200);
+        ck_assert_uint_le(ms->frames, 301);
+        ck_assert_uint_eq(ms->count, ms->frames * 10);
+}
+END_TEST
+
+/* Drawing marks lines, the display is handed to the UI once a frame, or
+ * every turbo frames */
+START_TEST(test_chip8_coalesced_publish){
+        ms->insPerFrame = 10;
+        ms->mem[0x200] = 0xD0;
+        ms->mem[0x201] = 0x05;
+        ms->mem[0x202] = 0x12;
+        ms->mem[0x203] = 0x00;
+        decode_invalidate_all(ms);
+
+        chip8_set_turbo(ms, 5);
+        for(int i = 0; i < 20; i++)
+                ck_assert_int_eq(chip8_run_frame(ms), 0);
+        ck_assert_uint_eq(ms->display->published, 4);
+        chip8_set_turbo(ms, 1);
+        for(int i = 0; i < 10; i++)
+                ck_assert_int_eq(chip8_run_frame(ms), 0);
+        ck_assert_uint_eq(ms->display->published, 14);
+        /* 5 draws a frame of the same sprite, an odd number, leave it */
+        ck_assert_uint_eq(tribuf_front_dirty(&ms->display->disp), 0);
+}
+END_TEST
+
+/* Free running, the display is handed over at most CHIP8_PRESENT_HZ times
+ * a second, however fast the chip draws */
+START_TEST(test_chip8_present_rate){
+        ms->mem[0x200] = 0xD0;
+        ms->mem[0x201] = 0x05;
+        ms->mem[0x202] = 0x12;
+        ms->mem[0x203] = 0x00;
+
+        chip8_set_turbo(ms, CHIP8_MAX_TURBO);
+        chip8_run(ms);
+        sleep_after_start(300000000ULL);
+        chip8_halt(ms);
+        ck_assert_uint_ge(ms->display->published, 1);
+        ck_assert_uint_le(ms->display->published, 300 * CHIP8_PRESENT_HZ / 1000 + 2);
+        ck_assert_uint_gt(ms->count / 2, 100 * ms->display->published);
+}
+END_TEST
+
+/* The same timer checks as test_chip8_timers on the virtual clock, where
+ * frames are counted instead of waited for */
+START_TEST(test_chip8_virtual_timers){
+        struct mState *ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        ms->registers[0x0] = 0xFF;
+        ms->mem[0x400] = 0xF0;
+        ms->mem[0x401] = 0x15;
+        ms->mem[0x402] = 0xF0;
+        ms->mem[0x403] = 0x18;
+        ms->mem[0x404] = 0x14;
+        ms->mem[0x405] = 0x04;
+        ms->pc = 0x400;
+
+        chip8_run_headless(ms, 0, 60);
+        ck_assert_uint_eq(ms->sTimer, 0xFF - 60);
+        ck_assert_uint_eq(ms->dTimer, 0xFF - 60);
+
+        chip8_run_headless(ms, 0, 300);
+        ck_assert_uint_eq(ms->sTimer, 0);
+        ck_assert_uint_eq(ms->dTimer, 0);
+        chip8_destroy(&ms);
+}
+END_TEST
+
+/* On the virtual clock the execution thread ticks the timers once every
+ * insPerFrame instructions */
+START_TEST(test_chip8_frame_scheduler){
+        struct timespec ts, ts2;
+        ms->insPerFrame = 12;
+        ms->registers[0x0] = 0xFF;
+        ms->mem[0x400] = 0xF0;
+        ms->mem[0x401] = 0x15;
+        ms->mem[0x402] = 0xF0;
+        ms->mem[0x403] = 0x18;
+        ms->mem[0x404] = 0x14;
+        ms->mem[0x405] = 0x04;
+        ms->pc = 0x400;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 500000000L;
+
+        chip8_run(ms);
+        nanosleep(&ts, &ts2);
+        chip8_halt(ms);
+
+        /* Roughly 30 frames in half a second */
+        ck_assert_uint_ge(ms->count / 12, 20);
+        ck_assert_uint_le(ms->count / 12, 40);
+        /* and the timers moved with the instructions, not the wall clock */
+        ck_assert_uint_eq(ms->dTimer, 0xFF - ms->count / 12);
+        ck_assert_uint_eq(ms->sTimer, 0xFF - ms->count / 12);
+}
+END_TEST
+
+/* Two chips with the same seed on the virtual clock must end in the same
+ * state */
+START_TEST(test_chip8_deterministic){
+        struct mState *a = chip8_init_headless();
+        struct mState *b = chip8_init_headless();
+        ck_assert_ptr_nonnull(a);
+        ck_assert_ptr_nonnull(b);
+        /* V0 = rand, V1 += V0, dTimer = V1, V2 = dTimer, loop */
+        static const uint8_t prog[] = {0xC0, 0xFF, 0x81, 0x04, 0xF1, 0x15,
+                                       0xF2, 0x07, 0x12, 0x00};
+        for(size_t i = 0; i < sizeof(prog); i++){
+                a->mem[0x200 + i] = prog[i];
+                b->mem[0x200 + i] = prog[i];
+        }
+        chip8_seed(a, 1234);
+        chip8_seed(b, 1234);
+        chip8_run_headless(a, 10007, 0);
+        chip8_run_headless(b, 10007, 0);
+        for(int i = 0; i < 16; i++)
+                ck_assert_uint_eq(a->registers[i], b->registers[i]);
+        ck_assert_uint_eq(a->dTimer, b->dTimer);
+        ck_assert_uint_eq(a->pc, b->pc);
+        ck_assert_uint_eq(a->rngState, b->rngState);
+        chip8_destroy(&a);
+        chip8_destroy(&b);
+}
+END_TEST
+
+/* Skipping the rest of a frame in an idle loop must end in the state
+ * executing every instruction would, whatever the instructions per frame */
+START_TEST(test_chip8_idle_skip){
+        /* Wait for the delay timer, count, then jump to itself */
+        static const uint8_t prog[] = {
+                0x61, 0x07,     /* V1 = 7 */
+                0xF1, 0x15,     /* delay = V1 */
+                0xF0, 0x07,     /* V0 = delay */
+                0x30, 0x02,     /* skip if V0 == 2 */
+                0x12, 0x04,     /* jump 0x204 */
+                0x72, 0x01,     /* V2 += 1 */
+                0x12, 0x0C      /* jump 0x20C */
+        };
+        static const uint32_t rates[] = {1, 2, 3, 4, 5, 7, 10, 13, 1000};
+        for(size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++){
+                struct mState *a = chip8_init_headless();
+                struct mState *b = chip8_init_headless();
+                ck_assert_ptr_nonnull(a);
+                ck_assert_ptr_nonnull(b);
+                memcpy(a->mem + 0x200, prog, sizeof(prog));
+                memcpy(b->mem + 0x200, prog, sizeof(prog));
+                a->insPerFrame = b->insPerFrame = rates[r];
+                for(int frame = 0; frame < 30; frame++){
+                        chip8_run_headless(a, 0, 1);
+                        for(uint32_t i = 0; i < rates[r]; i++)
+                                chip8_step(b);
+                        if(b->dTimer != 0)
+                                b->dTimer--;
+                        ck_assert_uint_eq(a->count, b->count);
+                        ck_assert_uint_eq(a->pc, b->pc);
+                        ck_assert_uint_eq(a->dTimer, b->dTimer);
+                        ck_assert_mem_eq(a->registers, b->registers, 16);
+                }
+                /* Slower, and the loop samples too few values of the
+                 * timer to see 2 */
+                if(rates[r] >= 3)
+                        ck_assert_uint_eq(a->registers[0x2], 1);
+                chip8_destroy(&a);
+                chip8_destroy(&b);
+        }
+
+        /* Far too many instructions to execute one at a time */
+        struct mState *c = chip8_init_headless();
+        ck_assert_ptr_nonnull(c);
+        memcpy(c->mem + 0x200, prog, sizeof(prog));
+        c->insPerFrame = 1 << 30;
+        chip8_run_headless(c, 0, 60);
+        ck_assert_uint_eq(c->count, 60ULL << 30);
+        ck_assert_uint_eq(c->pc, 0x20C);
+        ck_assert_uint_eq(c->registers[0x2], 1);
+        chip8_destroy(&c);
+
+        /* A program that has exited with 00FD is parked the same way */
+        static const uint8_t exited[] = {
+                0x72, 0x01,     /* V2 += 1 */
+                0x00, 0xFD      /* exit */
+        };
+        c = chip8_init_headless();
+        ck_assert_ptr_nonnull(c);
+        memcpy(c->mem + 0x200, exited, sizeof(exited));
+        c->insPerFrame = 1 << 30;
+        chip8_run_headless(c, 0, 60);
+        ck_assert_uint_eq(c->count, 60ULL << 30);
+        ck_assert_uint_eq(c->pc, 0x202);
+        ck_assert_uint_eq(c->registers[0x2], 1);
+        chip8_destroy(&c);
+}
+END_TEST
+
+/* A free running chip limited to a rate keeps to it, and to a new one set
+ * while it runs */
+START_TEST(test_chip8_rate_limit){
+        struct mState *c = chip8_init_headless();
+        ck_assert_ptr_nonnull(c);
+        c->insPerFrame = 0;
+        /* V0 += 1, loop */
+        static const uint8_t prog[] = {0x70, 0x01, 0x12, 0x00};
+        memcpy(c->mem + 0x200, prog, sizeof(prog));
+        struct timespec ts = { 0, 500000000L };
+        struct chip8_pace p;
+
+        chip8_set_rate(c, 20000);
+        chip8_run(c);
+        nanosleep(&ts, NULL);
+        chip8_get_pace(c, &p);
+        ck_assert_uint_eq(p.rate, 20000);
+        ck_assert_uint_gt(p.deadlines, 0);
+        double rate = p.instructions * 1e9 / p.elapsed;
+        ck_assert_msg(rate > 18000 && rate < 22000, "ran at %.0f/s", rate);
+
+        chip8_set_rate(c, 5000);
+        nanosleep(&ts, NULL);
+        chip8_get_pace(c, &p);
+        ck_assert_uint_eq(p.rate, 5000);
+        rate = p.instructions * 1e9 / p.elapsed;
+        ck_assert_msg(rate > 4500 && rate < 5500, "ran at %.0f/s", rate);
+        chip8_halt(c);
+        chip8_destroy(&c);
+}
+END_TEST
+
 /* Test clear display instruction:
  * 0x0E0 clears the display */
 START_TEST(test_clear_instruction){
         run_instruction(ms, 0x00E0);
         for(size_t y = 0; y < 32; y++)
                 for(size_t x = 0; x < 8; x++)
-                        ck_assert_uint_eq(ms->disp[y][x], 0x0);
+                        ck_assert_uint_eq(disp_byte(ms, y, x), 0x0);
         for(size_t y = 0; y < 32; y++)
-                for(size_t x = 0; x < 8; x++)
-                        ms->disp[x][y] = 1;
+                ms->disp[y][0] = ~0ULL;
         run_instruction(ms, 0x00E0);
-        for(int x = 0; x < 8; x++)
-                for(int y = 0; y < 4; y++)
-                        ck_assert_uint_eq(ms->disp[x][y], 0x0);
+        for(size_t y = 0; y < 32; y++)
+                ck_assert_uint_eq(ms->disp[y][0], 0x0);
 }
 END_TEST
 
@@ -620,7 +1027,7 @@ START_TEST(test_draw_instruction){
         ms->registers[1] = 0x0;
         ms->iRegister = 0;
         run_instruction(ms, 0xD011);
-        ck_assert_uint_eq(ms->disp[0][0], 0b11111111);
+        ck_assert_uint_eq(disp_byte(ms, 0, 0), 0b11111111);
         ck_assert_uint_eq(ms->registers[0xF], 0);
 
         /* check that two lines are drawn correctly */
@@ -630,8 +1037,8 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 0;
         ms->registers[1] = 1;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[1][0], 0b10101010);
-        ck_assert_uint_eq(ms->disp[2][0], 0b10101010);
+        ck_assert_uint_eq(disp_byte(ms, 1, 0), 0b10101010);
+        ck_assert_uint_eq(disp_byte(ms, 2, 0), 0b10101010);
         ck_assert_uint_eq(ms->registers[0xF], 0);
 
         /* check that pixels are XOR'd */
@@ -641,8 +1048,8 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 0;
         ms->registers[1] = 1;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[1][0], 0b00000000);
-        ck_assert_uint_eq(ms->disp[2][0], 0b00000000);
+        ck_assert_uint_eq(disp_byte(ms, 1, 0), 0b00000000);
+        ck_assert_uint_eq(disp_byte(ms, 2, 0), 0b00000000);
         ck_assert_uint_eq(ms->registers[0xF], 1);
 
         /* test sprites that overlap byte bounds */
@@ -652,10 +1059,10 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 4;
         ms->registers[1] = 4;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[4][0], 0b00001111);
-        ck_assert_uint_eq(ms->disp[4][1], 0b11110000);
-        ck_assert_uint_eq(ms->disp[5][0], 0b00001111);
-        ck_assert_uint_eq(ms->disp[5][1], 0b11110000);
+        ck_assert_uint_eq(disp_byte(ms, 4, 0), 0b00001111);
+        ck_assert_uint_eq(disp_byte(ms, 4, 1), 0b11110000);
+        ck_assert_uint_eq(disp_byte(ms, 5, 0), 0b00001111);
+        ck_assert_uint_eq(disp_byte(ms, 5, 1), 0b11110000);
         ck_assert_uint_eq(ms->registers[0xF], 0);
 
         /* test line wraping works */
@@ -665,10 +1072,10 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 60;
         ms->registers[1] = 8;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[8][7], 0b00001111);
-        ck_assert_uint_eq(ms->disp[8][0], 0b11110000);
-        ck_assert_uint_eq(ms->disp[9][7], 0b00001111);
-        ck_assert_uint_eq(ms->disp[9][0], 0b11110000);
+        ck_assert_uint_eq(disp_byte(ms, 8, 7), 0b00001111);
+        ck_assert_uint_eq(disp_byte(ms, 8, 0), 0b11110000);
+        ck_assert_uint_eq(disp_byte(ms, 9, 7), 0b00001111);
+        ck_assert_uint_eq(disp_byte(ms, 9, 0), 0b11110000);
         ck_assert_uint_eq(ms->registers[0xF], 0);
 
         /* test that x and y values out side the screen are wrapped to fit */
@@ -680,10 +1087,10 @@ START_TEST(test_draw_instruction){
         /* Y should become 74 - (32 * 2) = 10 */
         ms->registers[1] = 74;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[10][0], 0b00110011);
-        ck_assert_uint_eq(ms->disp[10][1], 0b00000000);
-        ck_assert_uint_eq(ms->disp[11][0], 0b00110011);
-        ck_assert_uint_eq(ms->disp[11][1], 0b00000000);
+        ck_assert_uint_eq(disp_byte(ms, 10, 0), 0b00110011);
+        ck_assert_uint_eq(disp_byte(ms, 10, 1), 0b00000000);
+        ck_assert_uint_eq(disp_byte(ms, 11, 0), 0b00110011);
+        ck_assert_uint_eq(disp_byte(ms, 11, 1), 0b00000000);
         ck_assert_uint_eq(ms->registers[0xF], 0);
 
         /* test sprites that overlap byte bounds with odd number overlap */
@@ -693,10 +1100,10 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 7;
         ms->registers[1] = 28;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[28][0], 0b00000001);
-        ck_assert_uint_eq(ms->disp[28][1], 0b11111110);
-        ck_assert_uint_eq(ms->disp[29][0], 0b00000001);
-        ck_assert_uint_eq(ms->disp[29][1], 0b11111110);
+        ck_assert_uint_eq(disp_byte(ms, 28, 0), 0b00000001);
+        ck_assert_uint_eq(disp_byte(ms, 28, 1), 0b11111110);
+        ck_assert_uint_eq(disp_byte(ms, 29, 0), 0b00000001);
+        ck_assert_uint_eq(disp_byte(ms, 29, 1), 0b11111110);
         ck_assert_uint_eq(ms->registers[0xF], 0);
         
         /* clear the display */
@@ -709,11 +1116,35 @@ START_TEST(test_draw_instruction){
         ms->registers[0] = 7;
         ms->registers[1] = 31;
         run_instruction(ms, 0xD012);
-        ck_assert_uint_eq(ms->disp[31][0], 0b00000001);
-        ck_assert_uint_eq(ms->disp[31][1], 0b11111110);
-        ck_assert_uint_eq(ms->disp[0][0], 0b00000001);
-        ck_assert_uint_eq(ms->disp[0][1], 0b11111110);
+        ck_assert_uint_eq(disp_byte(ms, 31, 0), 0b00000001);
+        ck_assert_uint_eq(disp_byte(ms, 31, 1), 0b11111110);
+        ck_assert_uint_eq(disp_byte(ms, 0, 0), 0b00000001);
+        ck_assert_uint_eq(disp_byte(ms, 0, 1), 0b11111110);
+        ck_assert_uint_eq(ms->registers[0xF], 0);
+
+        /* test a collision on any row sets Vf, not just on the last one */
+        run_instruction(ms, 0x00E0);
+        ms->mem[5] = 0b10000000;
+        ms->mem[6] = 0b00000001;
+        ms->iRegister = 5;
+        ms->registers[0] = 0;
+        ms->registers[1] = 0;
+        run_instruction(ms, 0xD011);
         ck_assert_uint_eq(ms->registers[0xF], 0);
+        run_instruction(ms, 0xD012);
+        ck_assert_uint_eq(disp_byte(ms, 0, 0), 0b00000000);
+        ck_assert_uint_eq(disp_byte(ms, 1, 0), 0b00000001);
+        ck_assert_uint_eq(ms->registers[0xF], 1);
+
+        /* test the lines drawn on, or cleared, are marked dirty */
+        run_instruction(ms, 0x00E0);
+        ms->dirty = 0;
+        ms->registers[1] = 31;
+        run_instruction(ms, 0xD012);
+        ck_assert_uint_eq(ms->dirty, 1u << 31 | 1u << 0);
+        ms->dirty = 0;
+        run_instruction(ms, 0x00E0);
+        ck_assert_uint_eq(ms->dirty, 1u << 31 | 1u << 0);
 }
 END_TEST
 
@@ -941,6 +1372,192 @@ START_TEST(test_load_instruction){
 }
 END_TEST
 
+/* Addresses formed from I wrap around at the end of memory, and key
+ * numbers past F use the low 4 bits */
+START_TEST(test_address_wrap){
+        /* Decode the font at 0, F0 90, so the entry has to change */
+        ms->pc = 0;
+        decode_execute(ms);
+        ms->registers[0x0] = 0xF1;
+        ms->registers[0x1] = 0x00;
+        ms->iRegister = 0xFFF;
+        run_instruction(ms, 0xF155);
+        ck_assert_uint_eq(ms->mem[0xFFF], 0xF1);
+        ck_assert_uint_eq(ms->mem[0x000], 0x00);
+        ck_assert_uint_eq(ms->iRegister, 0x1001);
+
+        ms->registers[0x2] = 123;
+        ms->iRegister = 0xFFE;
+        run_instruction(ms, 0xF233);
+        ck_assert_uint_eq(ms->mem[0xFFE], 1);
+        ck_assert_uint_eq(ms->mem[0xFFF], 2);
+        ck_assert_uint_eq(ms->mem[0x000], 3);
+        /* 03 90 is now a jump to 0x390 */
+        ms->pc = 0;
+        decode_execute(ms);
+        ck_assert_uint_eq(ms->pc, 0x390);
+
+        ms->iRegister = 0xFFE;
+        run_instruction(ms, 0xF265);
+        ck_assert_uint_eq(ms->registers[0x0], 1);
+        ck_assert_uint_eq(ms->registers[0x1], 2);
+        ck_assert_uint_eq(ms->registers[0x2], 3);
+
+        /* Rows of the sprite come from 0xFFF, then 0 */
+        ms->registers[0x0] = 0;
+        ms->iRegister = 0xFFF;
+        run_instruction(ms, 0xD002);
+        ck_assert_uint_eq(disp_byte(ms, 0, 0), 2);
+        ck_assert_uint_eq(disp_byte(ms, 1, 0), 3);
+
+        ms->keys[0x3] = 1;
+        ms->registers[0x4] = 0x13;
+        ms->pc = 0x200;
+        run_instruction(ms, 0xE49E);
+        ck_assert_uint_eq(ms->pc, 0x204);
+        run_instruction(ms, 0xE4A1);
+        ck_assert_uint_eq(ms->pc, 0x206);
+}
+END_TEST
+
+/* 00FF switches to 128x64, and 00FE back, clearing the display and marking
+ * every line so the UI sees the switch */
+START_TEST(test_schip_resolution){
+        ms->disp[3][0] = 1;
+        ms->dirty = 0;
+        ms->pc = 0x200;
+        run_instruction(ms, 0x00FF);
+        ck_assert_uint_eq(ms->hires, 1);
+        ck_assert_uint_eq(ms->pc, 0x202);
+        ck_assert_uint_eq(ms->disp[3][0], 0);
+        ck_assert(ms->dirty == CHIP8_ALL_LINES);
+
+        /* Already in the mode, only the lines drawn on change */
+        ms->disp[40][1] = 1;
+        ms->dirty = 0;
+        run_instruction(ms, 0x00FF);
+        ck_assert_uint_eq(ms->disp[40][1], 0);
+        ck_assert(ms->dirty == 1ULL << 40);
+
+        ms->dirty = 0;
+        run_instruction(ms, 0x00FE);
+        ck_assert_uint_eq(ms->hires, 0);
+        ck_assert(ms->dirty == CHIP8_ALL_LINES);
+
+        /* 00FD exits, the program stays on it */
+        run_instruction(ms, 0x00FD);
+        ck_assert_uint_eq(ms->pc, 0x206);
+        /* Other 0NNN instructions are still jumps */
+        run_instruction(ms, 0x00FA);
+        ck_assert_uint_eq(ms->pc, 0x0FA);
+}
+END_TEST
+
+/* DXY0 draws a 16x16 sprite, in high resolution across both words of a
+ * line and wrapping at 128 and 64 */
+START_TEST(test_schip_draw){
+        for(int i = 0; i < 32; i++)
+                ms->mem[0x300 + i] = (i & 1) ? 0x01 : 0x80;
+        ms->iRegister = 0x300;
+        run_instruction(ms, 0x00FF);
+        ms->registers[0] = 56;
+        ms->registers[1] = 62;
+        ms->dirty = 0;
+        run_instruction(ms, 0xD010);
+        ck_assert_uint_eq(ms->registers[0xF], 0);
+        /* Columns 56 and 71 of lines 62, 63, then 0 to 13 */
+        ck_assert(ms->disp[62][0] == 1ULL << 7);
+        ck_assert(ms->disp[62][1] == 1ULL << 56);
+        ck_assert(ms->disp[13][0] == 1ULL << 7);
+        ck_assert(ms->disp[14][0] == 0);
+        ck_assert(ms->dirty == (0x3FFFULL | 3ULL << 62));
+
+        run_instruction(ms, 0xD010);
+        ck_assert_uint_eq(ms->registers[0xF], 1);
+        ck_assert(ms->disp[62][0] == 0 && ms->disp[62][1] == 0);
+
+        /* Past the right edge the row wraps to the left */
+        ms->mem[0x320] = 0xFF;
+        ms->iRegister = 0x320;
+        ms->registers[0] = 124;
+        ms->registers[1] = 0;
+        run_instruction(ms, 0xD011);
+        ck_assert(ms->disp[0][1] == 0xF);
+        ck_assert(ms->disp[0][0] == 0xFULL << 60);
+
+        /* Low resolution draws 16x16 as well, in the first word */
+        run_instruction(ms, 0x00FE);
+        ms->iRegister = 0x300;
+        ms->registers[0] = 0;
+        run_instruction(ms, 0xD010);
+        ck_assert(ms->disp[0][0] == (1ULL << 63 | 1ULL << 48));
+        ck_assert(ms->disp[15][0] == (1ULL << 63 | 1ULL << 48));
+        ck_assert(ms->disp[16][0] == 0);
+        ck_assert(ms->disp[0][1] == 0);
+}
+END_TEST
+
+/* 00CN moves lines down, 00FB and 00FC move pixels 4 right or left, in
+ * pixels of the current mode */
+START_TEST(test_schip_scroll){
+        run_instruction(ms, 0x00FF);
+        ms->disp[0][0] = 0xF;
+        ms->disp[0][1] = 0xF000000000000000ULL;
+        ms->disp[60][1] = 1;
+        ms->dirty = 0;
+        run_instruction(ms, 0x00C3);
+        ck_assert(ms->disp[0][0] == 0 && ms->disp[0][1] == 0);
+        ck_assert(ms->disp[3][0] == 0xF);
+        ck_assert(ms->disp[3][1] == 0xF000000000000000ULL);
+        ck_assert(ms->disp[63][1] == 1);
+        ck_assert(ms->disp[60][1] == 0);
+        ck_assert(ms->dirty == (1ULL << 0 | 1ULL << 3 | 1ULL << 60 | 1ULL << 63));
+
+        /* Right carries the low bits of the first word into the second */
+        run_instruction(ms, 0x00FB);
+        ck_assert(ms->disp[3][0] == 0);
+        ck_assert(ms->disp[3][1] == 0xFF00000000000000ULL);
+        ck_assert(ms->disp[63][1] == 0);
+        run_instruction(ms, 0x00FC);
+        run_instruction(ms, 0x00FC);
+        ck_assert(ms->disp[3][0] == 0xFF);
+        ck_assert(ms->disp[3][1] == 0);
+
+        /* Low resolution stays in the first word, and the top 32 lines */
+        run_instruction(ms, 0x00FE);
+        ms->disp[0][0] = 0xF;
+        ms->disp[30][0] = 1ULL << 63;
+        run_instruction(ms, 0x00FB);
+        ck_assert(ms->disp[0][0] == 0);
+        ck_assert(ms->disp[0][1] == 0);
+        ck_assert(ms->disp[30][0] == 1ULL << 59);
+        run_instruction(ms, 0x00C2);
+        ck_assert(ms->disp[31][0] == 0);
+        ck_assert(ms->disp[32][0] == 0);
+        ck_assert(ms->disp[2][0] == 0);
+}
+END_TEST
+
+/* FX75 and FX85 save and load V0 to VX in the flags, FX30 points I at the
+ * big font */
+START_TEST(test_schip_flags){
+        for(int i = 0; i < 16; i++)
+                ms->registers[i] = i + 1;
+        run_instruction(ms, 0xF375);
+        memset(ms->registers, 0, sizeof(ms->registers));
+        run_instruction(ms, 0xF785);
+        ck_assert_uint_eq(ms->registers[0x0], 1);
+        ck_assert_uint_eq(ms->registers[0x3], 4);
+        ck_assert_uint_eq(ms->registers[0x4], 0);
+        ck_assert_uint_eq(ms->rplFlags[0x4], 0);
+
+        ms->registers[0x2] = 8;
+        run_instruction(ms, 0xF230);
+        ck_assert_uint_eq(ms->iRegister, 80 + 8 * 10);
+        ck_assert_uint_eq(ms->mem[ms->iRegister], 0x3C);
+}
+END_TEST
+
 
 Suite *chip8_suite(void){
         Suite *s;
@@ -955,6 +1572,7 @@ Suite *chip8_suite(void){
         /* Core operations */
         tcase_add_test(tc_core, test_chip8_init);
         tcase_add_test(tc_core, test_chip8_destroy);
+        tcase_add_test(tc_core, test_chip8_init_headless);
         suite_add_tcase(s, tc_core);
         /* Instructions */
         tcase_add_test(tc_ins, test_clear_instruction);
@@ -991,13 +1609,30 @@ Suite *chip8_suite(void){
         tcase_add_test(tc_ins, test_to_bcd_instruction);
         tcase_add_test(tc_ins, test_dump_instruction);
         tcase_add_test(tc_ins, test_load_instruction);
+        tcase_add_test(tc_ins, test_address_wrap);
+        tcase_add_test(tc_ins, test_schip_resolution);
+        tcase_add_test(tc_ins, test_schip_draw);
+        tcase_add_test(tc_ins, test_schip_scroll);
+        tcase_add_test(tc_ins, test_schip_flags);
         tcase_add_checked_fixture(tc_ins, chip8_setup, chip8_teardown);
         tcase_set_timeout(tc_ins, 10);
         suite_add_tcase(s, tc_ins);
 
         tcase_add_test(tc_func, test_chip8_run);
         tcase_add_test(tc_func, test_chip8_timers);
+        tcase_add_test(tc_func, test_chip8_ticks_due);
+        tcase_add_test(tc_func, test_chip8_timer_drift);
+        tcase_add_test(tc_func, test_chip8_turbo);
+        tcase_add_test(tc_func, test_chip8_turbo_frames);
+        tcase_add_test(tc_func, test_chip8_coalesced_publish);
+        tcase_add_test(tc_func, test_chip8_present_rate);
         tcase_add_test(tc_func, test_chip8_load_rom);
+        tcase_add_test(tc_func, test_chip8_run_headless);
+        tcase_add_test(tc_func, test_chip8_virtual_timers);
+        tcase_add_test(tc_func, test_chip8_frame_scheduler);
+        tcase_add_test(tc_func, test_chip8_deterministic);
+        tcase_add_test(tc_func, test_chip8_idle_skip);
+        tcase_add_test(tc_func, test_chip8_rate_limit);
         tcase_add_checked_fixture(tc_func, chip8_setup, chip8_teardown);
         tcase_set_timeout(tc_func, 20);
         suite_add_tcase(s, tc_func);
@@ -0,0 +1,255 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode_test.h"
+
+#include "../src/chip8.h"
+#include "../src/jit.h"
+
+static struct mState *a;
+static struct mState *b;
+
+void decode_setup(void){
+        a = chip8_init_headless();
+        b = chip8_init_headless();
+        ck_assert_ptr_nonnull(a);
+        ck_assert_ptr_nonnull(b);
+}
+
+void decode_teardown(void){
+        chip8_destroy(&a);
+        chip8_destroy(&b);
+}
+
+/* Gives both chips the same random registers, and the same memory */
+static void randomize(void){
+        for(int i = 0; i < 16; i++){
+                a->registers[i] = b->registers[i] = rand();
+                a->keys[i] = b->keys[i] = rand() & 1;
+        }
+        /* Keep I away from the instruction under test */
+        a->iRegister = b->iRegister = 0x800 + (rand() & 0x3FF);
+        a->stackSize = b->stackSize = 2 + rand() % 3;
+        for(size_t i = 0; i < a->stackSize; i++)
+                a->stack[i] = b->stack[i] = (rand() & 0x7FF) * 2;
+        for(size_t i = 0x800; i < 4096; i++)
+                a->mem[i] = b->mem[i] = rand();
+}
+
+static void assert_same(uint16_t ins){
+        for(int i = 0; i < 16; i++)
+                ck_assert_msg(a->registers[i] == b->registers[i], "V%X differs for %04x", i, ins);
+        ck_assert_msg(a->pc == b->pc, "pc differs for %04x", ins);
+        ck_assert_msg(a->iRegister == b->iRegister, "I differs for %04x", ins);
+        ck_assert_msg(a->stackSize == b->stackSize, "stack differs for %04x", ins);
+        ck_assert_msg(memcmp(a->mem, b->mem, sizeof(a->mem)) == 0, "memory differs for %04x", ins);
+        ck_assert_msg(memcmp(a->disp, b->disp, sizeof(a->disp)) == 0, "display differs for %04x", ins);
+}
+
+/* Every instruction run from the cache must do exactly what
+ * run_instruction does */
+START_TEST(test_decode_matches_run_instruction){
+        for(int n = 0; n < 20000; n++){
+                uint16_t ins = rand();
+                uint8_t sopc = ins & 0xF;
+                /* Skip the instructions that wait, use the random number
+                 * generator, or are invalid */
+                if((ins & 0xF0FF) == 0xF00A || (ins >> 12) == 0xC)
+                        continue;
+                if((ins >> 12) == 0x5 && sopc != 0)
+                        continue;
+                if((ins >> 12) == 0x8 && sopc > 0x7 && sopc != 0xE)
+                        continue;
+                randomize();
+                /* Key codes must be valid */
+                if((ins >> 12) == 0xE)
+                        a->registers[(ins >> 8) & 0xF] = b->registers[(ins >> 8) & 0xF] &= 0xF;
+                a->pc = b->pc = 0x200;
+                a->mem[0x200] = b->mem[0x200] = ins >> 8;
+                a->mem[0x201] = b->mem[0x201] = ins & 0xFF;
+                decode_invalidate(b, 0x200, 2);
+                run_instruction(a, ins);
+                decode_execute(b);
+                assert_same(ins);
+                /* Run it again from the now decoded entry */
+                a->pc = b->pc = 0x200;
+                run_instruction(a, ins);
+                decode_execute(b);
+                assert_same(ins);
+        }
+}
+END_TEST
+
+/* Writing over an instruction that has already been decoded must cause it
+ * to be decoded again */
+START_TEST(test_decode_self_modifying){
+        static const uint8_t prog[] = {
+                0x23, 0x00,     /* call 0x300 */
+                0x60, 0x61,     /* V0 = 0x61 */
+                0x61, 0x42,     /* V1 = 0x42 */
+                0xA3, 0x00,     /* I = 0x300 */
+                0xF1, 0x55,     /* 0x300 = 0x6142, V1 = 0x42 */
+                0x61, 0x00,     /* V1 = 0 */
+                0x23, 0x00,     /* call 0x300 */
+                0x12, 0x0E      /* loop */
+        };
+        memcpy(a->mem + 0x200, prog, sizeof(prog));
+        /* V1 = 0x55, return */
+        a->mem[0x300] = 0x61;
+        a->mem[0x301] = 0x55;
+        a->mem[0x302] = 0x00;
+        a->mem[0x303] = 0xEE;
+
+        chip8_run_headless(a, 3, 0);
+        ck_assert_uint_eq(a->registers[0x1], 0x55);
+        chip8_run_headless(a, 100, 0);
+        ck_assert_uint_eq(a->pc, 0x20E);
+        ck_assert_uint_eq(a->registers[0x1], 0x42);
+
+        /* BCD writes invalidate as well, 0xF0 is stored as 2 4 0 */
+        a->mem[0x400] = 0x00;
+        a->mem[0x401] = 0x00;
+        a->mem[0x402] = 0x00;
+        a->pc = 0x400;
+        decode_execute(a);
+        a->registers[0x2] = 240;
+        a->iRegister = 0x400;
+        run_instruction(a, 0xF233);
+        ck_assert_uint_eq(a->mem[0x400], 2);
+        a->pc = 0x400;
+        decode_execute(a);
+        /* 0x0204 is a jump to 0x204 */
+        ck_assert_uint_eq(a->pc, 0x204);
+}
+END_TEST
+
+/* Builds a random program out of the instructions that neither wait,
+ * draw, read keys, nor use the random number generator. I is kept inside memory, and
+ * away from the program, test_decode_self_modifying covers rewriting it */
+static void random_program(struct mState *ms, uint16_t start, uint16_t end){
+        static const uint16_t templates[] = {
+                0x1000, 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0x8000,
+                0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007,
+                0x800E, 0x9000, 0xA000, 0xF007, 0xF015,
+                0xF018, 0xF033, 0xF055, 0xF065
+        };
+        for(uint16_t addr = start; addr < end; addr += 2){
+                uint16_t t = templates[rand() % (sizeof(templates) / sizeof(templates[0]))];
+                uint16_t ins = t;
+                switch(t >> 12){
+                        case 0x1:
+                                ins |= start + (rand() % ((end - start) / 2)) * 2;
+                                break;
+                        case 0xA:
+                                ins |= 0x600 + (rand() % 0x300);
+                                break;
+                        case 0x3: case 0x4: case 0x6: case 0x7:
+                                ins |= rand() & 0xFFF;
+                                break;
+                        case 0x5: case 0x8: case 0x9:
+                                ins |= rand() & 0xFF0;
+                                break;
+                        default:
+                                ins |= rand() & 0xF00;
+                                break;
+                }
+                ms->mem[addr] = ins >> 8;
+                ms->mem[addr + 1] = ins & 0xFF;
+        }
+        /* Loop back to the start at the end, twice in case the last
+         * instruction skips */
+        for(uint16_t addr = end; addr < end + 4; addr += 2){
+                ms->mem[addr] = 0x10 | (start >> 8);
+                ms->mem[addr + 1] = start & 0xFF;
+        }
+}
+
+/* A chip running batches with the configured engine must end up in the
+ * same state as one stepped through run_instruction */
+static void batch_matches_step(void){
+        for(int n = 0; n < 20; n++){
+                randomize();
+                random_program(a, 0x200, 0x400);
+                memcpy(b->mem, a->mem, sizeof(a->mem));
+                a->pc = b->pc = 0x200;
+                a->iRegister = b->iRegister = 0x600;
+                decode_invalidate_all(a);
+                for(int i = 0; i < 5000; i++){
+                        chip8_run_batch(a, 1);
+                        run_instruction(b, ((uint16_t) b->mem[b->pc]) << 8 | b->mem[b->pc + 1]);
+                        assert_same(i);
+                        /* FX55 and FX65 move I by up to 16 each, keep a
+                         * whole batch of them inside memory */
+                        if(a->iRegister > 0x900)
+                                a->iRegister = b->iRegister = 0x600;
+                }
+                /* and in longer batches, which engines may run in blocks */
+                memcpy(a->registers, b->registers, sizeof(a->registers));
+                a->pc = b->pc;
+                a->iRegister = b->iRegister = 0x600;
+                a->stackSize = b->stackSize;
+                decode_invalidate_all(a);
+                for(int i = 0; i < 200; i++){
+                        uint64_t len = 1 + rand() % 100;
+                        ck_assert_uint_eq(chip8_run_batch(a, len), len);
+                        for(uint64_t j = 0; j < len; j++)
+                                run_instruction(b, ((uint16_t) b->mem[b->pc]) << 8 | b->mem[b->pc + 1]);
+                        assert_same(i);
+                        /* FX55 and FX65 move I by up to 16 each, keep a
+                         * whole batch of them inside memory */
+                        if(a->iRegister > 0x900)
+                                a->iRegister = b->iRegister = 0x600;
+                }
+        }
+}
+
+START_TEST(test_decode_batch_matches_step){
+        batch_matches_step();
+}
+END_TEST
+
+#ifdef CHIP8_JIT_CORE
+/* A JIT build that could not map its code buffer interprets instead */
+START_TEST(test_decode_batch_without_jit){
+        jit_destroy(&a->jit);
+        ck_assert_ptr_null(a->jit);
+        batch_matches_step();
+}
+END_TEST
+#endif
+
+Suite *decode_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("decode");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_decode_matches_run_instruction);
+        tcase_add_test(tc, test_decode_self_modifying);
+        tcase_add_test(tc, test_decode_batch_matches_step);
+#ifdef CHIP8_JIT_CORE
+        tcase_add_test(tc, test_decode_batch_without_jit);
+#endif
+        tcase_add_checked_fixture(tc, decode_setup, decode_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
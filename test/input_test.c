@@ -0,0 +1,163 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "input_test.h"
+
+#include "../src/chip8.h"
+#include "../src/input.h"
+
+static struct mState *ms;
+static struct mState *replayed;
+static char file[] = "/tmp/chip8_inputXXXXXX";
+
+/* Waits for a key, then adds random numbers to V2 while it is held,
+ * counting them in V3 */
+static const uint8_t prog[] = {
+        0xF0, 0x0A,     /* V0 = key */
+        0xC1, 0xFF,     /* V1 = rand */
+        0x82, 0x14,     /* V2 += V1 */
+        0xE0, 0x9E,     /* skip if key V0 is held */
+        0x12, 0x00,     /* jump 0x200 */
+        0x73, 0x01,     /* V3 += 1 */
+        0x12, 0x02,     /* jump 0x202 */
+};
+
+void input_setup(void){
+        ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        replayed = chip8_init_headless();
+        ck_assert_ptr_nonnull(replayed);
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        memcpy(replayed->mem + 0x200, prog, sizeof(prog));
+        ms->insPerFrame = 7;
+        chip8_seed(ms, 1234);
+        chip8_seed(replayed, 99);
+        strcpy(file, "/tmp/chip8_inputXXXXXX");
+        int fd = mkstemp(file);
+        ck_assert_int_ne(fd, -1);
+        close(fd);
+}
+
+void input_teardown(void){
+        unlink(file);
+        chip8_destroy(&ms);
+        chip8_destroy(&replayed);
+}
+
+static void key(struct mState *ms, enum keyEventType type, uint8_t k){
+        struct keyEvent ke = { .type = type, .key = k };
+        chip8_key_event_notify(ms, ke);
+}
+
+/* A replay ends up exactly where the recording did, with the seed and
+ * clock of the recording */
+START_TEST(test_input_round_trip){
+        ms->input = input_record(ms, file);
+        ck_assert_ptr_nonnull(ms->input);
+        chip8_run_headless(ms, 0, 3);
+        key(ms, Pressed, 0x5);
+        /* Not applied until the chip runs again */
+        ck_assert_uint_eq(ms->keys[0x5], 0);
+        chip8_run_headless(ms, 0, 2);
+        ck_assert_uint_eq(ms->keys[0x5], 1);
+        key(ms, Released, 0x5);
+        chip8_run_headless(ms, 13, 0);
+        key(ms, Pressed, 0xA);
+        chip8_run_headless(ms, 0, 4);
+        key(ms, Released, 0xA);
+        key(ms, Pressed, 0x1);
+        chip8_run_headless(ms, 0, 2);
+        ck_assert_uint_eq(ms->input->events, 5);
+        input_close(&ms->input);
+        ck_assert_uint_ne(ms->registers[0x3], 0);
+
+        replayed->input = input_replay(replayed, file);
+        ck_assert_ptr_nonnull(replayed->input);
+        ck_assert_uint_eq(replayed->insPerFrame, 7);
+        chip8_run_headless(replayed, ms->count, 0);
+        ck_assert_uint_eq(replayed->input->events, 5);
+        input_close(&replayed->input);
+
+        ck_assert_uint_eq(replayed->count, ms->count);
+        ck_assert_uint_eq(replayed->pc, ms->pc);
+        ck_assert_uint_eq(replayed->rngState, ms->rngState);
+        ck_assert_uint_eq(replayed->dTimer, ms->dTimer);
+        ck_assert_mem_eq(replayed->registers, ms->registers, 16);
+        ck_assert_mem_eq(replayed->keys, ms->keys, 16);
+}
+END_TEST
+
+/* While replaying the log owns the keyboard */
+START_TEST(test_input_replay_ignores_keys){
+        ms->input = input_record(ms, file);
+        ck_assert_ptr_nonnull(ms->input);
+        chip8_run_headless(ms, 0, 1);
+        input_close(&ms->input);
+
+        replayed->input = input_replay(replayed, file);
+        ck_assert_ptr_nonnull(replayed->input);
+        key(replayed, Pressed, 0x2);
+        chip8_run_headless(replayed, 0, 1);
+        ck_assert_uint_eq(replayed->keys[0x2], 0);
+        ck_assert_uint_eq(replayed->input->dropped, 1);
+        input_close(&replayed->input);
+}
+END_TEST
+
+START_TEST(test_input_rejects_bad_logs){
+        ms->input = input_record(ms, file);
+        ck_assert_ptr_nonnull(ms->input);
+        key(ms, Pressed, 0x5);
+        chip8_run_headless(ms, 0, 1);
+        input_close(&ms->input);
+
+        /* Another program */
+        replayed->mem[0x200] ^= 1;
+        ck_assert_ptr_null(input_replay(replayed, file));
+        replayed->mem[0x200] ^= 1;
+
+        /* Cut off in the middle of an event */
+        ck_assert_int_eq(truncate(file, 25), 0);
+        ck_assert_ptr_null(input_replay(replayed, file));
+
+        /* Not a log at all */
+        ck_assert_int_eq(truncate(file, 8), 0);
+        ck_assert_ptr_null(input_replay(replayed, file));
+        unlink(file);
+        ck_assert_ptr_null(input_replay(replayed, file));
+}
+END_TEST
+
+Suite *input_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("input");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_input_round_trip);
+        tcase_add_test(tc, test_input_replay_ignores_keys);
+        tcase_add_test(tc, test_input_rejects_bad_logs);
+        tcase_add_checked_fixture(tc, input_setup, input_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
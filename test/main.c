@@ -19,8 +19,18 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "audio_test.h"
+#include "batch_test.h"
+#include "capture_test.h"
 #include "chip8_test.h"
+#include "decode_test.h"
+#include "input_test.h"
+#include "profile_test.h"
+#include "rewind_test.h"
 #include "runtime_error_test.h"
+#include "savestate_test.h"
+#include "sched_test.h"
+#include "tribuf_test.h"
 
 
 int main(int argc, char **argv){
@@ -29,6 +39,16 @@ int main(int argc, char **argv){
         int number_failed;
 
         sr = srunner_create(chip8_suite());
+        srunner_add_suite(sr, decode_suite());
+        srunner_add_suite(sr, sched_suite());
+        srunner_add_suite(sr, batch_suite());
+        srunner_add_suite(sr, savestate_suite());
+        srunner_add_suite(sr, rewind_suite());
+        srunner_add_suite(sr, capture_suite());
+        srunner_add_suite(sr, audio_suite());
+        srunner_add_suite(sr, profile_suite());
+        srunner_add_suite(sr, input_suite());
+        srunner_add_suite(sr, tribuf_suite());
         srunner_add_suite(sr, runtime_error_suite());
         srunner_run_all(sr, CK_NORMAL);
         number_failed = srunner_ntests_failed(sr);
@@ -0,0 +1,147 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile_test.h"
+
+#include "../src/chip8.h"
+#include "../src/profile.h"
+
+static struct mState *ms;
+static struct profile *p;
+
+void profile_setup(void){
+        ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+}
+
+void profile_teardown(void){
+        profile_destroy(&p);
+        ck_assert_ptr_null(p);
+        chip8_destroy(&ms);
+}
+
+/* Counts, and executes n instructions. The chip has no profile attached,
+ * so profiling builds do not count them twice */
+static void run(uint64_t n){
+        for(uint64_t i = 0; i < n; i++){
+                profile_step(p, ms);
+                chip8_step(ms);
+        }
+}
+
+START_TEST(test_profile_classify){
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00E0)), "00E0");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00EE)), "00EE");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x0123)), "0NNN");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00C4)), "00CN");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00FB)), "00FB");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00FD)), "00FD");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00FF)), "00FF");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x00FA)), "0NNN");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x2ABC)), "2NNN");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x8AB4)), "8XY4");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x8ABE)), "8XYE");
+        ck_assert_str_eq(profile_class_name(profile_classify(0x8AB9)), "????");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xD125)), "DXYN");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xE3A1)), "EXA1");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xE3A2)), "????");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xF365)), "FX65");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xF330)), "FX30");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xF375)), "FX75");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xF385)), "FX85");
+        ck_assert_str_eq(profile_class_name(profile_classify(0xF366)), "????");
+}
+END_TEST
+
+/* Calls 0x206 twice, which calls 0x20C, then spins */
+static const uint8_t prog[] = {
+        0x22, 0x06,     /* call 0x206 */
+        0x22, 0x06,     /* call 0x206 */
+        0x12, 0x04,     /* jump 0x204 */
+        0x22, 0x0C,     /* call 0x20C */
+        0x00, 0xEE,     /* return */
+        0x00, 0x00,
+        0x60, 0x01,     /* V0 = 1 */
+        0x00, 0xEE,     /* return */
+};
+
+START_TEST(test_profile_call_tree){
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        p = profile_init(ms);
+        ck_assert_ptr_nonnull(p);
+        run(12);
+
+        ck_assert_uint_eq(p->total, 12);
+        ck_assert_uint_eq(p->classes[PROF_CALL], 4);
+        ck_assert_uint_eq(p->classes[PROF_RET], 4);
+        ck_assert_uint_eq(p->classes[PROF_LD_IMM], 2);
+        ck_assert_uint_eq(p->classes[PROF_JP], 2);
+        ck_assert_uint_eq(p->pcs[0x204], 2);
+        ck_assert_uint_eq(p->pcs[0x20C], 2);
+        ck_assert_uint_eq(p->nodeCount, 3);
+        ck_assert_uint_eq(p->current, 0);
+
+        char *out = NULL;
+        size_t len = 0;
+        FILE *fp = open_memstream(&out, &len);
+        ck_assert_int_eq(profile_write_folded(p, fp), 0);
+        fclose(fp);
+        ck_assert_str_eq(out, "0x200 4\n0x200;0x206 4\n0x200;0x206;0x20c 4\n");
+        free(out);
+}
+END_TEST
+
+/* Returns from a subroutine entered before profiling began are counted,
+ * but leave the tree alone */
+START_TEST(test_profile_unmatched_return){
+        ms->mem[0x300] = 0x00;
+        ms->mem[0x301] = 0xEE;
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        ms->stack[0] = 0x200;
+        ms->stackSize = 1;
+        ms->pc = 0x300;
+        p = profile_init(ms);
+        ck_assert_ptr_nonnull(p);
+        run(4);
+        ck_assert_uint_eq(p->unmatched, 1);
+        ck_assert_uint_eq(p->nodeCount, 3);
+        ck_assert_uint_eq(p->nodes[0].addr, 0x300);
+        ck_assert_uint_eq(p->nodes[0].self, 2);
+        ck_assert_uint_eq(p->nodes[1].addr, 0x206);
+        ck_assert_uint_eq(p->nodes[1].self, 1);
+        ck_assert_uint_eq(p->current, 2);
+}
+END_TEST
+
+Suite *profile_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("profile");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_profile_classify);
+        tcase_add_test(tc, test_profile_call_tree);
+        tcase_add_test(tc, test_profile_unmatched_return);
+        tcase_add_checked_fixture(tc, profile_setup, profile_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
@@ -0,0 +1,172 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind_test.h"
+
+#include "../src/chip8.h"
+#include "../src/rewind.h"
+
+static struct mState *ms;
+static struct mState *ref;
+static struct rewind *rw;
+
+void rewind_setup(void){
+        ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        ref = chip8_init_headless();
+        ck_assert_ptr_nonnull(ref);
+        rw = rewind_init(ms, REWIND_DEFAULT_BUDGET, 16);
+        ck_assert_ptr_nonnull(rw);
+        ms->rewind = rw;
+}
+
+void rewind_teardown(void){
+        chip8_destroy(&ms);
+        chip8_destroy(&ref);
+        rewind_destroy(&rw);
+}
+
+/* Draws random sprites, and keeps the timers, stack and memory changing */
+static const uint8_t prog[] = {
+        0x22, 0x06,     /* call 0x206 */
+        0x12, 0x00,     /* jump 0x200 */
+        0x00, 0x00,
+        0xC0, 0x3F,     /* V0 = rand & 0x3F */
+        0xC1, 0x1F,     /* V1 = rand & 0x1F */
+        0xF0, 0x29,     /* I = sprite V0 */
+        0xD0, 0x15,     /* draw V0, V1 */
+        0x72, 0x03,     /* V2 += 3 */
+        0xF2, 0x15,     /* delay timer = V2 */
+        0xA3, 0x00,     /* I = 0x300 */
+        0xF2, 0x55,     /* 0x300 = V0-V2 */
+        0x00, 0xEE      /* return */
+};
+
+static void load(struct mState *chip){
+        memcpy(chip->mem + 0x200, prog, sizeof(prog));
+        chip8_seed(chip, 99);
+}
+
+/* ms must be where ref is after running count instructions from boot */
+static void assert_at(uint64_t count){
+        chip8_destroy(&ref);
+        ref = chip8_init_headless();
+        load(ref);
+        chip8_run_headless(ref, count, 0);
+        ck_assert_uint_eq(ms->count, count);
+        ck_assert_int_eq(ms->pc, ref->pc);
+        ck_assert_uint_eq(ms->iRegister, ref->iRegister);
+        ck_assert_uint_eq(ms->dTimer, ref->dTimer);
+        ck_assert_uint_eq(ms->rngState, ref->rngState);
+        ck_assert_uint_eq(ms->stackSize, ref->stackSize);
+        ck_assert(memcmp(ms->registers, ref->registers, sizeof(ms->registers)) == 0);
+        ck_assert(memcmp(ms->disp, ref->disp, sizeof(ms->disp)) == 0);
+        ck_assert(memcmp(ms->mem, ref->mem, sizeof(ms->mem)) == 0);
+}
+
+/* Rewinding to any instruction gives the machine a run from boot stopped
+ * there would have, across keyframes and part way through frames */
+START_TEST(test_rewind_to){
+        load(ms);
+        chip8_run_headless(ms, 0, 200);
+        uint64_t count = ms->count;
+        for(int n = 0; n < 20; n++){
+                count -= rand() % 97;
+                ck_assert_ptr_null(rewind_to(rw, ms, count));
+                ck_assert_uint_lt(rw->lastReplayed, ms->insPerFrame);
+                assert_at(count);
+        }
+        /* The history carries on from the point rewound to. Frames start
+         * where a run starts, so go back to a frame boundary to stay in step
+         * with a run from boot */
+        ck_assert_ptr_null(rewind_to(rw, ms, count - count % ms->insPerFrame));
+        chip8_run_headless(ms, 0, 50);
+        count = ms->count;
+        ck_assert_ptr_null(rewind_to(rw, ms, count - 333));
+        assert_at(count - 333);
+}
+END_TEST
+
+/* Stepping back one instruction at a time retraces the run */
+START_TEST(test_rewind_step_back){
+        load(ms);
+        chip8_run_headless(ms, 0, 40);
+        uint64_t count = ms->count;
+        for(int n = 1; n <= 25; n++){
+                ck_assert_ptr_null(rewind_step_back(rw, ms, 1));
+                assert_at(count - n);
+        }
+}
+END_TEST
+
+/* The history stays within its budget by forgetting its oldest frames */
+START_TEST(test_rewind_budget){
+        struct runtime_error *re;
+        rewind_destroy(&rw);
+        rw = rewind_init(ms, 16 * 1024, 16);
+        ck_assert_ptr_nonnull(rw);
+        ms->rewind = rw;
+        load(ms);
+        chip8_run_headless(ms, 0, 2000);
+        ck_assert_uint_le(rw->bytes, rw->budget);
+        ck_assert_uint_gt(rw->size, 1);
+        ck_assert_uint_eq(rw->captures, 2000);
+
+        re = rewind_to(rw, ms, 100);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        re = rewind_to(rw, ms, ms->count + 1);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        ck_assert_uint_eq(ms->count, 20000);
+
+        ck_assert_ptr_null(rewind_to(rw, ms, 19000));
+        assert_at(19000);
+}
+END_TEST
+
+/* Re-executing is only repeatable on the virtual clock */
+START_TEST(test_rewind_needs_virtual_clock){
+        load(ms);
+        chip8_run_headless(ms, 0, 10);
+        ms->insPerFrame = 0;
+        struct runtime_error *re = rewind_to(rw, ms, 50);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        ck_assert_uint_eq(ms->count, 100);
+}
+END_TEST
+
+Suite *rewind_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("rewind");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_rewind_to);
+        tcase_add_test(tc, test_rewind_step_back);
+        tcase_add_test(tc, test_rewind_budget);
+        tcase_add_test(tc, test_rewind_needs_virtual_clock);
+        tcase_add_checked_fixture(tc, rewind_setup, rewind_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
@@ -0,0 +1,286 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "savestate_test.h"
+
+#include "../src/chip8.h"
+#include "../src/savestate.h"
+
+static struct mState *ms;
+static struct mState *restored;
+static uint8_t buf[8192];
+
+void savestate_setup(void){
+        ms = chip8_init_headless();
+        ck_assert_ptr_nonnull(ms);
+        restored = chip8_init_headless();
+        ck_assert_ptr_nonnull(restored);
+}
+
+void savestate_teardown(void){
+        chip8_destroy(&ms);
+        chip8_destroy(&restored);
+}
+
+/* Calls a subroutine that draws a random sprite, and counts down the delay
+ * timer, so every part of the machine changes */
+static const uint8_t prog[] = {
+        0x22, 0x06,     /* call 0x206 */
+        0x12, 0x00,     /* jump 0x200 */
+        0x00, 0x00,
+        0x22, 0x0A,     /* call 0x20A */
+        0x00, 0xEE,     /* return */
+        0xC0, 0x3F,     /* V0 = rand & 0x3F */
+        0xC1, 0x1F,     /* V1 = rand & 0x1F */
+        0xF0, 0x29,     /* I = sprite V0 */
+        0xD0, 0x15,     /* draw V0, V1 */
+        0x72, 0x03,     /* V2 += 3 */
+        0xF2, 0x15,     /* delay timer = V2 */
+        0xA3, 0x00,     /* I = 0x300 */
+        0xF2, 0x55,     /* 0x300 = V0-V2 */
+        0x60, 0x00,     /* V0 = 0 */
+        0xF0, 0x07,     /* V0 = delay timer */
+        0x00, 0xEE      /* return */
+};
+
+static void assert_same(struct mState *a, struct mState *b){
+        ck_assert_uint_eq(a->count, b->count);
+        ck_assert_int_eq(a->pc, b->pc);
+        ck_assert_uint_eq(a->iRegister, b->iRegister);
+        ck_assert_uint_eq(a->dTimer, b->dTimer);
+        ck_assert_uint_eq(a->sTimer, b->sTimer);
+        ck_assert_uint_eq(a->rngState, b->rngState);
+        ck_assert_uint_eq(a->stackSize, b->stackSize);
+        ck_assert(memcmp(a->stack, b->stack, a->stackSize * sizeof(int16_t)) == 0);
+        ck_assert(memcmp(a->registers, b->registers, sizeof(a->registers)) == 0);
+        ck_assert(memcmp(a->keys, b->keys, sizeof(a->keys)) == 0);
+        ck_assert(memcmp(a->disp, b->disp, sizeof(a->disp)) == 0);
+        ck_assert_uint_eq(a->hires, b->hires);
+        ck_assert(memcmp(a->rplFlags, b->rplFlags, sizeof(a->rplFlags)) == 0);
+        ck_assert(memcmp(a->mem, b->mem, sizeof(a->mem)) == 0);
+}
+
+/* A restored chip carries on exactly as the one that was saved */
+START_TEST(test_savestate_round_trip){
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        chip8_seed(ms, 1234);
+        ms->keys[0x5] = 1;
+        /* Stop part way through the subroutine so the stack is not empty */
+        chip8_run_headless(ms, 0, 30);
+        chip8_run_headless(ms, 7, 0);
+        ck_assert_uint_ne(ms->stackSize, 0);
+
+        size_t len = chip8_state_size(ms);
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+        ck_assert_ptr_null(chip8_load_state(restored, buf, len));
+        assert_same(ms, restored);
+
+        chip8_run_headless(ms, 0, 30);
+        chip8_run_headless(restored, 0, 30);
+        assert_same(ms, restored);
+}
+END_TEST
+
+/* The 128x64 display, and the SUPER-CHIP flags are kept */
+START_TEST(test_savestate_hires){
+        run_instruction(ms, 0x00FF);
+        ms->registers[0x0] = 100;
+        ms->registers[0x1] = 60;
+        run_instruction(ms, 0xD010);
+        run_instruction(ms, 0xF175);
+        ck_assert_uint_ne(ms->disp[63][1], 0);
+
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+        ck_assert_ptr_null(chip8_load_state(restored, buf, chip8_state_size(ms)));
+        assert_same(ms, restored);
+        ck_assert_uint_eq(restored->rplFlags[0x1], 60);
+}
+END_TEST
+
+/* A version 1 state, with the 64x32 display a word a line, and no mode
+ * or flags, loads in the 64x32 mode. One is made from a version 2 state
+ * of the same chip */
+START_TEST(test_savestate_version_1){
+        static uint8_t old[8192];
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        chip8_run_headless(ms, 0, 30);
+        chip8_run_headless(ms, 7, 0);
+        ck_assert_uint_ne(ms->stackSize, 0);
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+
+        /* Header, then count to keys, 64 bytes in all, are the same */
+        size_t n = 64;
+        memcpy(old, buf, n);
+        for(int y = 0; y < 32; y++, n += 8)
+                memcpy(old + n, buf + 64 + y * 16, 8);
+        /* After the display, the mode, and the flags, memory and stack */
+        size_t rest = chip8_state_size(ms) - 4 - (64 + 64 * 16 + 1 + 16);
+        memcpy(old + n, buf + 64 + 64 * 16 + 1 + 16, rest);
+        n += rest + 4;
+        old[4] = 1;
+        old[8] = n & 0xFF;
+        old[9] = n >> 8;
+        chip8_state_seal(old);
+
+        run_instruction(restored, 0x00FF);
+        restored->disp[40][1] = 1;
+        restored->rplFlags[0x2] = 7;
+        ck_assert_ptr_null(chip8_load_state(restored, old, n));
+        assert_same(ms, restored);
+
+        chip8_run_headless(ms, 0, 30);
+        chip8_run_headless(restored, 0, 30);
+        assert_same(ms, restored);
+}
+END_TEST
+
+/* Restoring replaces code the predecoded cache has already seen */
+START_TEST(test_savestate_replaces_code){
+        static const uint8_t inc[] = {0x70, 0x01, 0x12, 0x00};
+        static const uint8_t dec[] = {0x70, 0xFF, 0x12, 0x00};
+        memcpy(ms->mem + 0x200, inc, sizeof(inc));
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+        memcpy(restored->mem + 0x200, dec, sizeof(dec));
+        chip8_run_headless(restored, 10, 0);
+        ck_assert_uint_eq(restored->registers[0x0], 0xFB);
+
+        ck_assert_ptr_null(chip8_load_state(restored, buf, chip8_state_size(ms)));
+        chip8_run_headless(restored, 10, 0);
+        ck_assert_uint_eq(restored->registers[0x0], 5);
+}
+END_TEST
+
+/* A damaged state is refused, and leaves the chip as it was */
+START_TEST(test_savestate_rejects_bad_states){
+        struct runtime_error *re;
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        chip8_run_headless(ms, 0, 5);
+        size_t len = chip8_state_size(ms);
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+        restored->registers[0x3] = 0x42;
+
+        /* Too small a buffer to save into */
+        re = chip8_save_state(ms, buf, len - 1);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+
+        /* Truncated */
+        re = chip8_load_state(restored, buf, len - 1);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+
+        /* A flipped bit */
+        buf[1000] ^= 0x10;
+        re = chip8_load_state(restored, buf, len);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        buf[1000] ^= 0x10;
+
+        /* Another version */
+        buf[4]++;
+        re = chip8_load_state(restored, buf, len);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        buf[4]--;
+
+        /* Not a state at all */
+        buf[0] = 'X';
+        re = chip8_load_state(restored, buf, len);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+
+        ck_assert_uint_eq(restored->registers[0x3], 0x42);
+        ck_assert_uint_eq(restored->count, 0);
+}
+END_TEST
+
+/* A PC, or return address outside memory is refused, even with a good
+ * checksum */
+START_TEST(test_savestate_rejects_bad_addresses){
+        struct runtime_error *re;
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        chip8_run_headless(ms, 0, 30);
+        chip8_run_headless(ms, 7, 0);
+        ck_assert_uint_ne(ms->stackSize, 0);
+        size_t len = chip8_state_size(ms);
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+        restored->registers[0x3] = 0x42;
+
+        /* The PC is 12 bytes in, after the header, and the count */
+        buf[20] = 0xFF;
+        buf[21] = 0xFF;
+        chip8_state_seal(buf);
+        re = chip8_load_state(restored, buf, len);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        ck_assert_ptr_null(chip8_save_state(ms, buf, sizeof(buf)));
+
+        /* The stack is last, before the checksum */
+        buf[len - 6] = 0x00;
+        buf[len - 5] = 0x10;
+        chip8_state_seal(buf);
+        re = chip8_load_state(restored, buf, len);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+
+        ck_assert_uint_eq(restored->registers[0x3], 0x42);
+        ck_assert_int_eq(restored->pc, 0x200);
+}
+END_TEST
+
+START_TEST(test_savestate_file){
+        char file[] = "/tmp/chip8_stateXXXXXX";
+        int fd = mkstemp(file);
+        ck_assert_int_ne(fd, -1);
+        close(fd);
+
+        memcpy(ms->mem + 0x200, prog, sizeof(prog));
+        chip8_run_headless(ms, 0, 12);
+        ck_assert_ptr_null(chip8_save_state_file(ms, file));
+        ck_assert_ptr_null(chip8_load_state_file(restored, file));
+        assert_same(ms, restored);
+        unlink(file);
+
+        struct runtime_error *re = chip8_load_state_file(restored, file);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+}
+END_TEST
+
+Suite *savestate_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("savestate");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_savestate_round_trip);
+        tcase_add_test(tc, test_savestate_hires);
+        tcase_add_test(tc, test_savestate_version_1);
+        tcase_add_test(tc, test_savestate_replaces_code);
+        tcase_add_test(tc, test_savestate_rejects_bad_states);
+        tcase_add_test(tc, test_savestate_rejects_bad_addresses);
+        tcase_add_test(tc, test_savestate_file);
+        tcase_add_checked_fixture(tc, savestate_setup, savestate_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
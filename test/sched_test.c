@@ -0,0 +1,182 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched_test.h"
+
+#include "../src/chip8.h"
+#include "../src/sched.h"
+
+#define CHIPS 64
+
+static struct scheduler *s;
+static struct mState *chips[CHIPS];
+
+void sched_setup(void){
+        s = sched_init(4, 0);
+        ck_assert_ptr_nonnull(s);
+        for(int i = 0; i < CHIPS; i++){
+                chips[i] = chip8_init_headless();
+                ck_assert_ptr_nonnull(chips[i]);
+        }
+}
+
+void sched_teardown(void){
+        sched_destroy(&s);
+        for(int i = 0; i < CHIPS; i++)
+                chip8_destroy(&chips[i]);
+}
+
+static void load(struct mState *ms, const uint8_t *prog, size_t len){
+        memcpy(ms->mem + 0x200, prog, len);
+}
+
+static void press(struct mState *ms, uint8_t key){
+        struct keyEvent ke;
+        ke.key = key;
+        ke.type = Pressed;
+        chip8_key_event_notify(ms, ke);
+}
+
+/* Count to 4 * 256, then wait for keys forever */
+static const uint8_t counter[] = {
+        0x70, 0x01,     /* V0 += 1 */
+        0x30, 0x00,     /* skip if V0 == 0 */
+        0x12, 0x00,     /* jump 0x200 */
+        0x71, 0x01,     /* V1 += 1 */
+        0x31, 0x04,     /* skip if V1 == 4 */
+        0x12, 0x00,     /* jump 0x200 */
+        0xF2, 0x0A,     /* V2 = key */
+        0x12, 0x0C      /* jump 0x20C */
+};
+
+/* Every chip runs to its FX0A and parks, a key press wakes it up to take
+ * the key, and it parks again at the next FX0A */
+START_TEST(test_sched_park_and_wake){
+        for(int i = 0; i < CHIPS; i++){
+                load(chips[i], counter, sizeof(counter));
+                ck_assert_ptr_null(sched_add(s, chips[i]));
+        }
+        sched_wait_idle(s);
+        for(int i = 0; i < CHIPS; i++){
+                ck_assert_uint_eq(chips[i]->schedState, SCHED_PARKED);
+                ck_assert_uint_eq(chips[i]->pc, 0x20C);
+                ck_assert_uint_eq(chips[i]->registers[0x0], 0);
+                ck_assert_uint_eq(chips[i]->registers[0x1], 4);
+                ck_assert_uint_eq(chips[i]->count, chips[0]->count);
+        }
+        ck_assert_uint_ge(atomic_load(&s->parks), CHIPS);
+
+        for(int i = 0; i < CHIPS; i++)
+                press(chips[i], i & 0xF);
+        sched_wait_idle(s);
+        for(int i = 0; i < CHIPS; i++){
+                ck_assert_uint_eq(chips[i]->schedState, SCHED_PARKED);
+                ck_assert_uint_eq(chips[i]->pc, 0x20C);
+                ck_assert_uint_eq(chips[i]->registers[0x2], i & 0xF);
+        }
+        ck_assert_uint_ge(atomic_load(&s->parks), 2 * CHIPS);
+
+        for(int i = 0; i < CHIPS; i++){
+                sched_remove(s, chips[i]);
+                ck_assert_uint_eq(chips[i]->schedState, SCHED_DONE);
+                ck_assert_ptr_null(chips[i]->sched);
+                ck_assert_uint_eq(chips[i]->running, 0);
+        }
+}
+END_TEST
+
+/* A chip that never stops is taken off by sched_remove */
+START_TEST(test_sched_remove){
+        static const uint8_t loop[] = {
+                0x70, 0x01,     /* V0 += 1 */
+                0x12, 0x00      /* jump 0x200 */
+        };
+        for(int i = 0; i < CHIPS; i++){
+                load(chips[i], loop, sizeof(loop));
+                ck_assert_ptr_null(sched_add(s, chips[i]));
+        }
+        for(int i = 0; i < CHIPS; i++){
+                sched_remove(s, chips[i]);
+                ck_assert_uint_eq(chips[i]->schedState, SCHED_DONE);
+                ck_assert_uint_eq(chips[i]->running, 0);
+        }
+        /* Removed chips stay where they were */
+        uint64_t count = chips[0]->count;
+        sched_wait_idle(s);
+        ck_assert_uint_eq(chips[0]->count, count);
+        ck_assert_uint_eq(chips[0]->count % CHIP8_DEFAULT_IPF, 0);
+}
+END_TEST
+
+/* A chip whose PC leaves memory is done, and only running chips are
+ * refused */
+START_TEST(test_sched_done){
+        static const uint8_t escape[] = {
+                0x1F, 0xFF      /* jump 0xFFF */
+        };
+        load(chips[0], escape, sizeof(escape));
+        ck_assert_ptr_null(sched_add(s, chips[0]));
+        sched_wait_idle(s);
+        ck_assert_uint_eq(chips[0]->schedState, SCHED_DONE);
+        ck_assert_ptr_null(chips[0]->sched);
+        ck_assert_uint_eq(chips[0]->pc, 0xFFF);
+        sched_remove(s, chips[0]);
+
+        chips[1]->running = 1;
+        struct runtime_error *re = sched_add(s, chips[1]);
+        ck_assert_ptr_nonnull(re);
+        runtime_error_destroy(&re);
+        chips[1]->running = 0;
+}
+END_TEST
+
+/* Chips left on the scheduler are taken off when it is destroyed */
+START_TEST(test_sched_destroy){
+        for(int i = 0; i < CHIPS; i++){
+                load(chips[i], counter, sizeof(counter));
+                ck_assert_ptr_null(sched_add(s, chips[i]));
+        }
+        sched_destroy(&s);
+        ck_assert_ptr_null(s);
+        for(int i = 0; i < CHIPS; i++){
+                ck_assert_uint_eq(chips[i]->schedState, SCHED_DONE);
+                ck_assert_ptr_null(chips[i]->sched);
+        }
+        /* Nothing is left to wake */
+        press(chips[0], 1);
+}
+END_TEST
+
+Suite *sched_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("sched");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_sched_park_and_wake);
+        tcase_add_test(tc, test_sched_remove);
+        tcase_add_test(tc, test_sched_done);
+        tcase_add_test(tc, test_sched_destroy);
+        tcase_add_checked_fixture(tc, sched_setup, sched_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}
@@ -0,0 +1,169 @@
+/* Copyright (C) 2017 David Jowett
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+#include <check.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tribuf_test.h"
+
+#include "../src/tribuf.h"
+
+#define FRAMES 200000
+
+static struct tribuf t;
+
+void tribuf_setup(void){
+        tribuf_init(&t);
+}
+
+void tribuf_teardown(void){
+}
+
+/* Every word of the display holds v */
+static void fill(uint64_t disp[TRIBUF_LINES][2], uint64_t v){
+        for(int i = 0; i < TRIBUF_LINES; i++)
+                disp[i][0] = disp[i][1] = v;
+}
+
+/* The value a complete display holds in every row, or 0 for a display
+ * that is part one, part another */
+static uint64_t value(uint64_t disp[TRIBUF_LINES][2]){
+        for(int i = 0; i < TRIBUF_LINES; i++)
+                if(disp[i][0] != disp[0][0] || disp[i][1] != disp[0][0])
+                        return 0;
+        return disp[0][0];
+}
+
+START_TEST(test_tribuf_latest){
+        uint64_t disp[TRIBUF_LINES][2];
+        ck_assert_int_eq(tribuf_acquire(&t), 0);
+        ck_assert_uint_eq(tribuf_front(&t)[0][0], 0);
+
+        fill(disp, 1);
+        tribuf_publish(&t, disp, UINT64_MAX, 0);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(value(tribuf_front(&t)), 1);
+        /* Nothing new, the front stays */
+        ck_assert_int_eq(tribuf_acquire(&t), 0);
+        ck_assert_uint_eq(value(tribuf_front(&t)), 1);
+
+        /* Only the newest of several is seen */
+        for(int v = 2; v <= 5; v++){
+                fill(disp, v);
+                tribuf_publish(&t, disp, UINT64_MAX, 0);
+        }
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(value(tribuf_front(&t)), 5);
+}
+END_TEST
+
+/* Only changed lines are passed on, and the reader hears of every line
+ * that changed since its last display, even in displays it skipped */
+START_TEST(test_tribuf_dirty){
+        uint64_t disp[TRIBUF_LINES][2] = {{0}};
+        disp[3][0] = 1;
+        tribuf_publish(&t, disp, 1u << 3, 0);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(tribuf_front_dirty(&t), 1u << 3);
+        ck_assert_mem_eq(tribuf_front(&t), disp, sizeof(disp));
+
+        disp[5][0] = 2;
+        tribuf_publish(&t, disp, 1u << 5, 0);
+        disp[7][1] = 3;
+        tribuf_publish(&t, disp, 1u << 7, 0);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(tribuf_front_dirty(&t), 1u << 5 | 1u << 7);
+        ck_assert_mem_eq(tribuf_front(&t), disp, sizeof(disp));
+
+        /* Every buffer has been behind by now */
+        for(uint64_t v = 4; v < 10; v++){
+                disp[v % 3][v & 1] = v;
+                tribuf_publish(&t, disp, 1u << (v % 3), 0);
+                ck_assert_int_eq(tribuf_acquire(&t), 1);
+                ck_assert_uint_eq(tribuf_front_dirty(&t), 1u << (v % 3));
+                ck_assert_mem_eq(tribuf_front(&t), disp, sizeof(disp));
+        }
+}
+END_TEST
+
+/* The mode goes with each display, and the lines below the first 32 are
+ * passed on like the others */
+START_TEST(test_tribuf_hires){
+        uint64_t disp[TRIBUF_LINES][2] = {{0}};
+        tribuf_publish(&t, disp, UINT64_MAX, 1);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(tribuf_front_hires(&t), 1);
+
+        disp[63][1] = 1;
+        tribuf_publish(&t, disp, 1ULL << 63, 1);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(tribuf_front_dirty(&t), 1ULL << 63);
+        ck_assert_uint_eq(tribuf_front_hires(&t), 1);
+        ck_assert_mem_eq(tribuf_front(&t), disp, sizeof(disp));
+
+        memset(disp, 0, sizeof(disp));
+        tribuf_publish(&t, disp, UINT64_MAX, 0);
+        ck_assert_int_eq(tribuf_acquire(&t), 1);
+        ck_assert_uint_eq(tribuf_front_hires(&t), 0);
+        ck_assert_mem_eq(tribuf_front(&t), disp, sizeof(disp));
+}
+END_TEST
+
+static void *writer(void *arg){
+        uint64_t disp[TRIBUF_LINES][2];
+        for(uint64_t f = 1; f <= FRAMES; f++){
+                fill(disp, f);
+                tribuf_publish(&t, disp, UINT64_MAX, 0);
+        }
+        return NULL;
+}
+
+/* A reader racing the writer only ever sees complete displays, in the order
+ * they were published, and ends on the last one */
+START_TEST(test_tribuf_concurrent){
+        pthread_t tid;
+        uint64_t last = 0;
+        ck_assert_int_eq(pthread_create(&tid, NULL, writer, NULL), 0);
+        while(last != FRAMES){
+                if(!tribuf_acquire(&t))
+                        continue;
+                uint64_t v = value(tribuf_front(&t));
+                ck_assert_uint_gt(v, last);
+                last = v;
+        }
+        pthread_join(tid, NULL);
+        ck_assert_int_eq(tribuf_acquire(&t), 0);
+}
+END_TEST
+
+Suite *tribuf_suite(void){
+        Suite *s;
+        TCase *tc;
+        s = suite_create("tribuf");
+
+        tc = tcase_create("core");
+
+        tcase_add_test(tc, test_tribuf_latest);
+        tcase_add_test(tc, test_tribuf_dirty);
+        tcase_add_test(tc, test_tribuf_hires);
+        tcase_add_test(tc, test_tribuf_concurrent);
+        tcase_add_checked_fixture(tc, tribuf_setup, tribuf_teardown);
+        suite_add_tcase(s, tc);
+
+        return s;
+}